@@ -54,7 +54,7 @@ tm.print_top_n_words(10)
 # Generate QASimilarity variable
 df['post_idx'] = df['post_idx'].astype(int)
 df['answer_idx'] = df['answer_idx'].astype(int)
-df['stablelda_sim'] = df.apply(lambda x: 1 - cosine(theta[x['post_idx']], theta[x['answer_idx']]), axis=1)
+df['stablelda_sim'] = pair_similarity(output_dir+'theta.dat', df['post_idx'], df['answer_idx'])
 
 # Run regression
 y, X = dmatrices('AnswerHepfulness ~ stablelda_sim + Sequence + QuestionHelpfulness + logwords', data=df, return_type='dataframe')
@@ -82,7 +82,7 @@ docs, vocab, theta, phi = load_topic_model_results(bow_file, vocab_file,
                                                    output_dir+'theta.dat', output_dir+'phi.dat')
 tm = TopicModel(num_topics, theta, phi, docs, vocab)
 
-df['stablelda_sim'] = df.apply(lambda x: 1 - cosine(theta[x['post_idx']], theta[x['answer_idx']]), axis=1)
+df['stablelda_sim'] = pair_similarity(output_dir+'theta.dat', df['post_idx'], df['answer_idx'])
 
 # Linear regression
 y, X = dmatrices('AnswerHepfulness ~ stablelda_sim + Sequence + QuestionHelpfulness + logwords', data=df, return_type='dataframe')
@@ -117,7 +117,7 @@ lda_theta = []
 for bow in gensimcorpus:
     prob = [i[1] for i in lda_model.get_document_topics(bow, minimum_probability=0)]
     lda_theta.append(prob)
-df['lda_sim'] = df.apply(lambda x: 1 - cosine(lda_theta[x['post_idx']], lda_theta[x['answer_idx']]), axis=1)
+df['lda_sim'] = pair_similarity(lda_theta, df['post_idx'], df['answer_idx'])
 
 # Linear regression
 y, X = dmatrices('AnswerHepfulness ~ lda_sim + Sequence + QuestionHelpfulness + logwords', data=df, return_type='dataframe')
@@ -138,7 +138,7 @@ lda_theta = []
 for bow in gensimcorpus:
     prob = [i[1] for i in lda_model.get_document_topics(bow, minimum_probability=0)]
     lda_theta.append(prob)
-df['lda_sim'] = df.apply(lambda x: 1 - cosine(lda_theta[x['post_idx']], lda_theta[x['answer_idx']]), axis=1)
+df['lda_sim'] = pair_similarity(lda_theta, df['post_idx'], df['answer_idx'])
 
 # Linear regression
 y, X = dmatrices('AnswerHepfulness ~ lda_sim + Sequence + QuestionHelpfulness + logwords', data=df, return_type='dataframe')
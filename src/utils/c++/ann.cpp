@@ -0,0 +1,523 @@
+#include "ann.h"
+
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <queue>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace utils;
+using namespace similarity;
+
+static const long long ANN_MAGIC = 0x4e4e4141444c5453LL; //"STLDAANN"
+static const long long ANN_VERSION = 1;
+static const int ANN_HEADER = 16; //long longs
+static const int LANES = 8;
+
+void AnnIndex::Visited::reset(int n){
+	if((int)marks.size() != n){
+		marks.assign(n, 0);
+		tag = 0;
+	}
+	if(++tag == 0){ //wrapped, stale marks could match again
+		fill(marks.begin(), marks.end(), 0);
+		tag = 1;
+	}
+}
+
+AnnIndex::AnnIndex(int M, int ef_construction, unsigned long long seed):
+		dim(0), M(M), ef_construction(ef_construction), ef_search(64), exact_below(20000),
+		num_docs(0), max_level(0), entry(-1), M0(2 * M), level_mult(1.0 / log((double)M)), rng(seed),
+		vecs(NULL), levels(NULL), links0(NULL), upper_off(NULL), upper(NULL), mapped(NULL), mapped_size(0),
+		locking(false), stripes(1 << 16){
+}
+
+AnnIndex::~AnnIndex(){
+	unmap();
+}
+
+void AnnIndex::attach(){
+	vecs = vecs_own.data();
+	levels = levels_own.data();
+	links0 = links0_own.data();
+	upper_off = upper_off_own.data();
+	upper = upper_own.data();
+}
+
+void AnnIndex::unmap(){
+#ifndef _WIN32
+	if(mapped != NULL)
+		munmap(mapped, mapped_size);
+#endif
+	mapped = NULL;
+	mapped_size = 0;
+}
+
+void AnnIndex::own(){
+	if(mapped == NULL)
+		return;
+	long long upper_size = num_docs > 0 ? upper_off[num_docs - 1] + levels[num_docs - 1] * (1 + M) : 0;
+	vecs_own.assign(vecs, vecs + (size_t)num_docs * dim);
+	levels_own.assign(levels, levels + num_docs);
+	links0_own.assign(links0, links0 + (size_t)num_docs * (1 + M0));
+	upper_off_own.assign(upper_off, upper_off + num_docs);
+	upper_own.assign(upper, upper + upper_size);
+	unmap();
+	attach();
+}
+
+int AnnIndex::random_level(){
+	return (int)(-log(1.0 - rng.uniform()) * level_mult);
+}
+
+void AnnIndex::to_vec(const double *theta_row, float *q) const{
+	for(int k = 0; k < dim; k++)
+		q[k] = sqrt(max(theta_row[k], 0.0));
+}
+
+void AnnIndex::append(const double *theta_row, int level){
+	size_t at = vecs_own.size();
+	vecs_own.resize(at + dim);
+	to_vec(theta_row, vecs_own.data() + at);
+	levels_own.push_back(level);
+	links0_own.resize(links0_own.size() + 1 + M0, 0);
+	upper_off_own.push_back(upper_own.size());
+	upper_own.resize(upper_own.size() + (size_t)level * (1 + M), 0);
+	num_docs++;
+	attach();
+}
+
+int *AnnIndex::links(int node, int level) const{
+	if(level == 0)
+		return links0 + (size_t)node * (1 + M0);
+	return upper + upper_off[node] + (size_t)(level - 1) * (1 + M);
+}
+
+float AnnIndex::dist(const float *q, int node) const{ //squared L2, in LANES partial sums
+	const float *v = vec(node);
+	float sum[LANES] = {0};
+	int k = 0;
+	for(; k + LANES <= dim; k += LANES)
+		for(int l = 0; l < LANES; l++){
+			float d = q[k + l] - v[k + l];
+			sum[l] += d * d;
+		}
+	for(; k < dim; k++){
+		float d = q[k] - v[k];
+		sum[0] += d * d;
+	}
+	return ((sum[0] + sum[1]) + (sum[2] + sum[3])) + ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+}
+
+unique_ptr<AnnIndex::Visited> AnnIndex::take_visited() const{
+	unique_ptr<Visited> v;
+	{
+		lock_guard<mutex> lock(pool_lock);
+		if(!pool.empty()){
+			v = move(pool.back());
+			pool.pop_back();
+		}
+	}
+	if(!v)
+		v.reset(new Visited());
+	v->reset(num_docs);
+	return v;
+}
+
+void AnnIndex::give_visited(unique_ptr<Visited> v) const{
+	lock_guard<mutex> lock(pool_lock);
+	pool.push_back(move(v));
+}
+
+int AnnIndex::greedy(const float *q, int ep, int level) const{
+	float best = dist(q, ep);
+	vector<int> nbs;
+	for(bool changed = true; changed; ){
+		changed = false;
+		int *l = links(ep, level);
+		if(locking){
+			lock_guard<mutex> lock(stripes[ep % stripes.size()]);
+			nbs.assign(l + 1, l + 1 + l[0]);
+		}else
+			nbs.assign(l + 1, l + 1 + l[0]);
+		for(size_t i = 0; i < nbs.size(); i++){
+			float d = dist(q, nbs[i]);
+			if(d < best){
+				best = d;
+				ep = nbs[i];
+				changed = true;
+			}
+		}
+	}
+	return ep;
+}
+
+vector<pair<float, int>> AnnIndex::search_layer(const float *q, int ep, int ef, int level) const{
+	unique_ptr<Visited> visited = take_visited();
+	vector<unsigned> &marks = visited->marks;
+	unsigned tag = visited->tag;
+
+	priority_queue<pair<float, int>, vector<pair<float, int>>, greater<pair<float, int>>> candidates;
+	priority_queue<pair<float, int>> results; //farthest on top
+	float d = dist(q, ep);
+	candidates.push(make_pair(d, ep));
+	results.push(make_pair(d, ep));
+	marks[ep] = tag;
+
+	vector<int> nbs;
+	while(!candidates.empty()){
+		pair<float, int> c = candidates.top();
+		if(c.first > results.top().first && (int)results.size() >= ef)
+			break;
+		candidates.pop();
+		int *l = links(c.second, level);
+		if(locking){
+			lock_guard<mutex> lock(stripes[c.second % stripes.size()]);
+			nbs.assign(l + 1, l + 1 + l[0]);
+		}else
+			nbs.assign(l + 1, l + 1 + l[0]);
+		for(size_t i = 0; i < nbs.size(); i++){
+			int e = nbs[i];
+			if(marks[e] == tag)
+				continue;
+			marks[e] = tag;
+			float de = dist(q, e);
+			if((int)results.size() < ef || de < results.top().first){
+				candidates.push(make_pair(de, e));
+				results.push(make_pair(de, e));
+				if((int)results.size() > ef)
+					results.pop();
+			}
+		}
+	}
+	give_visited(move(visited));
+
+	vector<pair<float, int>> found(results.size());
+	for(int i = found.size() - 1; i >= 0; i--){
+		found[i] = results.top();
+		results.pop();
+	}
+	return found;
+}
+
+//the HNSW neighbour heuristic: nearest first, a candidate is kept only if it is closer to the base
+//than to every neighbour kept so far, which keeps links spread out in different directions
+vector<int> AnnIndex::select(const vector<pair<float, int>> &candidates, int max_links) const{
+	vector<int> kept;
+	for(size_t i = 0; i < candidates.size() && (int)kept.size() < max_links; i++){
+		const float *v = vec(candidates[i].second);
+		bool good = true;
+		for(size_t j = 0; j < kept.size() && good; j++)
+			good = dist(v, kept[j]) > candidates[i].first;
+		if(good)
+			kept.push_back(candidates[i].second);
+	}
+	return kept;
+}
+
+void AnnIndex::link(int node, int level, const vector<int> &neighbours){
+	int max_links = level == 0 ? M0 : M;
+	{
+		int *l = links(node, level);
+		unique_lock<mutex> lock(stripes[node % stripes.size()], defer_lock);
+		if(locking)
+			lock.lock();
+		l[0] = neighbours.size();
+		copy(neighbours.begin(), neighbours.end(), l + 1);
+	}
+	for(size_t i = 0; i < neighbours.size(); i++){
+		int nb = neighbours[i];
+		int *l = links(nb, level);
+		unique_lock<mutex> lock(stripes[nb % stripes.size()], defer_lock);
+		if(locking)
+			lock.lock();
+		if(l[0] < max_links){
+			l[1 + l[0]++] = node;
+			continue;
+		}
+		//full: keep the best spread of the old links and the new node
+		const float *v = vec(nb);
+		vector<pair<float, int>> candidates;
+		candidates.push_back(make_pair(dist(v, node), node));
+		for(int j = 1; j <= l[0]; j++)
+			candidates.push_back(make_pair(dist(v, l[j]), l[j]));
+		sort(candidates.begin(), candidates.end());
+		vector<int> kept = select(candidates, max_links);
+		l[0] = kept.size();
+		copy(kept.begin(), kept.end(), l + 1);
+	}
+}
+
+void AnnIndex::insert(int node){
+	const float *q = vec(node);
+	int level = levels[node];
+	unique_lock<mutex> top_lock(entry_lock);
+	int ep = entry, top = max_level;
+	if(ep == -1){
+		entry = node;
+		max_level = level;
+		return;
+	}
+	if(level <= top) //only a node that raises the top level holds the lock to the end
+		top_lock.unlock();
+
+	for(int l = top; l > level; l--)
+		ep = greedy(q, ep, l);
+	for(int l = min(level, top); l >= 0; l--){
+		vector<pair<float, int>> found = search_layer(q, ep, ef_construction, l);
+		found.erase(remove_if(found.begin(), found.end(),
+				[&](const pair<float, int> &f){ return f.second == node; }), found.end());
+		if(found.empty())
+			continue;
+		link(node, l, select(found, M));
+		ep = found[0].second;
+	}
+	if(level > top){
+		entry = node;
+		max_level = level;
+	}
+}
+
+void AnnIndex::build(const Theta &theta, int num_threads){
+	unmap();
+	dim = theta.num_topics;
+	num_docs = 0;
+	max_level = 0;
+	entry = -1;
+	vecs_own.clear();
+	levels_own.clear();
+	links0_own.clear();
+	upper_off_own.clear();
+	upper_own.clear();
+	vecs_own.reserve((size_t)theta.num_docs * dim);
+	links0_own.reserve((size_t)theta.num_docs * (1 + M0));
+	for(long long di = 0; di < theta.num_docs; di++) //levels drawn in order, so a build depends only on the seed
+		append(theta.row(di), random_level());
+
+	if(num_docs == 0)
+		return;
+	insert(0);
+	locking = num_threads > 1;
+	parallel_for(1, num_docs, num_threads, [&](int node){ insert(node); });
+	locking = false;
+}
+
+int AnnIndex::add(const double *theta_row){
+	own();
+	append(theta_row, random_level());
+	insert(num_docs - 1);
+	return num_docs - 1;
+}
+
+bool AnnIndex::add(const Theta &rows){
+	if(num_docs > 0 && rows.num_topics != dim)
+		return false;
+	dim = rows.num_topics;
+	for(long long di = 0; di < rows.num_docs; di++)
+		add(rows.row(di));
+	return true;
+}
+
+vector<pair<float, int>> AnnIndex::brute_force(const float *q, int k) const{
+	priority_queue<pair<float, int>> best; //farthest on top
+	for(int node = 0; node < num_docs; node++){
+		float d = dist(q, node);
+		if((int)best.size() < k)
+			best.push(make_pair(d, node));
+		else if(d < best.top().first){
+			best.pop();
+			best.push(make_pair(d, node));
+		}
+	}
+	vector<pair<float, int>> found(best.size());
+	for(int i = found.size() - 1; i >= 0; i--){
+		found[i] = best.top();
+		best.pop();
+	}
+	return found;
+}
+
+vector<pair<float, int>> AnnIndex::search_vec(const float *q, int k, bool exact) const{
+	vector<pair<float, int>> found;
+	if(k <= 0)
+		return found;
+	if(exact || num_docs < exact_below || entry == -1)
+		found = brute_force(q, k);
+	else{
+		int ep = entry;
+		for(int l = max_level; l > 0; l--)
+			ep = greedy(q, ep, l);
+		found = search_layer(q, ep, max(ef_search, k), 0);
+		if((int)found.size() > k)
+			found.resize(k);
+	}
+	for(size_t i = 0; i < found.size(); i++) //squared L2 of sqrt rows to Hellinger
+		found[i].first = sqrt(0.5f * found[i].first);
+	return found;
+}
+
+vector<pair<float, int>> AnnIndex::search(const double *theta_row, int k, bool exact) const{
+	vector<float> q(dim);
+	to_vec(theta_row, q.data());
+	return search_vec(q.data(), k, exact);
+}
+
+vector<vector<pair<float, int>>> AnnIndex::search(const Theta &queries, int k, int num_threads, bool exact) const{
+	vector<vector<pair<float, int>>> found(queries.num_docs);
+	if(queries.num_topics != dim)
+		return found;
+	parallel_for(0, num_threads, num_threads, [&](int p){
+		vector<float> q(dim);
+		for(long long i = queries.num_docs * p / num_threads; i < queries.num_docs * (p + 1) / num_threads; i++){
+			to_vec(queries.row(i), q.data());
+			found[i] = search_vec(q.data(), k, exact);
+		}
+	});
+	return found;
+}
+
+vector<pair<float, int>> AnnIndex::search_doc(int doc, int k, bool exact) const{
+	if(doc < 0 || doc >= num_docs) //not a stored row: no neighbours
+		return vector<pair<float, int>>();
+	return search_vec(vec(doc), k, exact);
+}
+
+static long long aligned(long long offset){
+	return (offset + 63) / 64 * 64;
+}
+
+bool AnnIndex::save(string filename) const{
+	long long upper_size = num_docs > 0 ? upper_off[num_docs - 1] + levels[num_docs - 1] * (1 + M) : 0;
+	long long h[ANN_HEADER] = {0};
+	h[0] = ANN_MAGIC;
+	h[1] = ANN_VERSION;
+	h[2] = dim;
+	h[3] = M;
+	h[4] = ef_construction;
+	h[5] = num_docs;
+	h[6] = max_level;
+	h[7] = entry;
+	h[8] = upper_size;
+	h[9] = aligned(sizeof(h)); //vectors
+	h[10] = aligned(h[9] + (long long)num_docs * dim * sizeof(float)); //levels
+	h[11] = aligned(h[10] + (long long)num_docs * sizeof(int)); //level-0 links
+	h[12] = aligned(h[11] + (long long)num_docs * (1 + M0) * sizeof(int)); //upper offsets
+	h[13] = aligned(h[12] + (long long)num_docs * sizeof(long long)); //upper links
+	h[14] = h[13] + upper_size * sizeof(int); //file size
+
+	ofstream file(filename.c_str(), ios::binary);
+	if(!file)
+		return false;
+	auto section = [&](long long offset, const void *data, long long bytes){
+		static const char zeros[64] = {0};
+		file.write(zeros, offset - file.tellp());
+		file.write((const char *)data, bytes);
+	};
+	file.write((const char *)h, sizeof(h));
+	section(h[9], vecs, (long long)num_docs * dim * sizeof(float));
+	section(h[10], levels, (long long)num_docs * sizeof(int));
+	section(h[11], links0, (long long)num_docs * (1 + M0) * sizeof(int));
+	section(h[12], upper_off, (long long)num_docs * sizeof(long long));
+	section(h[13], upper, upper_size * sizeof(int));
+	file.close();
+	return !file.fail();
+}
+
+bool AnnIndex::load(string filename){
+	long long h[ANN_HEADER];
+	{
+		ifstream file(filename.c_str(), ios::binary);
+		if(!file.read((char *)h, sizeof(h)) || h[0] != ANN_MAGIC || h[1] != ANN_VERSION){
+			cerr << filename << " is not an index file of this version" << endl;
+			return false;
+		}
+	}
+	long long file_size = -1;
+	{
+		ifstream file(filename.c_str(), ios::binary | ios::ate);
+		file_size = file.tellg();
+	}
+	//a truncated or damaged file must not be mapped: every section has to lie within it
+	long long num = h[5], m0 = 2 * h[3];
+	long long ends[5] = {
+		h[9] + num * h[2] * (long long)sizeof(float),
+		h[10] + num * (long long)sizeof(int),
+		h[11] + num * (1 + m0) * (long long)sizeof(int),
+		h[12] + num * (long long)sizeof(long long),
+		h[13] + h[8] * (long long)sizeof(int)};
+	bool valid = h[14] == file_size && h[2] > 0 && h[2] <= 1 << 20 && h[3] >= 2 && h[3] <= 1 << 16
+			&& num >= 0 && num < 1LL << 31 && h[8] >= 0 && h[8] <= h[14] && h[7] >= -1 && h[7] < num && h[6] >= 0;
+	for(int s = 0; s < 5 && valid; s++)
+		valid = h[9 + s] >= (long long)sizeof(h) && h[9 + s] % 64 == 0 && h[9 + s] <= h[14] && ends[s] <= h[14];
+	if(!valid){
+		cerr << filename << " is truncated or damaged" << endl;
+		return false;
+	}
+	unmap();
+	dim = h[2];
+	M = h[3];
+	M0 = 2 * M;
+	level_mult = 1.0 / log((double)M);
+	ef_construction = h[4];
+	num_docs = h[5];
+	max_level = h[6];
+	entry = h[7];
+	long long upper_size = h[8];
+
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd >= 0){
+		void *base = mmap(NULL, h[14], PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(base != MAP_FAILED){
+			mapped = base;
+			mapped_size = h[14];
+			const char *at = (const char *)base;
+			vecs = (const float *)(at + h[9]);
+			levels = (const int *)(at + h[10]);
+			links0 = (int *)(at + h[11]); //read-only, add() copies the index first
+			upper_off = (const long long *)(at + h[12]);
+			upper = (int *)(at + h[13]);
+			vector<float>().swap(vecs_own);
+			vector<int>().swap(levels_own);
+			vector<int>().swap(links0_own);
+			vector<long long>().swap(upper_off_own);
+			vector<int>().swap(upper_own);
+			return true;
+		}
+	}
+#endif
+	//no mmap: read the sections into memory
+	ifstream file(filename.c_str(), ios::binary);
+	vecs_own.resize((size_t)num_docs * dim);
+	levels_own.resize(num_docs);
+	links0_own.resize((size_t)num_docs * (1 + M0));
+	upper_off_own.resize(num_docs);
+	upper_own.resize(upper_size);
+	file.seekg(h[9]).read((char *)vecs_own.data(), vecs_own.size() * sizeof(float));
+	file.seekg(h[10]).read((char *)levels_own.data(), levels_own.size() * sizeof(int));
+	file.seekg(h[11]).read((char *)links0_own.data(), links0_own.size() * sizeof(int));
+	file.seekg(h[12]).read((char *)upper_off_own.data(), upper_off_own.size() * sizeof(long long));
+	file.seekg(h[13]).read((char *)upper_own.data(), upper_own.size() * sizeof(int));
+	attach();
+	return !file.fail();
+}
+
+/*
+ * This file implements the nearest-document index over topic vectors.
+ * - build: Draws every node's level in order, then inserts the rows on several threads; link
+ *   lists are guarded by striped locks while the build runs.
+ * - add: Inserts one more row, e.g. a document scored by fold-in, copying a mapped index first.
+ * - search: HNSW descent and best-first search on level 0, or an exact scan for small indexes;
+ *   batches of queries are split across threads.
+ * - save/load: A flat, 64-byte aligned file that is mapped read-only where mmap is available.
+ */
@@ -0,0 +1,103 @@
+#ifndef ANN_H_
+#define ANN_H_
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <memory>
+#include "similarity.h"
+#include "utility.h"
+using namespace std;
+
+// Nearest documents by the Hellinger distance between their topic vectors. Rows are stored as
+// sqrt(theta) in floats, where the Hellinger distance is sqrt(0.5 * squared L2), and linked into
+// an HNSW graph (Malkov & Yashunin): every node has a random top level, keeps up to 2*M links on
+// level 0 and M on each level above, and a search descends greedily from the entry point before
+// a best-first search of ef candidates on level 0. Small indexes are searched exactly instead.
+//
+// Saved indexes are a header and flat sections (vectors, levels, level-0 links, upper links),
+// each 64-byte aligned, so load() can map the file and search it in place.
+class AnnIndex {
+public:
+	int dim;
+	int M;
+	int ef_construction;
+	int ef_search; //candidates kept by a search, raised to k when smaller
+	int exact_below; //brute force while the index holds fewer rows than this
+	int num_docs;
+	int max_level;
+	int entry; //-1 while empty
+
+	AnnIndex(int M = 16, int ef_construction = 200, unsigned long long seed = 42);
+	~AnnIndex();
+
+	void build(const similarity::Theta &theta, int num_threads = 1); //replaces the contents
+	int add(const double *theta_row); //one more row (e.g. a folded-in document), returns its id
+	bool add(const similarity::Theta &rows); //false, adding nothing, if the rows are not dim wide
+
+	//(Hellinger distance, doc id) of the k nearest rows, nearest first; none for k < 1, or for
+	//queries that are not dim wide
+	vector<pair<float, int>> search(const double *theta_row, int k, bool exact = false) const;
+	vector<vector<pair<float, int>>> search(const similarity::Theta &queries, int k, int num_threads = 1,
+			bool exact = false) const;
+	vector<pair<float, int>> search_doc(int doc, int k, bool exact = false) const; //by a stored row, none for a bad id
+
+	bool save(string filename) const;
+	bool load(string filename); //mapped read-only where possible, copied into memory by add()
+
+private:
+	class Visited { //marks nodes seen by one search, cleared by bumping the tag
+	public:
+		vector<unsigned> marks;
+		unsigned tag;
+		void reset(int n);
+	};
+
+	int M0;
+	double level_mult;
+	utils::Random rng;
+
+	//owned storage; the pointers below point into it, or into the mapped file
+	vector<float> vecs_own;
+	vector<int> levels_own;
+	vector<int> links0_own; //per node: count, then 2*M ids
+	vector<long long> upper_off_own; //per node, start of its levels 1.. in upper; (1+M) ints per level
+	vector<int> upper_own;
+	const float *vecs;
+	const int *levels;
+	int *links0;
+	const long long *upper_off;
+	int *upper;
+	void *mapped;
+	size_t mapped_size;
+
+	bool locking; //links are updated by several threads (bulk build)
+	mutable vector<mutex> stripes; //per-node link locks, by node id modulo their number
+	mutex entry_lock;
+	mutable mutex pool_lock;
+	mutable vector<unique_ptr<Visited>> pool;
+
+	void attach();
+	void own(); //copy a mapped index into owned storage
+	void unmap();
+	int random_level();
+	void append(const double *theta_row, int level);
+
+	const float *vec(int node) const{ return vecs + (size_t)node * dim; }
+	int *links(int node, int level) const;
+	float dist(const float *q, int node) const;
+
+	int greedy(const float *q, int ep, int level) const;
+	vector<pair<float, int>> search_layer(const float *q, int ep, int ef, int level) const; //ascending
+	vector<int> select(const vector<pair<float, int>> &candidates, int max_links) const;
+	void link(int node, int level, const vector<int> &neighbours);
+	void insert(int node);
+	vector<pair<float, int>> search_vec(const float *q, int k, bool exact) const;
+	vector<pair<float, int>> brute_force(const float *q, int k) const;
+	void to_vec(const double *theta_row, float *q) const;
+
+	unique_ptr<Visited> take_visited() const;
+	void give_visited(unique_ptr<Visited> v) const;
+};
+
+#endif /* ANN_H_ */
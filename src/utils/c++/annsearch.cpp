@@ -0,0 +1,175 @@
+#include <iostream>
+#include <fstream>
+#include <getopt.h>
+#include "ann.h"
+#include "similarity.h"
+#include "instrument.h"
+
+using namespace std;
+using namespace similarity;
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	string theta_file; //rows to build an index from
+	string index_file; //an index to load
+	string add_file; //rows to add to the loaded index
+	string query_docs_file; //ids of indexed documents to find neighbours of
+	string query_theta_file; //topic vectors to find neighbours of
+	string output_path;
+	int M = 16, ef_construction = 200, ef_search = 64, k = 10;
+	int num_threads = 1;
+	bool exact = false;
+
+	const char *optstring = "i:x:a:q:Q:o:M:c:s:k:j:e";
+
+	while( (opt = getopt(argc, argv, optstring)) != -1){
+
+		switch (opt){
+			case 'i':
+				theta_file = optarg;
+				break;
+			case 'x':
+				index_file = optarg;
+				break;
+			case 'a':
+				add_file = optarg;
+				break;
+			case 'q':
+				query_docs_file = optarg;
+				break;
+			case 'Q':
+				query_theta_file = optarg;
+				break;
+			case 'o':
+				output_path = optarg;
+				break;
+			case 'M':
+				M = atoi(optarg);
+				break;
+			case 'c':
+				ef_construction = atoi(optarg);
+				break;
+			case 's':
+				ef_search = atoi(optarg);
+				break;
+			case 'k':
+				k = atoi(optarg);
+				break;
+			case 'j':
+				num_threads = max(1, atoi(optarg));
+				break;
+			case 'e': //exact search, by brute force
+				exact = true;
+				break;
+			default:
+				cerr <<"unknown option: " << char(optopt) << endl;
+				return -1;
+		}
+	}
+
+	if(M < 2 || ef_construction < 1 || ef_search < 1 || k < 1){
+		cerr << "-M must be at least 2, and -c, -s and -k at least 1" << endl;
+		return -1;
+	}
+
+	AnnIndex index(M, ef_construction);
+	index.ef_search = ef_search;
+	double start = instrument::now();
+	if(!theta_file.empty()){
+		Theta theta;
+		if(!load_theta(theta_file, theta, num_threads)){
+			cerr << "cannot read theta file " << theta_file << endl;
+			return 1;
+		}
+		index.build(theta, num_threads);
+		cout << "built index of " << index.num_docs << " docs (" << instrument::now() - start << "s)" << endl;
+	}else if(!index_file.empty()){
+		if(!index.load(index_file))
+			return 1;
+		cout << "loaded index of " << index.num_docs << " docs (" << instrument::now() - start << "s)" << endl;
+	}else{
+		cerr << "either -i theta file or -x index file is needed" << endl;
+		return -1;
+	}
+
+	if(!add_file.empty()){
+		Theta rows;
+		if(!load_theta(add_file, rows, num_threads)){
+			cerr << "cannot read theta file " << add_file << endl;
+			return 1;
+		}
+		if(!index.add(rows)){
+			cerr << add_file << " has " << rows.num_topics << " topics, the index " << index.dim << endl;
+			return 1;
+		}
+		cout << "added " << rows.num_docs << " docs" << endl;
+	}
+
+	bool querying = !query_docs_file.empty() || !query_theta_file.empty();
+	if(!querying){ //build or add: write the index
+		if(!index.save(output_path)){
+			cerr << "cannot write index file " << output_path << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	//one line per query: "doc:distance doc:distance ..." nearest first
+	start = instrument::now();
+	vector<vector<pair<float, int>>> found;
+	if(!query_theta_file.empty()){
+		Theta queries;
+		if(!load_theta(query_theta_file, queries, num_threads)){
+			cerr << "cannot read theta file " << query_theta_file << endl;
+			return 1;
+		}
+		if(queries.num_topics != index.dim){
+			cerr << query_theta_file << " has " << queries.num_topics << " topics, the index " << index.dim << endl;
+			return 1;
+		}
+		found = index.search(queries, k, num_threads, exact);
+	}else{
+		vector<long long> docs;
+		ifstream ids(query_docs_file.c_str());
+		long long doc;
+		while(ids >> doc)
+			docs.push_back(doc);
+		long long bad = 0;
+		for(size_t i = 0; i < docs.size(); i++){
+			if(docs[i] < 0 || docs[i] >= index.num_docs){
+				if(bad++ == 0)
+					cerr << "query id " << docs[i] << " is not a document of the index (0 to "
+							<< index.num_docs - 1 << ")" << endl;
+				docs[i] = -1;
+			}
+		}
+		if(bad > 0)
+			cerr << bad << " query ids are out of range; their lines are left empty" << endl;
+		found.resize(docs.size());
+		utils::parallel_for(0, num_threads, num_threads, [&](int p){
+			for(size_t i = docs.size() * p / num_threads; i < docs.size() * (p + 1) / num_threads; i++)
+				found[i] = index.search_doc(docs[i], k, exact);
+		});
+	}
+	double seconds = instrument::now() - start;
+	cout << found.size() << " queries (" << seconds << "s, "
+			<< (found.empty() ? 0 : seconds * 1e3 / found.size()) << " ms/query)" << endl;
+
+	ofstream out(output_path.c_str());
+	for(size_t i = 0; i < found.size(); i++){
+		for(size_t j = 0; j < found[i].size(); j++)
+			out << found[i][j].second << ":" << found[i][j].first << " ";
+		out << endl;
+	}
+	out.close();
+	return 0;
+}
+
+/*
+ * This file is the entry point for finding topically similar documents.
+ * It builds a nearest-neighbour index from a theta file (-i, see similarity.h for the formats) or
+ * loads a saved one (-x), optionally adds more rows (-a, e.g. folded-in documents), and then
+ * either saves the index to -o, or answers top -k queries for stored documents (-q, one id per
+ * line) or new topic vectors (-Q) and writes one "doc:distance ..." line per query to -o.
+ */
@@ -0,0 +1,234 @@
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <getopt.h>
+#include "estimator.h"
+#include "utility.h"
+#include "instrument.h"
+#include "synthetic.h"
+#include "coherence.h"
+#include "constraints.h"
+
+using namespace std;
+using namespace utils;
+using namespace instrument;
+using namespace synthetic;
+
+static volatile double sink; //keeps results of timed calls alive
+
+static void report(string name, long long iters, double seconds, string extra = ""){
+	double ns = iters > 0 ? seconds * 1e9 / iters : 0;
+	cout << name << "\t" << iters << " iters\t" << ns << " ns/op" << extra << endl;
+	stringstream line;
+	line << "{\"bench\":\"" << name << "\",\"iters\":" << iters << ",\"seconds\":" << seconds
+			<< ",\"ns_per_op\":" << ns << ",\"peak_rss_kb\":" << peak_rss_kb() << "}";
+	metrics.write(line.str());
+}
+
+// runs fn(i) for i in [0, iters) and reports the time per call
+template<class F>
+static void run(string name, long long iters, F fn){
+	double start = now();
+	for(long long i = 0; i < iters; i++)
+		fn(i);
+	report(name, iters, now() - start);
+}
+
+class Silence { //load_data and estimate talk on cout
+public:
+	Silence(){ old = cout.rdbuf(null.rdbuf()); }
+	~Silence(){ cout.rdbuf(old); }
+private:
+	stringstream null;
+	streambuf *old;
+};
+
+static bool wanted(string benches, string name){
+	return benches == "all" || ("," + benches + ",").find("," + name + ",") != string::npos;
+}
+
+int main(int argc, char *argv[]) {
+
+	CorpusSpec spec;
+	string prefix = "synthetic";
+	string benches = "all";
+	string metrics_file;
+	int num_topics = 10;
+	double alpha = 1, beta = 0.01, eta = 1000;
+	int epochs = 3;
+	int num_threads = 1;
+	long long iters = 1000000;
+	bool generate_only = false;
+	bool word_major = false;
+	bool group_words = false;
+	bool block_rotation = false;
+	bool data_parallel = false;
+	bool hogwild = false;
+	bool numa_aware = false;
+
+	const char *optstring = "d:w:l:L:s:k:c:t:n:r:o:j:i:b:m:gWGRDHN";
+	int opt;
+	while( (opt = getopt(argc, argv, optstring)) != -1){
+		switch (opt){
+			case 'd': spec.num_docs = atoi(optarg); break;
+			case 'w': spec.num_words = atoi(optarg); break;
+			case 'l': spec.mean_len = atof(optarg); break;
+			case 'L': spec.len_dist = optarg; break;
+			case 's': spec.len_sigma = atof(optarg); break;
+			case 'k': spec.num_topics = atoi(optarg); break;
+			case 'c': spec.num_clusters = atoi(optarg); break;
+			case 't': num_topics = atoi(optarg); break;
+			case 'n': epochs = atoi(optarg); break;
+			case 'r': spec.seed = atoi(optarg); break;
+			case 'o': prefix = optarg; break;
+			case 'j': num_threads = atoi(optarg); break;
+			case 'i': iters = atoll(optarg); break;
+			case 'b': benches = optarg; break;
+			case 'm': metrics_file = optarg; break;
+			case 'g': generate_only = true; break;
+			case 'W': word_major = true; break;
+			case 'G': group_words = true; break;
+			case 'R': block_rotation = true; break;
+			case 'D': data_parallel = true; break;
+			case 'H': hogwild = true; break;
+			case 'N': numa_aware = true; break;
+			default:
+				cerr <<"unknown option: " << char(optopt) << endl;
+				return -1;
+		}
+	}
+	if(!metrics_file.empty())
+		metrics.open(metrics_file);
+
+	double start = now();
+	synthetic::Corpus corpus(spec);
+	corpus.save(prefix);
+	long long num_tokens = corpus.num_tokens();
+	cout << "corpus: " << spec.num_docs << " docs, " << num_tokens << " tokens, "
+			<< spec.num_words << " words, " << corpus.clusters.size() << " clusters ("
+			<< now() - start << "s)" << endl;
+	if(generate_only)
+		return 0;
+
+	string vocab_file = prefix + ".vocab";
+	string data_file = prefix + ".bow";
+	string cluster_file = prefix + ".cluster";
+
+	if(wanted(benches, "load")){
+		int reps = 3;
+		run("readin_vocab+readin_data", reps, [&](long long){
+			Estimator est(alpha, beta, eta, num_topics, spec.num_words, spec.seed);
+			est.readin_vocab(vocab_file);
+			est.readin_data(data_file);
+		});
+	}
+
+	if(wanted(benches, "build_tree")){
+		Estimator est(alpha, beta, eta, num_topics, spec.num_words, spec.seed);
+		est.readin_vocab(vocab_file);
+		est.readin_clusters(cluster_file);
+		run("build_tree", 5, [&](long long){ est.build_tree(); });
+	}
+
+	if(wanted(benches, "constraints")){ //a star of cannot-links, the worst case for a naive enumeration
+		int leaves = 100000;
+		vector<vector<int>> mustlinks, cannotlinks;
+		for(int wi = 1; wi <= leaves; wi++)
+			cannotlinks.push_back(vector<int>{0, wi});
+		Constraints constraints;
+		run("constraints_star", 3, [&](long long){
+			constraints.compile(leaves + 1, mustlinks, cannotlinks);
+		});
+	}
+
+	Estimator est(alpha, beta, eta, num_topics, spec.num_words, spec.seed);
+	est.num_threads = num_threads;
+	est.word_major = word_major;
+	est.group_words = group_words;
+	est.block_rotation = block_rotation;
+	est.data_parallel = data_parallel;
+	est.hogwild = hogwild;
+	est.numa_aware = numa_aware;
+	{
+		Silence quiet;
+		est.load_data(data_file, prefix + ".z", cluster_file, vocab_file);
+	}
+
+	//a fixed pseudo-random stream of (topic, leaf) pairs shared by the micro benchmarks
+	Random rng(spec.seed);
+	vector<int> topic_stream(4096), leaf_stream(4096);
+	for(int i = 0; i < 4096; i++){
+		topic_stream[i] = rng.below(num_topics);
+		leaf_stream[i] = est.leafmap[rng.below(spec.num_words)];
+	}
+
+	if(wanted(benches, "wordval_update")){
+		run("wordval_update", iters, [&](long long i){
+			sink = est.topics[topic_stream[i & 4095]].wordval_update(1, leaf_stream[i & 4095]);
+		});
+	}
+
+	if(wanted(benches, "leaf_count_update")){
+		run("leaf_count_update(+1,-1)", iters, [&](long long i){
+			Topic topic = est.topics[topic_stream[i & 4095]];
+			topic.leaf_count_update(1, leaf_stream[i & 4095]);
+			topic.leaf_count_update(-1, leaf_stream[i & 4095]);
+		});
+	}
+
+	if(wanted(benches, "logphi_update")){ //likelihood read after each count change, as in variant sampling
+		run("logphi_update", iters / 100, [&](long long i){
+			Topic topic = est.topics[topic_stream[i & 4095]];
+			topic.leaf_count_update(1, leaf_stream[i & 4095]);
+			sink = topic.logphi_update();
+			topic.leaf_count_update(-1, leaf_stream[i & 4095]);
+		});
+	}
+
+	if(wanted(benches, "mult_sample")){
+		vector<double> probs(num_topics);
+		double probs_sum = 0.0;
+		for(int ti = 0; ti < num_topics; ti++){
+			probs[ti] = rng.uniform();
+			probs_sum += probs[ti];
+		}
+		run("mult_sample", iters, [&](long long){ sink = mult_sample(probs, probs_sum, rng); });
+	}
+
+	if(wanted(benches, "epoch")){
+		double estimate_start = now();
+		{
+			Silence quiet;
+			est.estimate(epochs);
+		}
+		double seconds = now() - estimate_start;
+		stringstream extra;
+		extra << "\t" << (seconds > 0 ? num_tokens * epochs / seconds : 0) << " tokens/sec\t"
+				<< peak_rss_kb() << " KB peak RSS";
+		report("estimate_epoch", epochs, seconds, extra.str());
+	}
+
+	if(wanted(benches, "coherence")){ //index built once per corpus, then every measure on the trained topics
+		vector<string> measures = {"u_mass", "c_uci", "c_npmi", "c_v"};
+		double index_start = now();
+		Coherence coherence(est.docs, est.num_words, measures, num_threads);
+		report("coherence_index", 1, now() - index_start);
+		vector<vector<int>> topics = est.top_words();
+		for(size_t mi = 0; mi < measures.size(); mi++){
+			run("coherence_" + measures[mi], 10, [&](long long){
+				sink = coherence.score(topics, measures[mi], num_threads);
+			});
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * This file is the entry point of the benchmark suite.
+ * It generates a deterministic synthetic corpus (see synthetic.cpp) from the command-line spec,
+ * saves it next to the given prefix, and then times corpus loading, build_tree, compiling a star of
+ * 10^5 cannot-links, wordval_update,
+ * leaf_count_update, logphi_update, mult_sample, full estimate epochs and topic coherence on it. Results go to stdout and,
+ * with -m, as JSON lines to a metrics file so that builds and sampler settings can be compared.
+ */
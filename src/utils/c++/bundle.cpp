@@ -0,0 +1,506 @@
+#include "bundle.h"
+#include "estimator.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static const long long BUNDLE_MAGIC = 0x4c444d41444c5453LL; //"STLDAMDL"
+static const long long BUNDLE_VERSION = 1;
+static const int BUNDLE_HEADER = 32; //long longs, followed by the section table
+static const int TABLE_ENTRY = 3; //offset, bytes, checksum
+
+static long long aligned(long long offset){
+	return (offset + 63) / 64 * 64;
+}
+
+static unsigned long long checksum(const char *data, long long bytes){
+	//FNV-1a over 8-byte words, then the tail byte by byte
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	long long i = 0;
+	for(; i + 8 <= bytes; i += 8){
+		unsigned long long w;
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 32;
+	}
+	for(; i < bytes; i++)
+		h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static unsigned long long hash_word(const char *word, size_t len){
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)word[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static long long double_bits(double v){
+	long long bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return bits;
+}
+
+static double bits_double(long long bits){
+	double v;
+	memcpy(&v, &bits, sizeof(v));
+	return v;
+}
+
+//the tree is written depth first as two streams, one of ints and one of doubles; a node is its
+//child count, leafstart, maxind, words and edge count, then its edge sum and edge priors, then its
+//children. A multinode has no edges of its own but its variants (fake leaf maps and log weights),
+//which come before its children. Offsets into the count arrays are redone by ROOT::layout().
+static void put_list(vector<int> &ints, const vector<int> &list){
+	ints.push_back(list.size());
+	ints.insert(ints.end(), list.begin(), list.end());
+}
+
+static void put_node(const Node &node, vector<int> &ints, vector<double> &doubles){
+	ints.push_back(node.children.size());
+	ints.push_back(node.leafstart);
+	put_list(ints, node.maxind);
+	put_list(ints, node.words);
+	ints.push_back(node.orig_edge_weights.size());
+	doubles.push_back(node.orig_edgesum);
+	doubles.insert(doubles.end(), node.orig_edge_weights.begin(), node.orig_edge_weights.end());
+	for(size_t i = 0; i < node.children.size(); i++)
+		put_node(node.children[i], ints, doubles);
+}
+
+static void put_multinode(const MultiNode &multi, vector<int> &ints, vector<double> &doubles){
+	ints.push_back(multi.children.size());
+	ints.push_back(multi.leafstart);
+	put_list(ints, multi.maxind);
+	put_list(ints, multi.words);
+	ints.push_back(multi.variants.size());
+	for(size_t v = 0; v < multi.variants.size(); v++)
+		put_list(ints, multi.fake_leafmap[v]);
+	doubles.insert(doubles.end(), multi.variant_logweights.begin(), multi.variant_logweights.end());
+	for(size_t v = 0; v < multi.variants.size(); v++)
+		put_node(multi.variants[v], ints, doubles);
+	for(size_t i = 0; i < multi.children.size(); i++)
+		put_node(multi.children[i], ints, doubles);
+}
+
+class TreeReader {
+public:
+	const int *ints;
+	const double *doubles;
+
+	vector<int> list(){
+		int n = *ints++;
+		vector<int> l(ints, ints + n);
+		ints += n;
+		return l;
+	}
+
+	Node node(){
+		int num_children = *ints++;
+		int leafstart = *ints++;
+		vector<int> maxind = list();
+		vector<int> words = list();
+		int num_edges = *ints++;
+		double edgesum = *doubles++;
+		vector<double> weights(doubles, doubles + num_edges);
+		doubles += num_edges;
+		vector<Node> children;
+		children.reserve(num_children);
+		for(int i = 0; i < num_children; i++)
+			children.push_back(node());
+		return Node(move(children), move(maxind), leafstart, move(words), move(weights), edgesum);
+	}
+
+	MultiNode multinode(){
+		int num_children = *ints++;
+		int leafstart = *ints++;
+		vector<int> maxind = list();
+		vector<int> words = list();
+		int num_variants = *ints++;
+		vector<vector<int>> fake_leafmap;
+		for(int v = 0; v < num_variants; v++)
+			fake_leafmap.push_back(list());
+		vector<double> logweights(doubles, doubles + num_variants);
+		doubles += num_variants;
+		vector<Node> variants, children;
+		variants.reserve(num_variants);
+		for(int v = 0; v < num_variants; v++)
+			variants.push_back(node());
+		children.reserve(num_children);
+		for(int i = 0; i < num_children; i++)
+			children.push_back(node());
+		return MultiNode(move(children), move(maxind), leafstart, move(words), move(variants),
+				move(fake_leafmap), move(logweights));
+	}
+};
+
+//lists as offsets (num_lists + 1) into the concatenated ids
+static void put_lists(const vector<vector<int>> &lists, vector<long long> &offsets, vector<int> &ids){
+	offsets.assign(1, 0);
+	for(size_t i = 0; i < lists.size(); i++){
+		ids.insert(ids.end(), lists[i].begin(), lists[i].end());
+		offsets.push_back(ids.size());
+	}
+}
+
+ModelBundle::ModelBundle(): num_topics(0), num_words(0), num_docs(0), alpha(0), beta(0), eta(0),
+		num_edges(0), num_nodes(0), num_multinodes(0), base(NULL), file_size(0), mapped(NULL),
+		offsets(NUM_SECTIONS, 0), sizes(NUM_SECTIONS, 0), checksums(NUM_SECTIONS, 0){
+}
+
+ModelBundle::~ModelBundle(){
+	unmap();
+}
+
+void ModelBundle::unmap(){
+#ifndef _WIN32
+	if(mapped != NULL)
+		munmap(mapped, file_size);
+#endif
+	mapped = NULL;
+	vector<long long>().swap(buffer);
+	base = NULL;
+}
+
+bool ModelBundle::save(Estimator &est, string filename, bool with_theta){
+	est.calc_phi();
+	if(with_theta)
+		est.calc_theta();
+	const ROOT &root = est.root;
+	int K = est.num_topics, V = est.num_words;
+
+	//vocab: offsets, bytes, and an open-addressing table of ids (-1 empty) sized to a power of two
+	vector<long long> vocab_offsets(1, 0);
+	string vocab_bytes;
+	for(int w = 0; w < V; w++){
+		vocab_bytes += est.vocab[w];
+		vocab_offsets.push_back(vocab_bytes.size());
+	}
+	size_t table_size = 16;
+	while(table_size < 2 * (size_t)V)
+		table_size *= 2;
+	vector<int> vocab_hash(table_size, -1);
+	for(int w = 0; w < V; w++){
+		size_t slot = hash_word(est.vocab[w].data(), est.vocab[w].size()) & (table_size - 1);
+		while(vocab_hash[slot] >= 0)
+			slot = (slot + 1) & (table_size - 1);
+		vocab_hash[slot] = w;
+	}
+
+	vector<long long> ml_offsets, cl_offsets, variant_ranges(1, 0), variant_offsets;
+	vector<int> ml_words, cl_words, variant_words;
+	put_lists(est.ml_cliques, ml_offsets, ml_words);
+	put_lists(est.cl_cliques, cl_offsets, cl_words);
+	vector<vector<int>> variants;
+	for(size_t i = 0; i < est.cl_variants.size(); i++){
+		variants.insert(variants.end(), est.cl_variants[i].begin(), est.cl_variants[i].end());
+		variant_ranges.push_back(variants.size());
+	}
+	put_lists(variants, variant_offsets, variant_words);
+
+	vector<int> tree_ints;
+	vector<double> tree_doubles;
+	tree_ints.push_back(root.children.size());
+	tree_ints.push_back(root.leafstart);
+	put_list(tree_ints, root.maxind);
+	tree_ints.push_back(root.orig_edge_weights.size());
+	tree_doubles.push_back(root.orig_edgesum);
+	tree_doubles.insert(tree_doubles.end(), root.orig_edge_weights.begin(), root.orig_edge_weights.end());
+	for(size_t i = 0; i < root.children.size(); i++)
+		put_multinode(root.children[i], tree_ints, tree_doubles);
+
+	vector<int> edges(est.topics.edges.begin(), est.topics.edges.end()); //stored as int whatever count_t is
+	vector<int> sums(est.topics.sums.begin(), est.topics.sums.end());
+	vector<double> phi, theta, word_phi((size_t)V * K);
+	phi.reserve((size_t)K * V);
+	for(int ti = 0; ti < K; ti++)
+		phi.insert(phi.end(), est.phi[ti].begin(), est.phi[ti].end());
+	for(int ti = 0; ti < K; ti++)
+		for(int wi = 0; wi < V; wi++)
+			word_phi[(size_t)wi * K + ti] = est.phi[ti][wi];
+	if(with_theta){
+		theta.reserve((size_t)est.num_docs * K);
+		for(int di = 0; di < est.num_docs; di++)
+			theta.insert(theta.end(), est.theta[di].begin(), est.theta[di].end());
+	}
+
+	const char *data[NUM_SECTIONS];
+	long long bytes[NUM_SECTIONS];
+	auto section = [&](int s, const void *p, size_t n){
+		data[s] = (const char *)p;
+		bytes[s] = n;
+	};
+	section(VOCAB_OFFSETS, vocab_offsets.data(), vocab_offsets.size() * sizeof(long long));
+	section(VOCAB_BYTES, vocab_bytes.data(), vocab_bytes.size());
+	section(VOCAB_HASH, vocab_hash.data(), vocab_hash.size() * sizeof(int));
+	section(ML_OFFSETS, ml_offsets.data(), ml_offsets.size() * sizeof(long long));
+	section(ML_WORDS, ml_words.data(), ml_words.size() * sizeof(int));
+	section(CL_OFFSETS, cl_offsets.data(), cl_offsets.size() * sizeof(long long));
+	section(CL_WORDS, cl_words.data(), cl_words.size() * sizeof(int));
+	section(CL_VARIANT_RANGES, variant_ranges.data(), variant_ranges.size() * sizeof(long long));
+	section(CL_VARIANT_OFFSETS, variant_offsets.data(), variant_offsets.size() * sizeof(long long));
+	section(CL_VARIANT_WORDS, variant_words.data(), variant_words.size() * sizeof(int));
+	section(TREE_INTS, tree_ints.data(), tree_ints.size() * sizeof(int));
+	section(TREE_DOUBLES, tree_doubles.data(), tree_doubles.size() * sizeof(double));
+	section(LEAFMAP, est.leafmap.data(), est.leafmap.size() * sizeof(int));
+	section(EDGES, edges.data(), edges.size() * sizeof(int));
+	section(SUMS, sums.data(), sums.size() * sizeof(int));
+	section(Y, est.topics.y.data(), est.topics.y.size() * sizeof(int));
+	section(PHI, phi.data(), phi.size() * sizeof(double));
+	section(THETA, theta.data(), theta.size() * sizeof(double));
+	section(WORD_PHI, word_phi.data(), word_phi.size() * sizeof(double));
+
+	long long h[BUNDLE_HEADER] = {0};
+	long long table[NUM_SECTIONS * TABLE_ENTRY];
+	long long offset = aligned(sizeof(h) + sizeof(table));
+	for(int s = 0; s < NUM_SECTIONS; s++){
+		table[s * TABLE_ENTRY] = bytes[s] > 0 ? offset : 0;
+		table[s * TABLE_ENTRY + 1] = bytes[s];
+		table[s * TABLE_ENTRY + 2] = checksum(data[s], bytes[s]);
+		if(bytes[s] > 0)
+			offset = aligned(offset + bytes[s]);
+	}
+	h[0] = BUNDLE_MAGIC;
+	h[1] = BUNDLE_VERSION;
+	h[2] = K;
+	h[3] = V;
+	h[4] = est.num_docs;
+	h[5] = double_bits(est.alpha);
+	h[6] = double_bits(est.beta);
+	h[7] = double_bits(est.eta);
+	h[8] = root.num_edges;
+	h[9] = root.num_nodes;
+	h[10] = root.num_multinodes;
+	h[11] = NUM_SECTIONS;
+	h[12] = offset; //file size
+	h[13] = checksum((const char *)h, sizeof(h)) ^ checksum((const char *)table, sizeof(table));
+
+	ofstream file(filename.c_str(), ios::binary);
+	if(!file)
+		return false;
+	file.write((const char *)h, sizeof(h));
+	file.write((const char *)table, sizeof(table));
+	static const char zeros[64] = {0};
+	for(int s = 0; s < NUM_SECTIONS; s++){
+		if(bytes[s] == 0)
+			continue;
+		file.write(zeros, table[s * TABLE_ENTRY] - file.tellp());
+		file.write(data[s], bytes[s]);
+	}
+	file.write(zeros, offset - file.tellp());
+	file.close();
+	return !file.fail();
+}
+
+bool ModelBundle::load(string filename){
+	unmap();
+	long long h[BUNDLE_HEADER];
+	vector<long long> table;
+	{
+		ifstream file(filename.c_str(), ios::binary);
+		if(!file.read((char *)h, sizeof(h)) || h[0] != BUNDLE_MAGIC || h[1] != BUNDLE_VERSION){
+			cerr << filename << " is not a model bundle of this version" << endl;
+			return false;
+		}
+		if(h[11] < 0 || h[11] > 4096){
+			cerr << filename << " is truncated or its header is damaged" << endl;
+			return false;
+		}
+		table.resize(h[11] * TABLE_ENTRY);
+		file.read((char *)table.data(), table.size() * sizeof(long long));
+		file.seekg(0, ios::end);
+		long long stored = h[13];
+		h[13] = 0;
+		if(file.fail() || (long long)file.tellg() != h[12]
+				|| (checksum((const char *)h, sizeof(h)) ^ checksum((const char *)table.data(),
+						table.size() * sizeof(long long))) != (unsigned long long)stored){
+			cerr << filename << " is truncated or its header is damaged" << endl;
+			return false;
+		}
+	}
+	num_topics = h[2];
+	num_words = h[3];
+	num_docs = h[4];
+	alpha = bits_double(h[5]);
+	beta = bits_double(h[6]);
+	eta = bits_double(h[7]);
+	num_edges = h[8];
+	num_nodes = h[9];
+	num_multinodes = h[10];
+	file_size = h[12];
+	//sections past NUM_SECTIONS are newer and skipped; ones an older writer did not know are absent
+	for(int s = h[11]; s < NUM_SECTIONS; s++){
+		offsets[s] = 0;
+		sizes[s] = 0;
+		checksums[s] = checksum(NULL, 0);
+	}
+	for(int s = 0; s < min<long long>(h[11], NUM_SECTIONS); s++){
+		offsets[s] = table[s * TABLE_ENTRY];
+		sizes[s] = table[s * TABLE_ENTRY + 1];
+		checksums[s] = table[s * TABLE_ENTRY + 2];
+		if(sizes[s] < 0 || offsets[s] % 64 != 0 || offsets[s] + sizes[s] > file_size){
+			cerr << filename << ": section " << s << " is out of bounds" << endl;
+			return false;
+		}
+	}
+	long long K = num_topics, V = num_words;
+	if(size(VOCAB_OFFSETS) != (V + 1) * (long long)sizeof(long long) || size(LEAFMAP) != V * (long long)sizeof(int)
+			|| size(EDGES) != K * num_edges * (long long)sizeof(int) || size(SUMS) != K * num_nodes * (long long)sizeof(int)
+			|| size(Y) != K * num_multinodes * (long long)sizeof(int)
+			|| (has_phi() && size(PHI) != K * V * (long long)sizeof(double))
+			|| (has_theta() && size(THETA) != num_docs * K * (long long)sizeof(double))
+			|| (has_word_phi() && size(WORD_PHI) != V * K * (long long)sizeof(double))){
+		cerr << filename << ": section sizes do not match the model" << endl;
+		return false;
+	}
+	//the vocab hash is probed with a mask, and needs a free slot to end a lookup of an unknown word
+	long long hash_slots = size(VOCAB_HASH) / (long long)sizeof(int);
+	if(size(VOCAB_HASH) % sizeof(int) != 0 || hash_slots <= V || (hash_slots & (hash_slots - 1)) != 0
+			|| size(TREE_INTS) <= 0 || size(TREE_INTS) % sizeof(int) != 0
+			|| size(TREE_DOUBLES) <= 0 || size(TREE_DOUBLES) % sizeof(double) != 0){
+		cerr << filename << ": the vocab hash or the tree sections are malformed" << endl;
+		return false;
+	}
+
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd >= 0){
+		void *at = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(at != MAP_FAILED){
+			mapped = at;
+			base = (const char *)at;
+			return true;
+		}
+	}
+#endif
+	//no mmap: read the file into memory
+	ifstream file(filename.c_str(), ios::binary);
+	buffer.resize((file_size + 7) / 8);
+	file.read((char *)buffer.data(), file_size);
+	base = (const char *)buffer.data();
+	return !file.fail();
+}
+
+bool ModelBundle::verify() const{
+	for(int s = 0; s < NUM_SECTIONS; s++)
+		if(checksum(base + offsets[s], sizes[s]) != checksums[s]){
+			cerr << "model bundle section " << s << " fails its checksum" << endl;
+			return false;
+		}
+	return true;
+}
+
+string ModelBundle::word(int id) const{
+	const long long *off = at<long long>(VOCAB_OFFSETS);
+	return string(at<char>(VOCAB_BYTES) + off[id], off[id + 1] - off[id]);
+}
+
+int ModelBundle::word_id(const char *word, size_t len) const{
+	const long long *off = at<long long>(VOCAB_OFFSETS);
+	const char *bytes = at<char>(VOCAB_BYTES);
+	const int *table = at<int>(VOCAB_HASH);
+	size_t mask = size(VOCAB_HASH) / sizeof(int) - 1;
+	for(size_t slot = hash_word(word, len) & mask; table[slot] >= 0; slot = (slot + 1) & mask){
+		int w = table[slot];
+		if((size_t)(off[w + 1] - off[w]) == len && memcmp(bytes + off[w], word, len) == 0)
+			return w;
+	}
+	return -1;
+}
+
+vector<vector<int>> ModelBundle::read_lists(int offsets_section, int words_section) const{
+	const long long *off = at<long long>(offsets_section);
+	const int *ids = at<int>(words_section);
+	vector<vector<int>> lists(size(offsets_section) / sizeof(long long) - 1);
+	for(size_t i = 0; i < lists.size(); i++)
+		lists[i].assign(ids + off[i], ids + off[i + 1]);
+	return lists;
+}
+
+vector<vector<int>> ModelBundle::ml_cliques() const{
+	return read_lists(ML_OFFSETS, ML_WORDS);
+}
+
+vector<vector<int>> ModelBundle::cl_cliques() const{
+	return read_lists(CL_OFFSETS, CL_WORDS);
+}
+
+vector<vector<vector<int>>> ModelBundle::cl_variants() const{
+	vector<vector<int>> variants = read_lists(CL_VARIANT_OFFSETS, CL_VARIANT_WORDS);
+	const long long *ranges = at<long long>(CL_VARIANT_RANGES);
+	vector<vector<vector<int>>> grouped(size(CL_VARIANT_RANGES) / sizeof(long long) - 1);
+	for(size_t i = 0; i < grouped.size(); i++)
+		grouped[i].assign(variants.begin() + ranges[i], variants.begin() + ranges[i + 1]);
+	return grouped;
+}
+
+void ModelBundle::build_tree(ROOT &root) const{
+	TreeReader reader;
+	reader.ints = at<int>(TREE_INTS);
+	reader.doubles = at<double>(TREE_DOUBLES);
+	root = ROOT();
+	int num_children = *reader.ints++;
+	root.leafstart = *reader.ints++;
+	root.maxind = reader.list();
+	int num_root_edges = *reader.ints++;
+	root.orig_edgesum = *reader.doubles++;
+	root.orig_edge_weights.assign(reader.doubles, reader.doubles + num_root_edges);
+	reader.doubles += num_root_edges;
+	root.children.reserve(num_children);
+	for(int i = 0; i < num_children; i++)
+		root.children.push_back(reader.multinode());
+	root.layout();
+}
+
+const int *ModelBundle::leafmap() const{
+	return at<int>(LEAFMAP);
+}
+
+const int *ModelBundle::edges(int ti) const{
+	return at<int>(EDGES) + (size_t)ti * num_edges;
+}
+
+const int *ModelBundle::sums(int ti) const{
+	return at<int>(SUMS) + (size_t)ti * num_nodes;
+}
+
+const int *ModelBundle::y(int ti) const{
+	return at<int>(Y) + (size_t)ti * num_multinodes;
+}
+
+const double *ModelBundle::phi(int ti) const{
+	return has_phi() ? at<double>(PHI) + (size_t)ti * num_words : NULL;
+}
+
+const double *ModelBundle::theta(int di) const{
+	return has_theta() ? at<double>(THETA) + (size_t)di * num_topics : NULL;
+}
+
+const double *ModelBundle::word_phi(int wi) const{
+	return has_word_phi() ? at<double>(WORD_PHI) + (size_t)wi * num_topics : NULL;
+}
+
+/*
+ * This file implements the single-file model bundle.
+ * - save: Lays out the vocab (with an open-addressing hash index), the cliques, the tree written
+ *   depth first as an int and a double stream, the topic counts, phi (topic-major and, for
+ *   fold-in, word-major) and optionally theta as
+ *   64-byte aligned sections, each with an FNV-1a checksum, behind a checksummed header.
+ * - load: Checks the header, the section bounds and sizes, then maps the file read-only; the
+ *   section checksums are left to verify(), which has to read every page.
+ * - word/word_id: Vocab lookups straight from the mapping.
+ * - build_tree: Rebuilds the tree from its streams, with no clique or variant search.
+ */
@@ -0,0 +1,93 @@
+#ifndef BUNDLE_H_
+#define BUNDLE_H_
+
+#include <vector>
+#include <string>
+#include "nodes.h"
+using namespace std;
+
+class Estimator;
+
+// A trained model in one binary file: hyperparameters, the vocab with a hash index, the
+// must-link / cannot-link cliques, the compiled Dirichlet tree, the topic counts, and optionally
+// phi and theta. The file is a header, a table of sections and the sections themselves, each
+// 64-byte aligned and checksummed, so load() maps it read-only and every accessor points straight
+// into the mapping: processes opening the same bundle share one copy in the page cache, and
+// opening it only reads the header and the section table.
+//
+// Sections are numbered; a reader skips sections numbered past the ones it knows and takes the
+// ones a bundle does not have as absent, so new sections can be appended without a new version.
+// The version changes when an existing section changes its layout.
+class ModelBundle {
+public:
+	enum Section {
+		VOCAB_OFFSETS, VOCAB_BYTES, VOCAB_HASH, //word w is bytes [offsets[w], offsets[w+1])
+		ML_OFFSETS, ML_WORDS, CL_OFFSETS, CL_WORDS, //cliques as offsets into a list of word ids
+		CL_VARIANT_RANGES, CL_VARIANT_OFFSETS, CL_VARIANT_WORDS, //variants of each cl clique
+		TREE_INTS, TREE_DOUBLES, LEAFMAP, //compiled tree, see build_tree()
+		EDGES, SUMS, Y, //TopicCounts arrays, topic after topic
+		PHI, THETA, //optional: num_topics x num_words, num_docs x num_topics
+		WORD_PHI, //optional: phi word-major (num_words x num_topics), for folding in new documents
+		NUM_SECTIONS
+	};
+
+	int num_topics;
+	int num_words;
+	int num_docs; //documents the model was trained on (rows of theta when saved)
+	double alpha;
+	double beta;
+	double eta;
+	int num_edges; //per-topic slots of the tree, as ROOT::layout() assigns them
+	int num_nodes;
+	int num_multinodes;
+
+	ModelBundle();
+	~ModelBundle();
+
+	//writes est (after estimate), with phi and, when with_theta, the dense theta
+	static bool save(Estimator &est, string filename, bool with_theta);
+
+	bool load(string filename); //maps the file read-only, or reads it where mmap is unavailable
+	bool verify() const; //checks every section checksum; reads the whole file
+
+	//vocab
+	string word(int id) const;
+	int word_id(const char *word, size_t len) const; //-1 when not in the vocab
+	int word_id(const string &word) const{ return word_id(word.data(), word.size()); }
+
+	//constraints, copied out
+	vector<vector<int>> ml_cliques() const;
+	vector<vector<int>> cl_cliques() const;
+	vector<vector<vector<int>>> cl_variants() const;
+
+	void build_tree(ROOT &root) const; //the tree as it was trained, without redoing the constraints
+	const int *leafmap() const;
+
+	//counts of topic ti over the tree (num_edges, num_nodes and num_multinodes entries)
+	const int *edges(int ti) const;
+	const int *sums(int ti) const;
+	const int *y(int ti) const;
+
+	bool has_phi() const{ return size(PHI) > 0; }
+	bool has_theta() const{ return size(THETA) > 0; }
+	const double *phi(int ti) const; //p(w | ti) for every word
+	const double *theta(int di) const;
+	bool has_word_phi() const{ return size(WORD_PHI) > 0; }
+	const double *word_phi(int wi) const; //p(w | k) for every topic k
+
+private:
+	const char *base; //the mapping, or buffer
+	long long file_size;
+	vector<long long> buffer; //the file contents when it is read instead of mapped
+	void *mapped;
+	vector<long long> offsets; //per section, 0 bytes when absent
+	vector<long long> sizes;
+	vector<unsigned long long> checksums;
+
+	void unmap();
+	long long size(int section) const{ return sizes[section]; }
+	template<class T> const T *at(int section) const{ return (const T *)(base + offsets[section]); }
+	vector<vector<int>> read_lists(int offsets_section, int words_section) const;
+};
+
+#endif /* BUNDLE_H_ */
@@ -0,0 +1,244 @@
+#include "coherence.h"
+#include "utility.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+using namespace utils;
+
+static const double EPSILON = 1e-12; //as gensim, keeps the logs of unseen pairs finite
+
+CoherenceIndex::CoherenceIndex(): window(0), num_contexts(0){
+}
+
+CoherenceIndex::CoherenceIndex(const vector<vector<int>> &docs, int num_words, int window, int num_threads):
+		window(window), num_contexts(0){
+	int num_docs = docs.size();
+	vector<long long> doc_start(num_docs + 1, 0);
+	for(int di = 0; di < num_docs; di++){
+		long long len = docs[di].size();
+		long long contexts = window == 0 ? 1 : (len == 0 ? 0 : (len <= window ? 1 : len - window + 1));
+		doc_start[di + 1] = doc_start[di] + contexts;
+	}
+	num_contexts = doc_start[num_docs];
+
+	//each thread collects the runs of a range of documents, the ranges are then joined word by word
+	int num_parts = max(1, min(num_threads, num_docs));
+	vector<vector<vector<long long>>> parts(num_parts);
+	parallel_for(0, num_parts, num_parts, [&](int p){
+		vector<vector<long long>> &local = parts[p];
+		local.resize(num_words);
+		for(int di = (long long)num_docs * p / num_parts; di < (long long)num_docs * (p + 1) / num_parts; di++){
+			long long first = doc_start[di];
+			long long last = doc_start[di + 1] - 1; //last context of the document
+			for(long long wi = 0; wi < (long long)docs[di].size(); wi++){
+				long long begin = first, end = last + 1;
+				if(window > 0 && last > first){ //windows starting at wi-window+1 .. wi hold this token
+					begin = first + max(0LL, wi - window + 1);
+					end = min(first + wi, last) + 1;
+				}
+				vector<long long> &r = local[docs[di][wi]];
+				if(!r.empty() && r.back() >= begin)
+					r.back() = max(r.back(), end);
+				else{
+					r.push_back(begin);
+					r.push_back(end);
+				}
+			}
+		}
+	});
+
+	runs.assign(num_words, vector<long long>());
+	bits.assign(num_words, vector<unsigned long long>());
+	totals.assign(num_words, 0);
+	parallel_for(0, num_words, num_threads, [&](int w){
+		vector<long long> &r = runs[w];
+		for(int p = 0; p < num_parts; p++){
+			vector<long long> &part = parts[p][w];
+			for(size_t i = 0; i < part.size(); i += 2){
+				if(!r.empty() && r.back() >= part[i])
+					r.back() = max(r.back(), part[i + 1]);
+				else{
+					r.push_back(part[i]);
+					r.push_back(part[i + 1]);
+				}
+			}
+			vector<long long>().swap(part);
+		}
+		for(size_t i = 0; i < r.size(); i += 2)
+			totals[w] += r[i + 1] - r[i];
+
+		//a bitset costs num_contexts / 8 bytes, about what the runs of a word this frequent take
+		if(totals[w] * 64 >= num_contexts && num_contexts > 0){
+			vector<unsigned long long> &b = bits[w];
+			b.assign((num_contexts + 63) / 64, 0ULL);
+			for(size_t i = 0; i < r.size(); i += 2)
+				for(long long ci = r[i]; ci < r[i + 1]; ci++)
+					b[ci >> 6] |= 1ULL << (ci & 63);
+		}
+	});
+}
+
+long long CoherenceIndex::count(int w) const{
+	return totals[w];
+}
+
+long long CoherenceIndex::count_bits(const vector<unsigned long long> &b, long long begin, long long end) const{
+	long long first = begin >> 6, last = (end - 1) >> 6;
+	unsigned long long head = ~0ULL << (begin & 63);
+	unsigned long long tail = ~0ULL >> (63 - ((end - 1) & 63));
+	if(first == last)
+		return __builtin_popcountll(b[first] & head & tail);
+	long long n = __builtin_popcountll(b[first] & head) + __builtin_popcountll(b[last] & tail);
+	for(long long i = first + 1; i < last; i++)
+		n += __builtin_popcountll(b[i]);
+	return n;
+}
+
+long long CoherenceIndex::count(int a, int b) const{
+	if(a == b)
+		return totals[a];
+	const vector<unsigned long long> &ba = bits[a], &bb = bits[b];
+	if(!ba.empty() && !bb.empty()){
+		//plain loop over whole words; vectorizes to SIMD popcounts where the target has them
+		long long n = 0;
+		const unsigned long long *x = ba.data(), *y = bb.data();
+		size_t size = ba.size();
+		for(size_t i = 0; i < size; i++)
+			n += __builtin_popcountll(x[i] & y[i]);
+		return n;
+	}
+	if(!ba.empty() || !bb.empty()){ //the runs of the sparse word against the bitset of the dense one
+		const vector<unsigned long long> &dense = ba.empty() ? bb : ba;
+		const vector<long long> &r = ba.empty() ? runs[a] : runs[b];
+		long long n = 0;
+		for(size_t i = 0; i < r.size(); i += 2)
+			n += count_bits(dense, r[i], r[i + 1]);
+		return n;
+	}
+	//both sparse: merge the two run lists
+	const vector<long long> &ra = runs[a], &rb = runs[b];
+	long long n = 0;
+	size_t i = 0, j = 0;
+	while(i < ra.size() && j < rb.size()){
+		long long begin = max(ra[i], rb[j]);
+		long long end = min(ra[i + 1], rb[j + 1]);
+		if(begin < end)
+			n += end - begin;
+		if(ra[i + 1] < rb[j + 1])
+			i += 2;
+		else
+			j += 2;
+	}
+	return n;
+}
+
+Coherence::Coherence(const vector<vector<int>> &docs, int num_words, vector<string> measures, int num_threads):
+		measures(measures){
+	for(size_t mi = 0; mi < measures.size(); mi++){
+		if(!known(measures[mi])){
+			cerr << "unknown coherence measure: " << measures[mi] << endl;
+			exit(1);
+		}
+		int window = window_of(measures[mi]);
+		if(indices.find(window) == indices.end())
+			indices[window] = CoherenceIndex(docs, num_words, window, num_threads);
+	}
+}
+
+bool Coherence::known(string measure){
+	return measure == "u_mass" || measure == "c_uci" || measure == "c_npmi" || measure == "c_v";
+}
+
+int Coherence::window_of(string measure){ //gensim's default window of each measure
+	if(measure == "c_v")
+		return 110;
+	if(measure == "c_uci" || measure == "c_npmi")
+		return 10;
+	return 0;
+}
+
+double Coherence::topic_score(const vector<int> &topic, string measure) const{
+	const CoherenceIndex &index = indices.at(window_of(measure));
+	int n = topic.size();
+	double num_contexts = index.num_contexts;
+
+	//joint probabilities of all word pairs, the marginals on the diagonal
+	vector<vector<double>> p(n, vector<double>(n));
+	for(int i = 0; i < n; i++)
+		for(int j = 0; j <= i; j++)
+			p[i][j] = p[j][i] = index.count(topic[i], topic[j]) / num_contexts;
+	auto pmi = [&](int i, int j){ return log((p[i][j] + EPSILON) / (p[i][i] * p[j][j])); };
+	auto npmi = [&](int i, int j){ return pmi(i, j) / -log(p[i][j] + EPSILON); };
+
+	double total = 0.0;
+	int num_segments = 0;
+	if(measure == "u_mass"){ //every word against each word ranked above it
+		for(int i = 1; i < n; i++)
+			for(int j = 0; j < i; j++, num_segments++)
+				total += log((p[i][j] + EPSILON) / p[j][j]);
+	} else if(measure == "c_uci" || measure == "c_npmi"){ //every ordered pair of distinct words
+		for(int i = 0; i < n; i++)
+			for(int j = 0; j < n; j++)
+				if(i != j){
+					total += measure == "c_uci" ? pmi(i, j) : npmi(i, j);
+					num_segments++;
+				}
+	} else{ //c_v: each word's NPMI vector against the sum of all of them
+		vector<vector<double>> v(n, vector<double>(n));
+		vector<double> sum(n, 0.0);
+		for(int i = 0; i < n; i++)
+			for(int j = 0; j < n; j++){
+				v[i][j] = npmi(i, j);
+				sum[j] += v[i][j];
+			}
+		double sum_norm = 0.0;
+		for(int j = 0; j < n; j++)
+			sum_norm += sum[j] * sum[j];
+		for(int i = 0; i < n; i++, num_segments++){
+			double dot = 0.0, norm = 0.0;
+			for(int j = 0; j < n; j++){
+				dot += v[i][j] * sum[j];
+				norm += v[i][j] * v[i][j];
+			}
+			total += dot / sqrt(norm * sum_norm);
+		}
+	}
+	return num_segments > 0 ? total / num_segments : 0.0;
+}
+
+vector<vector<double>> Coherence::topic_scores(const vector<vector<vector<int>>> &models, string measure, int num_threads) const{
+	vector<vector<double>> scores(models.size());
+	vector<pair<int, int>> tasks; //(model, topic)
+	for(size_t mi = 0; mi < models.size(); mi++){
+		scores[mi].resize(models[mi].size());
+		for(size_t ti = 0; ti < models[mi].size(); ti++)
+			tasks.push_back(make_pair(mi, ti));
+	}
+	parallel_steal(tasks.size(), num_threads, [&](int task, int){
+		int mi = tasks[task].first, ti = tasks[task].second;
+		scores[mi][ti] = topic_score(models[mi][ti], measure);
+	});
+	return scores;
+}
+
+double Coherence::score(const vector<vector<int>> &topics, string measure, int num_threads) const{
+	vector<double> scores = topic_scores(vector<vector<vector<int>>>(1, topics), measure, num_threads)[0];
+	double total = 0.0;
+	for(size_t ti = 0; ti < scores.size(); ti++)
+		total += scores[ti];
+	return scores.empty() ? 0.0 : total / scores.size();
+}
+
+/*
+ * This file implements native topic coherence, in place of gensim's CoherenceModel.
+ * - CoherenceIndex: Built once per corpus and window; for each word, the runs of documents or
+ *   sliding windows containing it, plus a packed bitset for frequent words. Pair counts intersect
+ *   two bitsets with popcounts, a run list with a bitset, or two run lists by merging.
+ * - Coherence: u_mass, c_uci, c_npmi and c_v of a topic's top words, following gensim's
+ *   segmentations and confirmation measures, scored over all topics of many models in parallel
+ *   against the same indices.
+ */
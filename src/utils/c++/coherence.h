@@ -0,0 +1,54 @@
+#ifndef COHERENCE_H_
+#define COHERENCE_H_
+
+#include <vector>
+#include <string>
+#include <map>
+using namespace std;
+
+// Which co-occurrence contexts of a corpus contain each word: a context is a whole document
+// (window 0, gensim's boolean_document) or one sliding window of window tokens (gensim's
+// boolean_sliding_window; a document shorter than the window is one context). Contexts are
+// numbered document after document, and every word keeps the sorted, disjoint [begin, end)
+// runs of contexts it occurs in. Words found in at least 1/64 of the contexts also keep a packed
+// bitset, so two frequent words are intersected 64 contexts per popcount.
+class CoherenceIndex {
+public:
+	int window;
+	long long num_contexts;
+	vector<vector<long long>> runs; //per word, begin0, end0, begin1, end1, ...
+	vector<vector<unsigned long long>> bits; //per word, empty unless the word is dense
+	vector<long long> totals; //contexts containing each word
+
+	CoherenceIndex();
+	CoherenceIndex(const vector<vector<int>> &docs, int num_words, int window, int num_threads = 1);
+
+	long long count(int w) const;
+	long long count(int a, int b) const; //contexts containing both words
+
+private:
+	long long count_bits(const vector<unsigned long long> &b, long long begin, long long end) const;
+};
+
+// Topic coherence as gensim's CoherenceModel computes it, for topics given as their top word ids:
+// u_mass (log conditional probability over preceding words, document contexts), c_uci (PMI,
+// windows of 10), c_npmi (normalized PMI, windows of 10) and c_v (cosine between NPMI context
+// vectors of each word and of the whole topic, windows of 110). One index is built per distinct
+// window the measures need, once per corpus, and is shared by every model scored against it.
+class Coherence {
+public:
+	vector<string> measures;
+	map<int, CoherenceIndex> indices; //by window
+
+	Coherence(const vector<vector<int>> &docs, int num_words, vector<string> measures, int num_threads = 1);
+
+	static bool known(string measure);
+	static int window_of(string measure);
+
+	double topic_score(const vector<int> &topic, string measure) const;
+	//every topic of every model, on num_threads threads; mean over a model's topics is its coherence
+	vector<vector<double>> topic_scores(const vector<vector<vector<int>>> &models, string measure, int num_threads = 1) const;
+	double score(const vector<vector<int>> &topics, string measure, int num_threads = 1) const;
+};
+
+#endif /* COHERENCE_H_ */
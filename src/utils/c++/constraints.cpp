@@ -0,0 +1,272 @@
+#include "constraints.h"
+
+#include <algorithm>
+#include <utility>
+
+DisjointSets::DisjointSets(int n):parent(n),size(n, 1){
+	for(int i = 0; i < n; i++)
+		parent[i] = i;
+}
+
+int DisjointSets::find(int x){
+	while(parent[x] != x){
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+bool DisjointSets::unite(int a, int b){
+	a = find(a);
+	b = find(b);
+	if(a == b)
+		return false;
+	if(size[a] < size[b])
+		swap(a, b);
+	parent[b] = a;
+	size[a] += size[b];
+	return true;
+}
+
+Constraints::Constraints(){
+	max_variants = 100000;
+	found = NULL;
+	truncated = false;
+	stamp = 0;
+}
+
+void Constraints::compile(int num_words, const vector<vector<int>> &mustlinks,
+		const vector<vector<int>> &cannotlinks){
+	ml_cliques.clear();
+	cl_components.clear();
+	cl_variants.clear();
+
+	//1. must-link components over the constrained words
+	DisjointSets words(num_words);
+	vector<bool> constrained(num_words, false);
+	for(int i = 0; i < mustlinks.size(); i++){
+		for(int j = 0; j < mustlinks[i].size(); j++){
+			constrained[mustlinks[i][j]] = true;
+			words.unite(mustlinks[i][0], mustlinks[i][j]);
+		}
+	}
+	for(int i = 0; i < cannotlinks.size(); i++)
+		for(int j = 0; j < cannotlinks[i].size(); j++)
+			constrained[cannotlinks[i][j]] = true;
+
+	vector<int> clique_of(num_words, -1); //indexed by union-find root, then by word
+	for(int wi = 0; wi < num_words; wi++){
+		if(!constrained[wi])
+			continue;
+		int r = words.find(wi);
+		if(clique_of[r] < 0){
+			clique_of[r] = ml_cliques.size();
+			ml_cliques.push_back(vector<int>());
+		}
+		ml_cliques[clique_of[r]].push_back(wi);
+	}
+	for(int wi = 0; wi < num_words; wi++)
+		if(constrained[wi])
+			clique_of[wi] = clique_of[words.find(wi)];
+	int num_cliques = ml_cliques.size();
+
+	//2. cannot-links lifted to ml cliques, deduplicated
+	vector<pair<int,int>> edges;
+	int conflicts = 0;
+	for(int i = 0; i < cannotlinks.size(); i++){
+		for(int a = 0; a < cannotlinks[i].size(); a++){
+			for(int b = a + 1; b < cannotlinks[i].size(); b++){
+				int ca = clique_of[cannotlinks[i][a]];
+				int cb = clique_of[cannotlinks[i][b]];
+				if(ca == cb){
+					conflicts++;
+					continue;
+				}
+				edges.push_back(make_pair(min(ca, cb), max(ca, cb)));
+			}
+		}
+	}
+	if(conflicts > 0)
+		cerr<< conflicts << " cannot-links join must-linked words and are ignored" <<endl;
+	sort(edges.begin(), edges.end());
+	edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+	//3. connected components of the cannot-link graph
+	DisjointSets cliques(num_cliques);
+	for(int e = 0; e < edges.size(); e++)
+		cliques.unite(edges[e].first, edges[e].second);
+	vector<int> component_of(num_cliques, -1);
+	vector<int> local(num_cliques);
+	for(int ci = 0; ci < num_cliques; ci++){
+		int r = cliques.find(ci);
+		if(component_of[r] < 0){
+			component_of[r] = cl_components.size();
+			cl_components.push_back(vector<int>());
+		}
+		local[ci] = cl_components[component_of[r]].size();
+		cl_components[component_of[r]].push_back(ci);
+	}
+	vector<vector<pair<int,int>>> component_edges(cl_components.size());
+	for(int e = 0; e < edges.size(); e++){
+		int comp = component_of[cliques.find(edges[e].first)];
+		component_edges[comp].push_back(make_pair(local[edges[e].first], local[edges[e].second]));
+	}
+
+	//4. variants of every component
+	for(int comp = 0; comp < cl_components.size(); comp++){
+		int n = cl_components[comp].size();
+		adj.assign(n, vector<int>());
+		for(int e = 0; e < component_edges[comp].size(); e++){
+			adj[component_edges[comp][e].first].push_back(component_edges[comp][e].second);
+			adj[component_edges[comp][e].second].push_back(component_edges[comp][e].first);
+		}
+		for(int v = 0; v < n; v++)
+			sort(adj[v].begin(), adj[v].end());
+
+		mark.assign(n, 0);
+		stamp = 0;
+		vector<vector<int>> sets;
+		found = &sets;
+		truncated = false;
+		vector<int> r, p, x;
+		for(int v = 0; v < n; v++)
+			p.push_back(v);
+		enumerate(r, p, x);
+		if(truncated)
+			cerr<< "cannot-link component " << comp << " has more than " << max_variants
+					<< " variants, keeping the first ones" <<endl;
+
+		for(int s = 0; s < sets.size(); s++){
+			for(int m = 0; m < sets[s].size(); m++)
+				sets[s][m] = cl_components[comp][sets[s][m]];
+			sort(sets[s].begin(), sets[s].end());
+		}
+		cl_variants.push_back(sets);
+	}
+	adj.clear();
+	mark.clear();
+	found = NULL;
+}
+
+void Constraints::mark_all(const vector<int> &set){
+	stamp++;
+	for(int i = 0; i < set.size(); i++)
+		mark[set[i]] = stamp;
+}
+
+// Bron-Kerbosch with pivoting on the complement of the cannot-link graph: r is the current set,
+// p the candidates that may join it, x the vertices already covered by earlier sets. Every step
+// works from the adjacency lists and membership marks, so a level costs the size of p and x plus
+// the cannot-links touching them.
+void Constraints::enumerate(vector<int> &r, vector<int> &p, vector<int> &x){
+	if(found->size() >= max_variants){
+		truncated = true;
+		return;
+	}
+	size_t r_size = r.size();
+
+	//cannot-links of every vertex into p
+	mark_all(p);
+	vector<int> p_degree(p.size()), x_degree(x.size());
+	for(int i = 0; i < p.size(); i++)
+		for(int j = 0; j < adj[p[i]].size(); j++)
+			p_degree[i] += mark[adj[p[i]][j]] == stamp;
+	for(int i = 0; i < x.size(); i++)
+		for(int j = 0; j < adj[x[i]].size(); j++)
+			x_degree[i] += mark[adj[x[i]][j]] == stamp;
+
+	//candidates without a cannot-link into p are in every set from here on, so they join r at once
+	//(a star or a path would otherwise recurse once per leaf); x loses their neighbours
+	bool isolated = false;
+	for(int i = 0; i < p.size() && !isolated; i++)
+		isolated = p_degree[i] == 0;
+	if(isolated){
+		vector<int> rest, rest_degree;
+		for(int i = 0; i < p.size(); i++){
+			if(p_degree[i] == 0){
+				r.push_back(p[i]);
+			}else{
+				rest.push_back(p[i]);
+				rest_degree.push_back(p_degree[i]);
+			}
+		}
+		p.swap(rest);
+		p_degree.swap(rest_degree);
+		stamp++;
+		for(size_t i = r_size; i < r.size(); i++)
+			for(int j = 0; j < adj[r[i]].size(); j++)
+				mark[adj[r[i]][j]] = stamp;
+		vector<int> kept, kept_degree;
+		for(int i = 0; i < x.size(); i++){
+			if(mark[x[i]] != stamp){
+				kept.push_back(x[i]);
+				kept_degree.push_back(x_degree[i]);
+			}
+		}
+		x.swap(kept);
+		x_degree.swap(kept_degree);
+	}
+	if(p.empty()){
+		if(x.empty())
+			found->push_back(r);
+		r.resize(r_size);
+		return;
+	}
+
+	//pivot: the vertex with the fewest cannot-links into p keeps the most candidates out of the loop
+	int pivot = p[0];
+	int best = p.size() + 1;
+	for(int i = 0; i < p.size(); i++){
+		if(p_degree[i] < best){
+			best = p_degree[i];
+			pivot = p[i];
+		}
+	}
+	for(int i = 0; i < x.size(); i++){
+		if(x_degree[i] < best){
+			best = x_degree[i];
+			pivot = x[i];
+		}
+	}
+
+	stamp++; //p minus the pivot's complement neighbours
+	for(int j = 0; j < adj[pivot].size(); j++)
+		mark[adj[pivot][j]] = stamp;
+	vector<int> branch;
+	for(int i = 0; i < p.size(); i++)
+		if(p[i] == pivot || mark[p[i]] == stamp)
+			branch.push_back(p[i]);
+
+	for(int i = 0; i < branch.size(); i++){
+		int v = branch[i];
+		stamp++;
+		mark[v] = stamp;
+		for(int j = 0; j < adj[v].size(); j++)
+			mark[adj[v][j]] = stamp;
+		vector<int> np, nx;
+		for(int j = 0; j < p.size(); j++)
+			if(mark[p[j]] != stamp)
+				np.push_back(p[j]);
+		for(int j = 0; j < x.size(); j++)
+			if(mark[x[j]] != stamp)
+				nx.push_back(x[j]);
+		r.push_back(v);
+		enumerate(r, np, nx);
+		r.pop_back();
+		p.erase(find(p.begin(), p.end(), v));
+		x.push_back(v);
+	}
+	r.resize(r_size);
+}
+
+/*
+ * This file compiles pairwise word constraints into the cliques used by build_tree.
+ *
+ * - DisjointSets: Union-find used for must-link components and cannot-link components.
+ * - Constraints::compile: Groups must-linked words into ml cliques, lifts cannot-links onto them,
+ *   splits the cannot-link graph into connected components and enumerates the variants of each
+ *   component with Bron-Kerbosch. Each recursion level costs its candidate sets plus the
+ *   cannot-links touching them, and candidates without cannot-links join the set together, so
+ *   stars and other sparse components take time near-linear in their constraints; components
+ *   with many variants take time proportional to the variants.
+ */
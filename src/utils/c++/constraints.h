@@ -0,0 +1,45 @@
+#ifndef CONSTRAINTS_H_
+#define CONSTRAINTS_H_
+
+#include <iostream>
+#include <vector>
+using namespace std;
+
+class DisjointSets { //union-find with path halving and union by size
+public:
+	vector<int> parent;
+	vector<int> size;
+
+	DisjointSets(int n);
+	int find(int x);
+	bool unite(int a, int b);
+};
+
+// Turns pairwise must-link / cannot-link word constraints into the cliques the Dirichlet tree is
+// built from. Must-link components come from union-find over the must-link pairs; cannot-links
+// are lifted to those components, and every connected component of the cannot-link graph
+// becomes one multinode whose variants are the maximal sets of components that may share a
+// topic (the maximal cliques of the complement graph, i.e. maximal independent sets).
+class Constraints {
+public:
+	vector<vector<int>> ml_cliques; //words of each must-link component
+	vector<vector<int>> cl_components; //ml clique ids of each cannot-link component
+	vector<vector<vector<int>>> cl_variants; //per cannot-link component, the allowed sets of ml cliques
+	int max_variants; //enumeration stops (with a warning) past this many variants in one component
+
+	Constraints();
+
+	void compile(int num_words, const vector<vector<int>> &mustlinks, const vector<vector<int>> &cannotlinks);
+
+private:
+	vector<vector<int>> adj; //cannot-link neighbours, local indices, sorted
+	vector<int> mark; //stamp per local index, for set membership without clearing
+	int stamp;
+	vector<vector<int>> *found;
+	bool truncated;
+
+	void mark_all(const vector<int> &set);
+	void enumerate(vector<int> &r, vector<int> &p, vector<int> &x);
+};
+
+#endif /* CONSTRAINTS_H_ */
@@ -0,0 +1,308 @@
+#include "distributed.h"
+#include "instrument.h"
+
+#include <iostream>
+#include <cstring>
+#include <thread>
+#include <chrono>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace distributed {
+
+enum Frame { HELLO = 1, CHANGE = 2, TOTAL = 3, REJECT = 4 };
+
+static bool is_tcp(const string &address){
+	return address.find('/') == string::npos && address.rfind(':') != string::npos;
+}
+
+static addrinfo *resolve(const string &address, bool passive){
+	size_t colon = address.rfind(':');
+	string host = address.substr(0, colon), port = address.substr(colon + 1);
+	addrinfo hints, *found = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	if(getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &found) != 0)
+		return NULL;
+	return found;
+}
+
+static bool unix_address(const string &path, sockaddr_un &addr){
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, path.c_str());
+	return true;
+}
+
+int listen_on(string address){
+	int fd = -1;
+	if(is_tcp(address)){
+		addrinfo *found = resolve(address, true);
+		if(found == NULL)
+			return -1;
+		fd = socket(found->ai_family, SOCK_STREAM, 0);
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		bool bound = fd >= 0 && bind(fd, found->ai_addr, found->ai_addrlen) == 0;
+		freeaddrinfo(found);
+		if(!bound){
+			if(fd >= 0)
+				close(fd);
+			return -1;
+		}
+	}else{
+		sockaddr_un addr;
+		if(!unix_address(address, addr))
+			return -1;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(address.c_str());
+		if(fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0){
+			if(fd >= 0)
+				close(fd);
+			return -1;
+		}
+	}
+	if(listen(fd, 128) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int connect_to(string address, double timeout_seconds){
+	double give_up = instrument::now() + timeout_seconds;
+	while(true){
+		int fd = -1;
+		bool connected = false;
+		if(is_tcp(address)){
+			addrinfo *found = resolve(address, false);
+			if(found != NULL){
+				fd = socket(found->ai_family, SOCK_STREAM, 0);
+				connected = fd >= 0 && ::connect(fd, found->ai_addr, found->ai_addrlen) == 0;
+				freeaddrinfo(found);
+			}
+			int on = 1; //deltas are sent whole, there is nothing to coalesce
+			if(connected)
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}else{
+			sockaddr_un addr;
+			if(unix_address(address, addr)){
+				fd = socket(AF_UNIX, SOCK_STREAM, 0);
+				connected = fd >= 0 && ::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0;
+			}
+		}
+		if(connected)
+			return fd;
+		if(fd >= 0)
+			close(fd);
+		if(instrument::now() > give_up)
+			return -1;
+		this_thread::sleep_for(chrono::milliseconds(100));
+	}
+}
+
+static bool send_all(int fd, const void *data, size_t bytes){
+	const char *at = (const char *)data;
+	while(bytes > 0){
+		ssize_t n = send(fd, at, bytes, MSG_NOSIGNAL);
+		if(n <= 0)
+			return false;
+		at += n;
+		bytes -= n;
+	}
+	return true;
+}
+
+static bool recv_all(int fd, void *data, size_t bytes){
+	char *at = (char *)data;
+	while(bytes > 0){
+		ssize_t n = recv(fd, at, bytes, 0);
+		if(n <= 0)
+			return false;
+		at += n;
+		bytes -= n;
+	}
+	return true;
+}
+
+//a frame is its type and payload length, then the payload
+static bool send_frame(int fd, long long type, const void *payload, long long bytes){
+	long long header[2] = {type, bytes};
+	return send_all(fd, header, sizeof(header)) && send_all(fd, payload, bytes);
+}
+
+static bool recv_frame(int fd, long long &type, vector<char> &payload){
+	long long header[2];
+	if(!recv_all(fd, header, sizeof(header)) || header[1] < 0)
+		return false;
+	type = header[0];
+	payload.resize(header[1]);
+	return recv_all(fd, payload.data(), header[1]);
+}
+
+CountClient::CountClient(): bytes_sent(0), bytes_received(0), fd(-1){
+}
+
+CountClient::~CountClient(){
+	if(fd >= 0)
+		close(fd); //the server takes the closed connection as this worker leaving
+}
+
+bool CountClient::connect(string address, int worker_id, int num_workers, long long num_counts,
+		unsigned long long fingerprint){
+	fd = connect_to(address, 60);
+	if(fd < 0){
+		cerr << "cannot reach the count server at " << address << endl;
+		return false;
+	}
+	long long hello[4] = {worker_id, num_workers, num_counts, (long long)fingerprint};
+	long long type;
+	vector<char> payload;
+	if(!send_frame(fd, HELLO, hello, sizeof(hello)) || !recv_frame(fd, type, payload)){
+		cerr << "lost the count server" << endl;
+		return false;
+	}
+	if(type == REJECT){ //the server answers HELLO with HELLO, or with REJECT
+		cerr << "the count server turned this worker away: its worker count, topics, tree or -r seed"
+				<< " differ from the other workers'" << endl;
+		return false;
+	}
+	return type == HELLO;
+}
+
+bool CountClient::exchange(const Delta &change, Delta &total){
+	long long bytes = change.size() * sizeof(change[0]);
+	if(!send_frame(fd, CHANGE, change.data(), bytes))
+		return false;
+	bytes_sent += bytes + 2 * sizeof(long long);
+	long long type;
+	vector<char> payload;
+	if(!recv_frame(fd, type, payload) || type != TOTAL)
+		return false;
+	bytes_received += payload.size() + 2 * sizeof(long long);
+	const pair<unsigned, int> *sums = (const pair<unsigned, int> *)payload.data();
+	total.assign(sums, sums + payload.size() / sizeof(total[0]));
+	return true;
+}
+
+CountServer::CountServer(int num_workers): num_workers(num_workers), num_counts(0), fingerprint(0), rounds(0),
+		bytes_received(0), bytes_sent(0){
+}
+
+bool CountServer::serve(string address){
+	int listen_fd = listen_on(address);
+	if(listen_fd < 0){
+		cerr << "cannot listen on " << address << endl;
+		return false;
+	}
+	vector<int> workers(num_workers, -1);
+	for(int joined = 0; joined < num_workers; ){
+		int fd = accept(listen_fd, NULL, NULL);
+		long long type;
+		vector<char> payload;
+		if(fd < 0 || !recv_frame(fd, type, payload) || type != HELLO || payload.size() != 4 * sizeof(long long)){
+			if(fd >= 0)
+				close(fd);
+			continue;
+		}
+		const long long *hello = (const long long *)payload.data();
+		int id = hello[0];
+		if(id < 0 || id >= num_workers || hello[1] != num_workers || workers[id] >= 0
+				|| (joined > 0 && (hello[2] != num_counts || (unsigned long long)hello[3] != fingerprint))){
+			cerr << "turning away worker " << id << ": it does not fit the other workers (worker count, "
+					<< "topics, tree or -r seed)" << endl;
+			send_frame(fd, REJECT, NULL, 0);
+			close(fd);
+			continue;
+		}
+		if(!send_frame(fd, HELLO, NULL, 0)){
+			close(fd);
+			continue;
+		}
+		num_counts = hello[2];
+		fingerprint = hello[3];
+		workers[id] = fd;
+		joined++;
+	}
+	close(listen_fd);
+	if(!is_tcp(address))
+		unlink(address.c_str());
+	counts.assign(num_counts, 0);
+	cout << num_workers << " workers joined, " << num_counts << " counts" << endl;
+
+	//rounds: every worker still there sends its change, all of them get the sum
+	double start = instrument::now();
+	vector<int> round(num_counts, 0);
+	vector<unsigned> touched;
+	Delta total;
+	vector<char> payload;
+	while(true){
+		int active = 0;
+		for(int w = 0; w < num_workers; w++){
+			if(workers[w] < 0)
+				continue;
+			long long type;
+			if(!recv_frame(workers[w], type, payload) || type != CHANGE){ //done, or gone
+				close(workers[w]);
+				workers[w] = -1;
+				continue;
+			}
+			active++;
+			bytes_received += payload.size() + 2 * sizeof(long long);
+			const pair<unsigned, int> *change = (const pair<unsigned, int> *)payload.data();
+			for(size_t i = 0; i < payload.size() / sizeof(change[0]); i++){
+				unsigned at = change[i].first;
+				if(at >= num_counts)
+					continue;
+				if(round[at] == 0)
+					touched.push_back(at);
+				round[at] += change[i].second;
+			}
+		}
+		if(active == 0)
+			break;
+		total.clear();
+		for(size_t i = 0; i < touched.size(); i++){
+			unsigned at = touched[i];
+			if(round[at] != 0){
+				total.push_back(make_pair(at, round[at]));
+				counts[at] += round[at];
+				round[at] = 0;
+			}
+		}
+		touched.clear();
+		long long bytes = total.size() * sizeof(total[0]);
+		for(int w = 0; w < num_workers; w++)
+			if(workers[w] >= 0 && send_frame(workers[w], TOTAL, total.data(), bytes))
+				bytes_sent += bytes + 2 * sizeof(long long);
+		rounds++;
+	}
+	cout << rounds << " rounds in " << instrument::now() - start << "s, " << bytes_received / 1e6
+			<< " MB in, " << bytes_sent / 1e6 << " MB out" << endl;
+	return true;
+}
+
+}
+
+/*
+ * This file implements the count server and its client for distributed training.
+ * - listen_on/connect_to: TCP ("host:port") or Unix domain sockets (a path); workers retry until
+ *   the server is up.
+ * - CountClient: A worker's connection; exchange() sends its sparse change and returns the sum of
+ *   every worker's change in the round.
+ * - CountServer: Waits for all workers, turning away any whose count size or model fingerprint
+ *   differs from the first one's, then runs rounds in lockstep: it reads every remaining
+ *   worker's change, adds them into the global counts, and sends the non-zero sum back to each.
+ *   A worker that closes its connection has left; the server stops when none are left.
+ */
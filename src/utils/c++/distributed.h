@@ -0,0 +1,63 @@
+#ifndef DISTRIBUTED_H_
+#define DISTRIBUTED_H_
+
+#include <vector>
+#include <string>
+using namespace std;
+
+// Distributed training: several worker processes, each training on its own shard of the documents
+// (its z and nd), keep one set of topic counts in step through a count server. After every piece
+// of an epoch a worker sends the change of its counts since the last sync, as sparse (index,
+// change) pairs over its edges followed by its sums; once every worker has sent its change, the
+// server adds them to the global counts and sends every worker their sum, which brings each
+// worker's counts to the new global counts.
+//
+// The counts only add up if every worker samples under the same tree: the same topics, tree layout
+// and multinode variants (y, drawn from the -r seed). Workers send a fingerprint of these when they
+// join, and the server turns away one that does not match the others.
+//
+// Addresses are "host:port" for TCP or a path for a Unix domain socket; messages are frames of a
+// type, a length and a payload.
+namespace distributed {
+
+	typedef vector<pair<unsigned, int>> Delta;
+
+	int listen_on(string address); //-1 on failure
+	int connect_to(string address, double timeout_seconds); //retries until the server is up
+
+	class CountClient { //a worker's connection to the count server
+	public:
+		CountClient();
+		~CountClient();
+
+		bool connect(string address, int worker_id, int num_workers, long long num_counts,
+				unsigned long long fingerprint);
+
+		//sends this worker's change and waits for the sum of every worker's change in this round
+		bool exchange(const Delta &change, Delta &total);
+
+		long long bytes_sent;
+		long long bytes_received;
+
+	private:
+		int fd;
+	};
+
+	class CountServer {
+	public:
+		int num_workers;
+		long long num_counts; //edges then sums, of all topics
+		unsigned long long fingerprint; //of the model every worker samples under
+		vector<long long> counts; //the global counts
+		long long rounds;
+		long long bytes_received;
+		long long bytes_sent;
+
+		CountServer(int num_workers);
+
+		//waits for num_workers workers, then syncs rounds until every worker has left
+		bool serve(string address);
+	};
+}
+
+#endif /* DISTRIBUTED_H_ */
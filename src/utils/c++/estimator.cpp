@@ -12,6 +12,12 @@
 #include "estimator.h"
 #include "nodes.h"
 #include "utility.h"
+#include "instrument.h"
+#include "constraints.h"
+#include "numa.h"
+#include "sparse_phi.h"
+#include "bundle.h"
+#include "distributed.h"
 
 #include<iostream>
 #include<cmath>
@@ -26,19 +32,75 @@
 #include <set>
 #include <cassert>
 #include <algorithm>
+#include <mutex>
+#include <thread>
+#include <cctype>
+#include <limits>
 
 using namespace std;
 using namespace utils;
+using namespace instrument;
+
+Corpus::Corpus(){
+	num_docs = 0;
+}
 
 Estimator::Estimator(double alpha, double beta, double eta,
-		int num_topics, int num_words, int rand_seed):alpha(alpha),beta(beta),
+		int num_topics, int num_words, int rand_seed):corpus(new Corpus()),alpha(alpha),beta(beta),
 				eta(eta),num_topics(num_topics),num_words(num_words),
-				rand_seed(rand_seed){
-		srand(rand_seed);
+				rand_seed(rand_seed),num_docs(corpus->num_docs),docs(corpus->docs),
+				doc_lens(corpus->doc_lens),tree(new ROOT()),root(*tree),vocab(corpus->vocab),
+				vocab2id(corpus->vocab2id),rng(rand_seed){
+		num_threads = 1;
+		sparse_theta = false;
+		word_major = false;
+		group_words = false;
+		block_rotation = false;
+		data_parallel = false;
+		hogwild = false;
+		numa_aware = false;
+		phi_mass = 0;
+		phi_log8 = false;
+		bundle = false;
+		worker_id = 0;
+		num_workers = 1;
+		syncs_per_epoch = 1;
+		numa_placed = 0;
+		theta_valid = false;
+		phi_valid = false;
+		word_phi_valid = false;
+
+}
 
+Estimator::Estimator(const Estimator &base, int num_topics, int rand_seed):corpus(base.corpus),
+				alpha(base.alpha),beta(base.beta),eta(base.eta),num_topics(num_topics),
+				num_words(base.num_words),rand_seed(rand_seed),num_docs(corpus->num_docs),
+				docs(corpus->docs),doc_lens(corpus->doc_lens),tree(base.tree),root(*tree),
+				leafmap(base.leafmap),vocab(corpus->vocab),vocab2id(corpus->vocab2id),
+				ml_cliques(base.ml_cliques),cl_cliques(base.cl_cliques),
+				cl_variants(base.cl_variants),rng(rand_seed){
+		num_threads = base.num_threads;
+		sparse_theta = base.sparse_theta;
+		word_major = base.word_major;
+		group_words = base.group_words;
+		block_rotation = base.block_rotation;
+		data_parallel = base.data_parallel;
+		hogwild = base.hogwild;
+		numa_aware = base.numa_aware;
+		phi_mass = base.phi_mass;
+		phi_log8 = base.phi_log8;
+		bundle = base.bundle;
+		worker_id = base.worker_id;
+		num_workers = base.num_workers;
+		syncs_per_epoch = base.syncs_per_epoch;
+		numa_placed = 0;
+		theta_valid = false;
+		phi_valid = false;
+		word_phi_valid = false;
 }
 
 void Estimator::readin_vocab(string vocab_file){
+	PROFILE_SCOPE("readin_vocab");
 	ifstream file(vocab_file);
 	if(file.fail()){
 		cerr<< "vocab file does not exist" <<endl;
@@ -55,37 +117,122 @@ void Estimator::readin_vocab(string vocab_file){
 }
 
 void Estimator::readin_data(string data_file){
+	PROFILE_SCOPE("readin_data");
 
-	ifstream file(data_file);
-
-	if(file.fail()){
+	string text;
+	if(!read_file(data_file, text)){
 		cerr<< "data file does not exist" <<endl;
 		exit(1);
-	} else
-	{
-		string line;
-		std::map<string,int> vocab_iter;
-		while(getline(file, line)){
+	}
+	shard_lines(text);
+	//each thread tokenizes a run of whole lines, one document per line; runs are joined in order
+	vector<size_t> bounds = line_chunks(text, num_threads);
+	vector<vector<vector<int>>> parts(num_threads);
+	parallel_for(0, num_threads, num_threads, [&](int p){
+		const char *at = text.data() + bounds[p];
+		const char *end = text.data() + bounds[p + 1];
+		while(at < end){
+			const char *eol = find(at, end, '\n');
 			vector<int> temp_doc;
-			stringstream linestream(line);
-			string word;
-			while(linestream >> word){
-				//vocab_iter = vocab2id.find(word);
-				int tok =  vocab2id.find(word)->second;
-				temp_doc.push_back(tok);
+			for(const char *c = at; c < eol; ){
+				while(c < eol && isspace((unsigned char)*c))
+					c++;
+				const char *word = c;
+				while(c < eol && !isspace((unsigned char)*c))
+					c++;
+				if(c > word)
+					temp_doc.push_back(vocab2id.find(string(word, c))->second);
+			}
+			parts[p].push_back(move(temp_doc));
+			at = eol + 1;
+		}
+	});
+	for(int p = 0; p < num_threads; p++){
+		for(int di = 0; di < parts[p].size(); di++){
+			doc_lens.push_back(parts[p][di].size());
+			docs.push_back(move(parts[p][di]));
+		}
+	}
+	num_docs = docs.size();
+}
+
+long long Estimator::shard_lines(string &text) const{
+	if(count_server.empty() || num_workers <= 1)
+		return 0;
+	long long num_lines = count(text.begin(), text.end(), '\n') + (!text.empty() && text.back() != '\n');
+	long long first = num_lines * worker_id / num_workers, last = num_lines * (worker_id + 1) / num_workers;
+	if(first == last){
+		text.clear();
+		return first;
+	}
+	size_t begin = 0, end = 0;
+	for(long long line = 0, at = 0; at < (long long)text.size() && line < last; line++){
+		size_t eol = text.find('\n', at);
+		eol = eol == string::npos ? text.size() : eol + 1;
+		if(line == first)
+			begin = at;
+		at = eol;
+		end = eol;
+	}
+	text.erase(end);
+	text.erase(0, begin);
+	return first;
+}
+
+bool Estimator::readin_z(string z_file, vector<vector<int>> &z){
+	PROFILE_SCOPE("readin_z");
+	string text;
+	if(!read_file(z_file, text))
+		return false;
+	long long first_line = shard_lines(text);
+	vector<size_t> bounds = line_chunks(text, num_threads);
+	vector<vector<vector<int>>> parts(num_threads);
+	vector<pair<long long, string>> bad(num_threads, make_pair(-1LL, string())); //first bad label of each part, by line
+	parallel_for(0, num_threads, num_threads, [&](int p){
+		const char *at = text.data() + bounds[p];
+		const char *end = text.data() + bounds[p + 1];
+		while(at < end){
+			const char *eol = find(at, end, '\n');
+			vector<int> temp_z;
+			for(const char *c = at; c < eol; ){
+				while(c < eol && isspace((unsigned char)*c))
+					c++;
+				const char *tok = c;
+				while(c < eol && !isspace((unsigned char)*c))
+					c++;
+				if(c == tok)
+					continue;
+				char *parsed;
+				long label = strtol(tok, &parsed, 10);
+				if(parsed != c || label < 0 || label >= num_topics){
+					if(bad[p].first < 0)
+						bad[p] = make_pair((long long)parts[p].size(), string(tok, c));
+					label = 0;
+				}
+				temp_z.push_back(label);
 			}
-				//temp_doc.push_back(stoi(word));
-				//temp_doc.push_back(vocab2id.   .(word));
-			doc_lens.push_back(temp_doc.size());
-			docs.push_back(temp_doc);
+			parts[p].push_back(move(temp_z));
+			at = eol + 1;
+		}
+	});
+	long long line = first_line;
+	for(int p = 0; p < num_threads; p++){
+		if(bad[p].first >= 0){
+			cerr<< z_file << " line " << line + bad[p].first + 1 << ": \"" << bad[p].second
+					<< "\" is not a topic label of 0.." << num_topics - 1 <<endl;
+			exit(1);
 		}
-		num_docs = docs.size();
-		file.close();
-		//cout<<"readin_data methods. number of docs: " << docs.size() <<endl;
+		line += parts[p].size();
 	}
+	z.clear();
+	for(int p = 0; p < num_threads; p++)
+		for(int di = 0; di < parts[p].size(); di++)
+			z.push_back(move(parts[p][di]));
+	return true;
 }
 
 void Estimator::readin_clusters(string cluster_file){
+	PROFILE_SCOPE("readin_clusters");
 	ifstream file(cluster_file);
 	if(file.fail()){
 		cerr<< "data file does not exist" <<endl;
@@ -97,139 +244,174 @@ void Estimator::readin_clusters(string cluster_file){
 			vector<int> temp;
 			stringstream linestream(line);
 			string token;
-			while(getline(linestream, token, ','))
-				temp.push_back( vocab2id[token]);
+			while(getline(linestream, token, ',')){
+				map<string, int>::iterator it = vocab2id.find(token); //find, not [], as data may be parsing
+				temp.push_back(it == vocab2id.end() ? 0 : it->second);
+			}
 			ml_cliques.push_back(temp);
 			wordcount += temp.size();
 		}
 		assert(wordcount == num_words);
 		int num_cliques = ml_cliques.size(); //each ml-link is a clique
 		vector<int> temp;
-		for(int i = 0; i < num_cliques; i++)
+		vector<vector<int>> variants; //all cliques cannot-link each other: one variant per clique
+		for(int i = 0; i < num_cliques; i++){
 			temp.push_back(i+wordcount);
+			variants.push_back(vector<int>(1, i+wordcount));
+		}
 		cl_cliques.push_back(temp);
+		cl_variants.push_back(variants);
+
+	}
+}
 
+void Estimator::readin_constraints(string constraint_file){
+	PROFILE_SCOPE("readin_constraints");
+	ifstream file(constraint_file);
+	if(file.fail()){
+		cerr<< "constraint file does not exist" <<endl;
+		exit(1);
+	}
+	//each line is "ml,w1,w2,..." (all words must-link) or "cl,w1,w2,..." (all words pairwise cannot-link)
+	mustlinks.clear();
+	cannotlinks.clear();
+	string line;
+	int unknown = 0;
+	while(getline(file, line)){
+		stringstream linestream(line);
+		string kind, token;
+		if(!getline(linestream, kind, ','))
+			continue;
+		vector<int> temp;
+		while(getline(linestream, token, ',')){
+			map<string, int>::iterator it = vocab2id.find(token);
+			if(it == vocab2id.end())
+				unknown++;
+			else
+				temp.push_back(it->second);
+		}
+		if(temp.size() < 2)
+			continue;
+		if(kind == "ml")
+			mustlinks.push_back(temp);
+		else if(kind == "cl")
+			cannotlinks.push_back(temp);
+		else
+			cerr<< "unknown constraint type " << kind <<endl;
+	}
+	if(unknown > 0)
+		cerr<< unknown << " constraint words are not in the vocab and are ignored" <<endl;
+
+	Constraints constraints;
+	constraints.compile(num_words, mustlinks, cannotlinks);
+	ml_cliques = move(constraints.ml_cliques);
+	cl_cliques.clear();
+	cl_variants.clear();
+	for(int i = 0; i < constraints.cl_components.size(); i++){ //ml clique ids become fake word ids
+		vector<int> &component = constraints.cl_components[i];
+		for(int z = 0; z < component.size(); z++)
+			component[z] += num_words;
+		vector<vector<int>> &variants = constraints.cl_variants[i];
+		for(int j = 0; j < variants.size(); j++)
+			for(int g = 0; g < variants[j].size(); g++)
+				variants[j][g] += num_words;
+		cl_cliques.push_back(move(component));
+		cl_variants.push_back(move(variants));
 	}
+	PROFILE_COUNT("ml_cliques", ml_cliques.size());
+	PROFILE_COUNT("cl_cliques", cl_cliques.size());
 }
 
 void Estimator::build_tree(){
+	double build_start = now();
 	//given ml_clique, cl_clique, beta, W, eta, create a dirichlet tree
 	vector<Node> ml_nodes;
+	ml_nodes.reserve(ml_cliques.size());
+	vector<int> ml_leaves; //leaf counts survive the ml nodes being moved into multinodes
 
 	//build MLnodes for each ml clique will only have leaf children
 	for(int i = 0; i < ml_cliques.size(); i++){//for each ml clique
 		double edgesum = 0;
-		vector<double> edge_weights;
-		vector<double> orig_edge_weights;
-		for(int j = 0; j < ml_cliques[i].size(); j++){
-			edge_weights.push_back(eta * beta);
-			orig_edge_weights.push_back(eta * beta);
+		vector<double> orig_edge_weights(ml_cliques[i].size(), eta * beta);
+		for(int j = 0; j < ml_cliques[i].size(); j++)
 			edgesum += eta * beta;
-		}
-		vector<Node> children;
-		vector<int> maxind;
-		Node ml(edge_weights, children, maxind,0, ml_cliques[i], edgesum, orig_edge_weights, edgesum);
-		ml_nodes.push_back(ml);
+		ml_nodes.emplace_back(vector<Node>(), vector<int>(), 0, ml_cliques[i],
+				move(orig_edge_weights), edgesum);
+		ml_leaves.push_back(ml_cliques[i].size());
 	}
 
 	//build multinodes for each cl_clique
 	vector<MultiNode> multinodes;
+	multinodes.reserve(cl_cliques.size());
+	vector<int> fake_index(ml_cliques.size(), -1); //position of an ml clique within its cl clique
 	for(int i = 0 ; i < cl_cliques.size(); i++){ //each ml-clique is cannot-link with other ml-cliques
-		vector<int> icids;
 		vector<int> fake_words;
 		for(int z= 0; z < cl_cliques[i].size(); z++){
 			int key = cl_cliques[i][z];
 			if (key >= num_words)  //those intermediate nodes must have index greater than num_words
-				icids.push_back(key);
+				fake_words.push_back(key);
 			else
 				cerr<< "intermediate nodes id error" << endl;
 		}
+		int num_fake = fake_words.size();
 
-		for(int z = 0; z < icids.size(); z++)
-			fake_words.push_back(icids[z]);
-
+		const vector<vector<int>> &allowed = cl_variants[i];
 		vector<Node> variations;
 		vector<double> variant_logweights;
 		vector<vector<int>> fake_leafmap;
-
-
-		vector<vector<int>> temp_allow;
-		for(int i = 0; i < ml_cliques.size(); i++){
-				vector<int> temp;
-				temp.push_back(i+num_words);
-				temp_allow.push_back(temp);
+		variations.reserve(allowed.size());
+		variant_logweights.reserve(allowed.size());
+		fake_leafmap.reserve(allowed.size());
+
+		//edge prior of every fake word, and the index of every fake word id
+		vector<double> fake_prior(num_fake);
+		for(int z = 0; z < num_fake; z++){
+			fake_prior[z] = beta * ml_leaves[fake_words[z]-num_words];
+			fake_index[fake_words[z]-num_words] = z;
 		}
 
-		for(int j = 0; j < temp_allow.size(); j++){
-			vector<int> good = temp_allow[j];
-			vector<int> bad;
-			for(int z =0 ; z < fake_words.size(); z++){
-				if( find(good.begin(), good.end(), fake_words[z]) == good.end() )
-					bad.push_back(fake_words[z]);
-			}
+		vector<bool> is_good(num_fake, false);
+		for(int j = 0; j < allowed.size(); j++){
+			//each variant allows a set of ml cliques (good) and puts the others (bad) under the fake root
+			const vector<int> &good = allowed[j];
+			int num_good = good.size();
 
 			vector<double> aedges;
-			vector<double> orig_aedges;
-			for(int z =0; z < good.size(); z++){
-				if(good[z] >= num_words){
-					aedges.push_back( beta * ml_nodes[good[z]-num_words].num_leaves());
-					orig_aedges.push_back(beta * ml_nodes[good[z]-num_words].num_leaves());
-				}else{
-					aedges.push_back(beta);
-					orig_aedges.push_back(beta);
-				}
-			}
-			vector<double> fedges;
-			vector<double> orig_fedges;
+			aedges.reserve(num_good);
 			double aedgesum = 0;
-			for(int z = 0; z<aedges.size(); z++)
-				aedgesum += aedges[z];
-			fedges.push_back(eta * aedgesum);
-			orig_fedges.push_back(eta * aedgesum);
-
-			for(int z= 0 ; z < bad.size(); z++){
-				if(bad[z] >= num_words){
-					fedges.push_back( beta * ml_nodes[bad[z]-num_words].num_leaves());
-					orig_fedges.push_back( beta * ml_nodes[bad[z]-num_words].num_leaves());
-				}else{
-					fedges.push_back(beta);
-					orig_fedges.push_back(beta);
-				}
+			for(int g = 0; g < num_good; g++){
+				is_good[fake_index[good[g]-num_words]] = true;
+				aedges.push_back(beta * ml_leaves[good[g]-num_words]);
+				aedgesum += aedges.back();
 			}
-			vector<Node> children;
-			vector<int> maxind;
-
-			vector<int> temp_words;
-			vector<Node> temp_variants;
-			vector<vector<int>> temp_fake_leafmap;
-			vector<double> logweights;
-			Node likely_internal(aedges, children, maxind, 0, aedgesum, orig_aedges, aedgesum);
 
-			vector<Node> likely_internal_list;
-			likely_internal_list.push_back(likely_internal);
-			vector<int> maxindN;
-			maxindN.push_back(good.size()-1);
+			vector<double> fedges;
+			fedges.reserve(num_fake - num_good + 1);
+			fedges.push_back(eta * aedgesum);
+			for(int z = 0; z < num_fake; z++)
+				if(!is_good[z])
+					fedges.push_back(fake_prior[z]);
 			double fedgesum = 0;
 			for(int z = 0; z < fedges.size(); z++)
 				fedgesum += fedges[z];
 
-			Node fakeroot(fedges, likely_internal_list, maxindN, good.size(), fedgesum, orig_fedges, fedgesum);
+			//fake leaves are ordered good first (in good order), then bad in fake_words order
+			vector<int> fake_leaf(num_fake);
+			for(int g = 0; g < num_good; g++)
+				fake_leaf[fake_index[good[g]-num_words]] = g;
+			int next_bad = num_good;
+			for(int z = 0; z < num_fake; z++)
+				if(!is_good[z])
+					fake_leaf[z] = next_bad++;
+			for(int g = 0; g < num_good; g++)
+				is_good[fake_index[good[g]-num_words]] = false;
 
-			vector<int> fake_wordmap;
-			for(int z = 0; z < good.size(); z++)
-				fake_wordmap.push_back(good[z]);
-			for(int z=0; z < bad.size(); z++)
-				fake_wordmap.push_back(bad[z]);
-
-			vector<int> fake_leaf;
-			for(int z= 0; z < fake_words.size(); z++){
-				int wi = fake_words[z];
-				int index = getIndex(fake_wordmap, wi);
-				fake_leaf.push_back(index);
-			}
+			vector<Node> likely_internal_list;
+			likely_internal_list.emplace_back(vector<Node>(), vector<int>(), 0, move(aedges), aedgesum);
+			vector<int> maxindN(1, num_good - 1);
 
-			variations.push_back(fakeroot);
-			fake_leafmap.push_back(fake_leaf);
+			variations.emplace_back(move(likely_internal_list), move(maxindN), num_good, move(fedges), fedgesum);
+			fake_leafmap.push_back(move(fake_leaf));
 			variant_logweights.push_back(log(aedgesum));
 		}
 
@@ -238,27 +420,26 @@ void Estimator::build_tree(){
 		for(int z = 0; z < cl_cliques[i].size(); z++){
 			int key = cl_cliques[i][z];
 			if (key >= num_words)
-				ichildrenM.push_back(ml_nodes[key-num_words]);
+				ichildrenM.push_back(move(ml_nodes[key-num_words])); //each ml clique sits under one multinode
 			else
 				lchildren.push_back(key);
 		}
 
-		vector<double> edge_weights;
-		vector<int> maxind;
-
-		MultiNode multi(edge_weights,ichildrenM,maxind,0,lchildren,variations, fake_leafmap, variant_logweights);
-		multinodes.push_back(multi);
+		multinodes.emplace_back(move(ichildrenM), vector<int>(), 0, move(lchildren),
+				move(variations), move(fake_leafmap), move(variant_logweights));
 	}
 	int cur_ind = 0;
 	vector<int> wordmap;
+	wordmap.reserve(num_words);
 	double edgesum = 0;
 
 	root = ROOT();
+	leafmap.clear();
 	for(int i= 0; i < multinodes.size(); i++){
 		MultiNode* multi = &(multinodes[i]);
 		for(int j = 0; j < multi->children.size(); j++){
 			Node* ml_child = &(multi->children[j]);
-			vector<int> words = ml_child->words;
+			const vector<int> &words = ml_child->words;
 			for(int w = 0; w < words.size(); w++)
 				wordmap.push_back(words[w]);
 			ml_child->leafstart = cur_ind;
@@ -272,153 +453,675 @@ void Estimator::build_tree(){
 				wordmap.push_back(multi->words[w]);
 		}
 		edgesum += beta * multi->num_leaves();
-		root.edge_weights.push_back(beta * multi->num_leaves());
 		root.orig_edge_weights.push_back(beta * multi->num_leaves());
-		root.children.push_back(*multi);
+		root.children.push_back(move(*multi));
 		root.maxind.push_back(cur_ind -1);
 	}
 
 
 	for(int i = 0 ; i < num_words-cur_ind; i++){
 		edgesum += beta;
-		root.edge_weights.push_back(beta);
 		root.orig_edge_weights.push_back(beta);
 	}
 	root.leafstart = cur_ind;
 
-	root.edgesum = edgesum;
 	root.orig_edgesum = edgesum;
+	root.layout(); //one topic's count slots
 
+	//words outside every clique hang directly off the root, after the clique leaves
+	vector<bool> placed(num_words, false);
+	for(int pos = 0; pos < wordmap.size(); pos++)
+		placed[wordmap[pos]] = true;
 	for(int wi = 0 ; wi < num_words; wi++)
-		if( find(wordmap.begin(), wordmap.end(), wi) == wordmap.end() )
+		if(!placed[wi])
 			wordmap.push_back(wi);
 
-	for(int wi = 0; wi < num_words; wi++)
-		leafmap.push_back( getIndex(wordmap, wi) );
+	leafmap.assign(num_words, -1);
+	for(int pos = 0; pos < wordmap.size(); pos++)
+		leafmap[wordmap[pos]] = pos;
+
+	metrics.phase("build_tree", now() - build_start);
 }
 
 void Estimator::estimate(int epochs){
 
 	//sampling
+	if(epochs > 0)
+		invalidate();
+	long long num_tokens = accumulate(doc_lens.begin(), doc_lens.end(), 0LL);
 	for(int epoch = 0; epoch < epochs; epoch++){ //for each epoch
 		//cout<<"running epoch " <<epoch <<endl;
-		for(int di = 0; di < num_docs; di++){
+		double epoch_start = now();
+		long long num_changed;
+		if(!count_server.empty())
+			num_changed = sample_distributed();
+		else if(block_rotation && num_threads > 1)
+			num_changed = sample_block_rotation();
+		else if((data_parallel || hogwild) && num_threads > 1)
+			num_changed = sample_data_parallel();
+		else if(word_major)
+			num_changed = sample_word_major();
+		else if(group_words)
+			num_changed = sample_doc_grouped();
+		else
+			num_changed = sample_doc_major();
+		report_epoch(epoch, num_tokens, num_changed, now() - epoch_start);
+	}
+	if(!sparse_theta)
+		calc_theta();
+	calc_phi();
+	print_topwords();
+}
+//with K known at compile time the probabilities stay on the stack as running sums, and the draw
+//counts the sums below the target instead of walking them, which unrolls to branch-free code. It
+//picks the same topic as mult_sample: the first whose running sum reaches the target.
+template<int K>
+int Estimator::sample_token_fixed(TopicCounts &counts, doc_count_t *nd_row, int leaf, int z, Random &rng){
+	counts[z].leaf_count_update(-1, leaf);
+	nd_row[z]--;
+
+	double running[K];
+	double probs_sum = 0.0;
+	for(int ti = 0; ti < K; ti++){
+		prob_t prob = counts[ti].wordval_update(1, leaf) * (nd_row[ti]+alpha);
+		probs_sum += prob;
+		running[ti] = probs_sum;
+	}
+	double r = rng.uniform() * probs_sum;
+	int newz = 0;
+	for(int ti = 0; ti < K - 1; ti++)
+		newz += running[ti] < r;
+	nd_row[newz]++;
+	counts[newz].leaf_count_update(1, leaf);
+	return newz;
+}
+
+int Estimator::sample_token(TopicCounts &counts, doc_count_t *nd_row, int leaf, int z, vector<prob_t> &probs, Random &rng){
+	switch(num_topics){
+	case 10: return sample_token_fixed<10>(counts, nd_row, leaf, z, rng);
+	case 20: return sample_token_fixed<20>(counts, nd_row, leaf, z, rng);
+	case 50: return sample_token_fixed<50>(counts, nd_row, leaf, z, rng);
+	case 100: return sample_token_fixed<100>(counts, nd_row, leaf, z, rng);
+	case 200: return sample_token_fixed<200>(counts, nd_row, leaf, z, rng);
+	}
+
+	counts[z].leaf_count_update(-1, leaf);
+	nd_row[z]--;
+
+	double probs_sum = 0.0;
+	for(int ti = 0; ti < num_topics; ti++){
+		double wordterm = counts[ti].wordval_update(1, leaf);
+		probs[ti] = wordterm * (nd_row[ti]+alpha);
+		probs_sum += probs[ti];
+	}
+	int newz = mult_sample(probs, probs_sum, rng);
+	nd_row[newz]++;
+	counts[newz].leaf_count_update(1, leaf);
+	return newz;
+}
+
+long long Estimator::sample_doc_major(){
+	long long num_changed = 0;
+	vector<prob_t> probs(num_topics, 0.0);
+	for(int di = 0; di < num_docs; di++){
+		for(int wi = 0; wi < doc_lens[di]; wi++){
+			int z = samples[di][wi];
+			int newz = sample_token(topics, nd[di].data(), leafmap[docs[di][wi]], z, probs, rng);
+			samples[di][wi] = newz;
+			num_changed += (newz != z);
+		}
+	}
+	return num_changed;
+}
+
+long long Estimator::sample_data_parallel(){
+	if(doc_offsets.size() != num_docs + 1){
+		doc_offsets.assign(num_docs + 1, 0);
+		for(int di = 0; di < num_docs; di++)
+			doc_offsets[di + 1] = doc_offsets[di] + doc_lens[di];
+	}
+	long long total = doc_offsets[num_docs];
+
+	//chunks are equal runs of the token stream, so a long document is cut across several chunks;
+	//a few chunks per thread leave idle threads something to steal
+	int num_chunks = num_threads * 16;
+	const numa::Topology &host = numa::topology();
+	if(numa_aware && numa_placed != num_threads)
+		place_shards(num_chunks);
+
+	//each thread samples against its own stale copy; with hogwild all threads update topics at once,
+	//or with numa_aware the threads of a node update that node's replica, merged after the epoch
+	int num_replicas = !hogwild ? num_threads : numa_aware ? min(host.num_nodes(), num_threads) : 0;
+	vector<TopicCounts> local(num_replicas);
+	auto replica_of = [&](int t){ return hogwild ? host.node_of(t, num_threads) : t; };
+	parallel_for(0, num_threads, numa_aware ? num_threads : 1, [&](int t){
+		if(numa_aware)
+			numa::pin(host.cpu_of(t, num_threads)); //so the replica is first touched on its node
+		if(num_replicas > 0 && (t == 0 || replica_of(t - 1) != replica_of(t))){
+			local[replica_of(t)] = topics;
+			local[replica_of(t)].shared = hogwild;
+		}
+	});
+	topics.shared = num_replicas == 0;
+	unsigned long long epoch_seed = rng.next();
+	vector<long long> changed(num_threads, 0);
+	vector<char> pinned(num_threads, 0);
+	parallel_steal(num_chunks, num_threads, [&](int chunk, int t){
+		if(numa_aware && !pinned[t]){
+			numa::pin(host.cpu_of(t, num_threads));
+			pinned[t] = 1;
+		}
+		TopicCounts &counts = num_replicas > 0 ? local[replica_of(t)] : topics;
+		long long first = total * chunk / num_chunks;
+		long long last = total * (chunk + 1) / num_chunks;
+		Random chunk_rng(epoch_seed + 0x9E3779B97F4A7C15ULL * (chunk + 1));
+		vector<prob_t> probs(num_topics);
+		vector<doc_count_t> row(num_topics), start_row(num_topics);
+		int di = upper_bound(doc_offsets.begin(), doc_offsets.end(), first) - doc_offsets.begin() - 1;
+		for(; di < num_docs && doc_offsets[di] < last; di++){
+			int begin = max(first, doc_offsets[di]) - doc_offsets[di];
+			int end = min(last, doc_offsets[di + 1]) - doc_offsets[di];
+			if(begin >= end)
+				continue;
+			//a whole document belongs to this chunk alone; a piece of one works on a copy of its
+			//row and adds its changes back atomically, as other pieces may be running
+			bool whole = begin == 0 && end == doc_lens[di];
+			doc_count_t *nd_row = nd[di].data();
+			if(!whole){
+				for(int ti = 0; ti < num_topics; ti++)
+					start_row[ti] = row[ti] = __atomic_load_n(nd_row + ti, __ATOMIC_RELAXED);
+				nd_row = row.data();
+			}
+			for(int wi = begin; wi < end; wi++){
+				int z = samples[di][wi];
+				int newz = sample_token(counts, nd_row, leafmap[docs[di][wi]], z, probs, chunk_rng);
+				samples[di][wi] = newz;
+				changed[t] += (newz != z);
+			}
+			if(!whole)
+				for(int ti = 0; ti < num_topics; ti++)
+					if(row[ti] != start_row[ti])
+						__atomic_fetch_add(nd[di].data() + ti, (doc_count_t)(row[ti] - start_row[ti]), __ATOMIC_RELAXED);
+		}
+	});
+
+	topics.shared = false;
+
+	//fold every replica's changes back into the shared counts
+	topics.merge(local, false, num_threads);
+	if(hogwild) //the adds were atomic, but each node's sum and edges moved separately
+		topics.repair_sums();
+	return accumulate(changed.begin(), changed.end(), 0LL);
+}
+
+void Estimator::join_count_server(){
+	if(!count_client){
+		//the workers' counts only add up under the same tree, so the server checks a fingerprint of
+		//the topics, the tree layout, the seed and the variants drawn from it
+		vector<long long> model = {num_topics, root.num_edges, root.num_nodes, root.num_multinodes, rand_seed};
+		model.insert(model.end(), topics.y.begin(), topics.y.end());
+		unsigned long long fingerprint = 0xcbf29ce484222325ULL;
+		for(size_t i = 0; i < model.size(); i++)
+			fingerprint = (fingerprint ^ (unsigned long long)model[i]) * 0x100000001b3ULL;
+		count_client.reset(new distributed::CountClient());
+		if(!count_client->connect(count_server, worker_id, num_workers, topics.edges.size() + topics.sums.size(),
+				fingerprint))
+			exit(1);
+	}
+	synced = TopicCounts(&root, num_topics); //the first change is this shard's whole counts
+	sync_counts();
+}
+
+void Estimator::sync_counts(){
+	PROFILE_SCOPE("sync_counts");
+	//this worker's change since the last round, over the edges and then the sums
+	size_t num_edges = topics.edges.size();
+	distributed::Delta change, total;
+	for(size_t i = 0; i < num_edges; i++)
+		if(topics.edges[i] != synced.edges[i])
+			change.push_back(make_pair(i, topics.edges[i] - synced.edges[i]));
+	for(size_t i = 0; i < topics.sums.size(); i++)
+		if(topics.sums[i] != synced.sums[i])
+			change.push_back(make_pair(num_edges + i, topics.sums[i] - synced.sums[i]));
+	if(!count_client->exchange(change, total)){
+		cerr<< "lost the count server" <<endl;
+		exit(1);
+	}
+	//the new global counts are the last ones plus every worker's change, this one's included
+	for(size_t i = 0; i < change.size(); i++){
+		unsigned at = change[i].first;
+		(at < num_edges ? topics.edges[at] : topics.sums[at - num_edges]) -= change[i].second;
+	}
+	for(size_t i = 0; i < total.size(); i++){
+		unsigned at = total[i].first;
+		(at < num_edges ? topics.edges[at] : topics.sums[at - num_edges]) += total[i].second;
+		(at < num_edges ? synced.edges[at] : synced.sums[at - num_edges]) += total[i].second;
+	}
+	fill(topics.logp.begin(), topics.logp.end(), NAN);
+	PROFILE_COUNT("sync_bytes", count_client->bytes_sent + count_client->bytes_received);
+}
+
+long long Estimator::sample_distributed(){
+	//the shard is sampled document by document in syncs_per_epoch runs, each followed by a round
+	long long num_changed = 0;
+	vector<prob_t> probs(num_topics, 0.0);
+	for(int s = 0; s < syncs_per_epoch; s++){
+		int first = (long long)num_docs * s / syncs_per_epoch;
+		int last = (long long)num_docs * (s + 1) / syncs_per_epoch;
+		for(int di = first; di < last; di++){
 			for(int wi = 0; wi < doc_lens[di]; wi++){
 				int z = samples[di][wi];
-				int word=  docs[di][wi];
-				topics[z].leaf_count_update(-1, leafmap[word]);
+				int newz = sample_token(topics, nd[di].data(), leafmap[docs[di][wi]], z, probs, rng);
+				samples[di][wi] = newz;
+				num_changed += (newz != z);
+			}
+		}
+		sync_counts();
+	}
+	return num_changed;
+}
+
+void Estimator::index_words(){
+	//counting sort of all token positions by word, in document order within a word
+	word_offsets.assign(num_words + 1, 0);
+	for(int di = 0; di < num_docs; di++)
+		for(int wi = 0; wi < doc_lens[di]; wi++)
+			word_offsets[docs[di][wi] + 1]++;
+	for(int w = 0; w < num_words; w++)
+		word_offsets[w + 1] += word_offsets[w];
+	word_docs.resize(word_offsets[num_words]);
+	word_positions.resize(word_offsets[num_words]);
+	vector<int> next(word_offsets.begin(), word_offsets.end() - 1);
+	for(int di = 0; di < num_docs; di++){
+		for(int wi = 0; wi < doc_lens[di]; wi++){
+			int at = next[docs[di][wi]]++;
+			word_docs[at] = di;
+			word_positions[at] = wi;
+		}
+	}
+}
+
+long long Estimator::sample_word_major(){
+	if(word_offsets.size() != num_words + 1)
+		index_words();
+	long long num_changed = 0;
+	vector<double> wordterms(num_topics);
+	vector<prob_t> probs(num_topics);
+	for(int word = 0; word < num_words; word++){
+		if(word_offsets[word] == word_offsets[word + 1])
+			continue;
+		//the word's leaf value in a topic only changes when that topic's counts do, so it is
+		//computed once per word and then refreshed for the two topics touched by each token
+		int leaf = leafmap[word];
+		for(int ti = 0; ti < num_topics; ti++)
+			wordterms[ti] = topics[ti].wordval_update(1, leaf);
+
+		for(int at = word_offsets[word]; at < word_offsets[word + 1]; at++){
+			int di = word_docs[at];
+			int wi = word_positions[at];
+			int z = samples[di][wi];
+			topics[z].leaf_count_update(-1, leaf);
+			nd[di][z]--;
+			wordterms[z] = topics[z].wordval_update(1, leaf);
+
+			double probs_sum = 0.0;
+			for(int ti = 0; ti < num_topics; ti++){
+				probs[ti] = wordterms[ti] * (nd[di][ti]+alpha);
+				probs_sum += probs[ti];
+			}
+			int newz = mult_sample(probs, probs_sum, rng);
+			samples[di][wi] = newz;
+			nd[di][newz]++;
+			topics[newz].leaf_count_update(1, leaf);
+			wordterms[newz] = topics[newz].wordval_update(1, leaf);
+			num_changed += (newz != z);
+		}
+	}
+	return num_changed;
+}
+
+long long Estimator::sample_doc_grouped(){
+	long long num_changed = 0;
+	vector<double> wordterms(num_topics);
+	vector<prob_t> probs(num_topics);
+	vector<int> order;
+	for(int di = 0; di < num_docs; di++){
+		//the document's tokens in word order, so the repeats of a word come one after another
+		const vector<int> &doc = docs[di];
+		order.resize(doc_lens[di]);
+		for(int wi = 0; wi < doc_lens[di]; wi++)
+			order[wi] = wi;
+		sort(order.begin(), order.end(), [&](int a, int b){
+			return doc[a] < doc[b] || (doc[a] == doc[b] && a < b);
+		});
+
+		//between two repeats of a word only the topics the first one left and joined have changed,
+		//so only those two leaf values are recomputed; the rest are reused as they are exact
+		int last_newz = -1;
+		for(int at = 0; at < doc_lens[di]; at++){
+			int wi = order[at];
+			int leaf = leafmap[doc[wi]];
+			bool repeat = at > 0 && doc[order[at - 1]] == doc[wi];
+			int z = samples[di][wi];
+			topics[z].leaf_count_update(-1, leaf);
+			nd[di][z]--;
+			if(!repeat){
+				for(int ti = 0; ti < num_topics; ti++)
+					wordterms[ti] = topics[ti].wordval_update(1, leaf);
+			}else if(z != last_newz){
+				wordterms[z] = topics[z].wordval_update(1, leaf);
+				wordterms[last_newz] = topics[last_newz].wordval_update(1, leaf);
+			}
+
+			double probs_sum = 0.0;
+			for(int ti = 0; ti < num_topics; ti++){
+				probs[ti] = wordterms[ti] * (nd[di][ti]+alpha);
+				probs_sum += probs[ti];
+			}
+			int newz = mult_sample(probs, probs_sum, rng);
+			samples[di][wi] = newz;
+			nd[di][newz]++;
+			topics[newz].leaf_count_update(1, leaf);
+			num_changed += (newz != z);
+			last_newz = newz;
+		}
+	}
+	return num_changed;
+}
+
+void Estimator::partition_blocks(int num_blocks){
+	//column blocks are whole root subtrees (a multinode with all its words, or one free word), so
+	//no two blocks share an edge below the root; they are balanced by tokens, largest first
+	vector<int> word_edge(num_words);
+	vector<long long> edge_tokens(root.orig_edge_weights.size(), 0);
+	for(int w = 0; w < num_words; w++)
+		word_edge[w] = root.edge_of(leafmap[w]);
+	for(int di = 0; di < num_docs; di++)
+		for(int wi = 0; wi < doc_lens[di]; wi++)
+			edge_tokens[word_edge[docs[di][wi]]]++;
+	vector<int> order(edge_tokens.size());
+	iota(order.begin(), order.end(), 0);
+	stable_sort(order.begin(), order.end(), [&](int a, int b){ return edge_tokens[a] > edge_tokens[b]; });
+	vector<long long> load(num_blocks, 0);
+	vector<int> edge_block(edge_tokens.size());
+	for(int i = 0; i < order.size(); i++){
+		int b = min_element(load.begin(), load.end()) - load.begin();
+		edge_block[order[i]] = b;
+		load[b] += edge_tokens[order[i]];
+	}
+
+	//row blocks are runs of documents with about the same number of tokens
+	long long total = accumulate(doc_lens.begin(), doc_lens.end(), 0LL);
+	long long before = 0;
+	block_docs.assign((size_t)num_blocks * num_blocks, vector<int>());
+	block_positions.assign((size_t)num_blocks * num_blocks, vector<int>());
+	for(int di = 0; di < num_docs; di++){
+		int p = total > 0 ? min<long long>(num_blocks - 1, before * num_blocks / total) : 0;
+		for(int wi = 0; wi < doc_lens[di]; wi++){
+			int cell = p * num_blocks + edge_block[word_edge[docs[di][wi]]];
+			block_docs[cell].push_back(di);
+			block_positions[cell].push_back(wi);
+		}
+		before += doc_lens[di];
+	}
+}
+
+long long Estimator::sample_block_rotation(){
+	int num_blocks = num_threads;
+	if(block_docs.size() != (size_t)num_blocks * num_blocks)
+		partition_blocks(num_blocks);
+
+	//thread p samples cell (p, p + round): disjoint documents and disjoint root subtrees, so the
+	//only count shared within a round is each topic's root sum, which every thread keeps a copy of
+	//and which is reconciled between rounds
+	vector<Random> rngs;
+	for(int p = 0; p < num_blocks; p++)
+		rngs.push_back(Random(rng.next()));
+	vector<long long> changed(num_blocks, 0);
+	vector<count_t> start_sums(num_topics);
+	vector<vector<count_t>> sums(num_blocks);
+	for(int round = 0; round < num_blocks; round++){
+		for(int ti = 0; ti < num_topics; ti++)
+			start_sums[ti] = topics[ti].c.sums[root.noff];
+		for(int p = 0; p < num_blocks; p++)
+			sums[p] = start_sums;
+
+		parallel_for(0, num_blocks, num_blocks, [&](int p){
+			const vector<int> &cell_docs = block_docs[p * num_blocks + (p + round) % num_blocks];
+			const vector<int> &cell_positions = block_positions[p * num_blocks + (p + round) % num_blocks];
+			vector<prob_t> probs(num_topics);
+			count_t *sum = sums[p].data();
+			for(int at = 0; at < cell_docs.size(); at++){
+				int di = cell_docs[at];
+				int wi = cell_positions[at];
+				int z = samples[di][wi];
+				int leaf = leafmap[docs[di][wi]];
+				root.leaf_count_update(topics[z].c, -1, leaf, sum[z]);
 				nd[di][z]--;
 
-				vector<double> probs(num_topics, 0.0);
 				double probs_sum = 0.0;
 				for(int ti = 0; ti < num_topics; ti++){
-					double wordterm = topics[ti].wordval_update(1, leafmap[word]);
+					double wordterm = root.wordval_update(topics[ti].c, 1, leaf, sum[ti]);
 					probs[ti] = wordterm * (nd[di][ti]+alpha);
 					probs_sum += probs[ti];
 				}
-				int newz = mult_sample(probs, probs_sum);
+				int newz = mult_sample(probs, probs_sum, rngs[p]);
 				samples[di][wi] = newz;
 				nd[di][newz]++;
-				topics[newz].leaf_count_update(1, leafmap[word]);
+				root.leaf_count_update(topics[newz].c, 1, leaf, sum[newz]);
+				changed[p] += (newz != z);
 			}
-		}
+		});
 
+		for(int ti = 0; ti < num_topics; ti++){
+			Topic topic = topics[ti];
+			int total = start_sums[ti];
+			for(int p = 0; p < num_blocks; p++)
+				total += sums[p][ti] - start_sums[ti];
+			topic.c.sums[root.noff] = total;
+			topic.c.logp[root.noff] = NAN;
+		}
 	}
-	calc_theta();
-	calc_phi();
-	print_topwords();
+	return accumulate(changed.begin(), changed.end(), 0LL);
 }
+
+void Estimator::place_shards(int num_chunks){
+	//first touch: each thread, pinned to its node, re-allocates nd and samples (and docs, unless
+	//another estimator shares the corpus) of the documents in the chunks it starts the epoch with
+	const numa::Topology &host = numa::topology();
+	long long total = doc_offsets[num_docs];
+	bool own_docs = corpus.use_count() == 1;
+	parallel_for(0, num_threads, num_threads, [&](int t){
+		numa::pin(host.cpu_of(t, num_threads));
+		long long first = total * ((long long)num_chunks * t / num_threads) / num_chunks;
+		long long last = total * ((long long)num_chunks * (t + 1) / num_threads) / num_chunks;
+		int di = lower_bound(doc_offsets.begin(), doc_offsets.end() - 1, first) - doc_offsets.begin();
+		for(; di < num_docs && doc_offsets[di] < last; di++){
+			vector<doc_count_t>(nd[di]).swap(nd[di]);
+			vector<int>(samples[di]).swap(samples[di]);
+			if(own_docs)
+				vector<int>(docs[di]).swap(docs[di]);
+		}
+	});
+	numa_placed = num_threads;
+}
+
+void Estimator::report_epoch(int epoch, long long num_tokens, long long num_changed, double seconds){
+	if(!metrics.enabled())
+		return;
+	stringstream line;
+	line << "{\"epoch\":" << epoch
+			<< ",\"num_topics\":" << num_topics
+			<< ",\"tokens\":" << num_tokens
+			<< ",\"seconds\":" << seconds
+			<< ",\"tokens_per_sec\":" << (seconds > 0 ? num_tokens / seconds : 0)
+			<< ",\"z_change_rate\":" << (num_tokens > 0 ? double(num_changed) / num_tokens : 0)
+			<< ",\"peak_rss_kb\":" << peak_rss_kb()
+			<< ",\"elapsed\":" << metrics.elapsed() << "}";
+	metrics.write(line.str());
+}
+
 void Estimator::load_data(string data_file, string z_file, string cluster_file, string vocab_file){
+	//the z file does not depend on the corpus, so with spare threads it is parsed while the corpus loads
+	vector<vector<int>> z;
+	bool have_z = false;
+	if(num_threads > 1){
+		thread z_reader([&](){ have_z = readin_z(z_file, z); });
+		load_corpus(data_file, cluster_file, vocab_file);
+		z_reader.join();
+	}else{
+		load_corpus(data_file, cluster_file, vocab_file);
+		have_z = readin_z(z_file, z);
+	}
+	init_counts(have_z ? &z : NULL);
+}
 
-	//1. read in data
+void Estimator::load_corpus(string data_file, string cluster_file, string vocab_file){
+
+	//1. read in vocab, which the data and the clusters are both looked up in
 	readin_vocab(vocab_file); //vocab, vocab2id
 
+	//2. read in topical clusters or pairwise constraints and 3. create the tree; only the vocab is
+	//needed, so with spare threads this runs while the data is parsed
+	auto tree_stage = [&](){
+		if(constraint_file.empty())
+			readin_clusters(cluster_file); //ml_clique, cl_clique
+		else
+			readin_constraints(constraint_file);
+		build_tree();  //root
+	};
+	thread tree_builder;
+	if(num_threads > 1)
+		tree_builder = thread(tree_stage);
+
+	//4. read in data
 	readin_data(data_file); //num_docs, docs, doc_lens
+	PROFILE_COUNT("num_docs", num_docs);
+	PROFILE_COUNT("num_tokens", accumulate(doc_lens.begin(), doc_lens.end(), 0LL));
 
-	//2. read in topical clusters
-	readin_clusters(cluster_file); //ml_clique, cl_clique
+	if(tree_builder.joinable())
+		tree_builder.join();
+	else
+		tree_stage();
+}
 
-	//3. create tree for each topic
-	build_tree();  //root
+void Estimator::init_topics(){
+	//the corpus has to fit the count types of this build (see utility.h)
+	long long num_tokens = accumulate(doc_lens.begin(), doc_lens.end(), 0LL);
+	int longest = num_docs > 0 ? *max_element(doc_lens.begin(), doc_lens.end()) : 0;
+	if(num_tokens > numeric_limits<count_t>::max()){
+		cerr<< "the corpus has " << num_tokens << " tokens, more than the " << numeric_limits<count_t>::max()
+				<< " the " << 8 * sizeof(count_t) << "-bit topic counts of this build can hold" <<endl;
+		exit(1);
+	}
+	if(longest > numeric_limits<doc_count_t>::max()){
+		cerr<< "the longest document has " << longest << " tokens, more than the " << numeric_limits<doc_count_t>::max()
+				<< " the " << 8 * sizeof(doc_count_t) << "-bit document counts of this build can hold" <<endl;
+		exit(1);
+	}
 
-	//4. initialize counts
-	// Build Dirichlet Tree for each topic
-	vector<double> cedges = root.edge_weights;
-	vector<MultiNode> cchildren = root.children;
-	vector<int> cmaxind = root.maxind;
-	int cleafstart = root.leafstart;
-	double edgesum = root.edgesum;
-	double orig_edgesum = root.orig_edgesum;
-
-	vector<double> orig_edge_weights = root.orig_edge_weights;
-	for(int ti = 0; ti < num_topics; ti++){
-		ROOT newtopic(cedges, cchildren,
-				cmaxind, cleafstart, edgesum, orig_edge_weights, orig_edgesum);
-		topics.push_back(newtopic);
-		topics[ti].sample_node();
+	// every topic shares the Dirichlet tree and starts with zero counts
+	topics = TopicCounts(&root, num_topics);
+	for(int ti = 0; ti < num_topics; ti++)
+		topics[ti].sample_node(rng);
 
-	}
-	vector<int> temp(num_topics,0);
+	vector<doc_count_t> temp(num_topics,0);
 	nd.assign(num_docs, temp);
 
-	vector<double> temp1(num_topics,0);
-	theta.assign(num_docs, temp1);
 	vector<double> temp2(num_words,0);
 	phi.assign(num_topics, temp2);
 
+	samples.clear();
 	for(int di = 0; di < num_docs; di++){
 		vector<int> temp_sample(doc_lens[di], 0);
 		samples.push_back(temp_sample);
 	}
+}
 
-	ifstream zfile(z_file);
-	if(zfile.fail()){
-		//cout<< "z file does not exist, initialize randomly" <<endl;
-		for(int di = 0; di < num_docs; di++){
+void Estimator::add_counts(){
+	//each thread counts a run of documents into its own zero counts, which are added up at the end;
+	//nd rows belong to one run each
+	int num_parts = max(1, min(num_threads, num_docs));
+	vector<TopicCounts> deltas(num_parts > 1 ? num_parts : 0);
+	parallel_for(0, num_parts, num_parts, [&](int p){
+		TopicCounts *counts = &topics;
+		if(num_parts > 1){
+			deltas[p] = TopicCounts(&root, num_topics);
+			counts = &deltas[p];
+		}
+		for(int di = (long long)num_docs * p / num_parts; di < (long long)num_docs * (p + 1) / num_parts; di++){
 			for(int wi = 0; wi < doc_lens[di]; wi++){
 				int word = docs[di][wi];
-				int new_z = rand() % num_topics;
-				samples[di][wi] = new_z;
+				int new_z = samples[di][wi];
 				nd[di][new_z] +=1;
-				topics[new_z].leaf_count_update(1, leafmap[word]);
+				(*counts)[new_z].leaf_count_update(1, leafmap[word]);
 			}
 		}
+	});
+	if(num_parts > 1)
+		topics.merge(deltas, true, num_threads);
+	if(!count_server.empty())
+		join_count_server(); //from here on the counts are those of every shard
+	invalidate();
+}
+void Estimator::init_counts(string z_file){
+	vector<vector<int>> z;
+	bool have_z = readin_z(z_file, z);
+	init_counts(have_z ? &z : NULL);
+}
+
+void Estimator::init_counts(vector<vector<int>> *z){
+	//4. initialize counts
+	PROFILE_SCOPE("init_counts");
+	init_topics();
+
+	if(z == NULL){
+		//cout<< "z file does not exist, initialize randomly" <<endl;
+		for(int di = 0; di < num_docs; di++)
+			for(int wi = 0; wi < doc_lens[di]; wi++)
+				samples[di][wi] = rng.below(num_topics);
 	} else{
 		//cout<< "z file exists, initialize from z file" <<endl;
-		string line;
-		vector<vector<int>> temp_samples;
-		while(getline(zfile, line)){
-			vector<int> temp_z;
-			stringstream linestream(line);
-			string tok;
-			while(linestream >> tok){
-				temp_z.push_back(stoi(tok));
-			}
-			temp_samples.push_back(temp_z);
-		}
-		samples = temp_samples;
+		samples = move(*z);
 
 		//cout<<"num of documents " << num_docs<<endl;
 		//cout<<"samples size " << samples.size()<<endl;
 		assert(samples.size() == num_docs);
+	}
+	add_counts();
+}
 
-
-		for(int di = 0; di < num_docs; di++){
-			for(int wi = 0; wi < doc_lens[di]; wi++){
-				int word = docs[di][wi];
-				int new_z = samples[di][wi];
-				nd[di][new_z] +=1;
-				topics[new_z].leaf_count_update(1, leafmap[word]);
-			}
+void Estimator::init_counts(const Estimator &coarse){
+	//topic k of the coarse model is split into k, k + coarse K, k + 2 * coarse K, ...
+	PROFILE_SCOPE("init_counts");
+	init_topics();
+	int coarse_topics = coarse.num_topics;
+	for(int di = 0; di < num_docs; di++){
+		for(int wi = 0; wi < doc_lens[di]; wi++){
+			int k = coarse.samples[di][wi];
+			int num_splits = (num_topics - 1 - k) / coarse_topics + 1;
+			samples[di][wi] = k + coarse_topics * rng.below(num_splits);
 		}
-
 	}
-	zfile.close();
+	add_counts();
+}
+
+void Estimator::invalidate(){
+	theta_valid = false;
+	phi_valid = false;
+	word_phi_valid = false;
 }
 
 
 
 void Estimator::calc_theta(){
+	if(theta_valid)
+		return;
+	PROFILE_SCOPE("calc_theta");
+	if(theta.size() != num_docs){
+		vector<double> temp(num_topics,0);
+		theta.assign(num_docs, temp);
+	}
 	for(int di = 0; di < num_docs; di++){
 		vector<double> probs;
 		double sum_prob = 0.0;
@@ -433,20 +1136,26 @@ void Estimator::calc_theta(){
 			theta[di][ti] = probs[ti];
 
 	}
+	theta_valid = true;
 }
 
 void Estimator::calc_phi(){
-	for(int ti = 0; ti < num_topics; ti++){
-		vector<double> probs;
-		double sum_prob = 0.0;
-		for(int wi = 0; wi < num_words; wi++){
-			phi[ti][wi] = topics[ti].wordval_update(1, leafmap[wi]);
-			sum_prob += phi[ti][wi];
-		}
-	}
+	if(phi_valid)
+		return;
+	PROFILE_SCOPE("calc_phi");
+	//one top-down sweep per topic fills every leaf, then leaves are mapped back to words
+	parallel_for(0, num_topics, num_threads, [&](int ti){
+		vector<double> leafvals(num_words, 0.0);
+		topics[ti].leafvals_update(1, leafvals);
+		for(int wi = 0; wi < num_words; wi++)
+			phi[ti][wi] = leafvals[leafmap[wi]];
+	});
+	phi_valid = true;
 }
 
 void Estimator::print_topwords(int N){
+	static mutex print_lock; //chains of a sweep print concurrently
+	lock_guard<mutex> lock(print_lock);
 	calc_phi();
 
 	if(num_words < N)
@@ -464,17 +1173,160 @@ void Estimator::print_topwords(int N){
 	}
 }
 
+vector<vector<int>> Estimator::top_words(int N){
+	calc_phi();
+	if(num_words < N)
+		N = num_words;
+	vector<vector<int>> tops(num_topics);
+	for(int ti = 0; ti < num_topics; ti++){
+		vector<int> idx = sort_indexes(phi[ti]);
+		tops[ti].assign(idx.begin(), idx.begin() + N);
+	}
+	return tops;
+}
+
+double Estimator::perplexity(){
+	calc_phi();
+	double loglikelihood = 0.0;
+	long long wordcount = 0;
+	for(int di = 0; di < num_docs; di++){
+		double norm = doc_lens[di] + num_topics * alpha;
+		for(int wi = 0; wi < doc_lens[di]; wi++){
+			int word = docs[di][wi];
+			double pr = 0.0;
+			for(int ti = 0; ti < num_topics; ti++)
+				pr += (nd[di][ti] + alpha) / norm * phi[ti][word];
+			loglikelihood += log(pr);
+			wordcount++;
+		}
+	}
+	return exp(-loglikelihood / wordcount);
+}
+
+vector<vector<double>> Estimator::fold_in(const vector<vector<int>> &new_docs, int iterations){
+	if(!word_phi_valid){
+		calc_phi();
+		word_phi.resize((size_t)num_words * num_topics);
+		for(int ti = 0; ti < num_topics; ti++)
+			for(int wi = 0; wi < num_words; wi++)
+				word_phi[(size_t)wi * num_topics + ti] = phi[ti][wi];
+		word_phi_valid = true;
+	}
+	return fold_in(word_phi.data(), num_topics, alpha, rand_seed, num_threads, new_docs, iterations);
+}
+
+vector<vector<double>> Estimator::fold_in(const double *word_phi, int num_topics, double alpha,
+		int rand_seed, int num_threads, const vector<vector<int>> &new_docs, int iterations){
+	PROFILE_SCOPE("fold_in");
+	int burn_in = iterations / 2;
+	vector<vector<double>> new_theta(new_docs.size(), vector<double>(num_topics, 0.0));
+	parallel_for(0, new_docs.size(), num_threads, [&](int di){
+		const vector<int> &doc = new_docs[di];
+		unsigned long long seed = rand_seed;
+		for(size_t wi = 0; wi < doc.size(); wi++)
+			seed = (seed ^ (unsigned)doc[wi]) * 0x100000001b3ULL;
+		Random doc_rng(seed);
+		vector<int> z(doc.size()), counts(num_topics, 0);
+		vector<double> probs(num_topics);
+		for(size_t wi = 0; wi < doc.size(); wi++){
+			z[wi] = doc_rng.below(num_topics);
+			counts[z[wi]]++;
+		}
+		vector<double> &row = new_theta[di];
+		for(int it = 0; it < iterations; it++){
+			for(size_t wi = 0; wi < doc.size(); wi++){
+				const double *p = word_phi + (size_t)doc[wi] * num_topics;
+				counts[z[wi]]--;
+				double sum = 0.0;
+				for(int ti = 0; ti < num_topics; ti++){
+					sum += (counts[ti] + alpha) * p[ti];
+					probs[ti] = sum;
+				}
+				double u = doc_rng.uniform() * sum;
+				int newz = 0;
+				while(newz < num_topics - 1 && probs[newz] <= u)
+					newz++;
+				z[wi] = newz;
+				counts[newz]++;
+			}
+			if(it >= burn_in)
+				for(int ti = 0; ti < num_topics; ti++)
+					row[ti] += counts[ti] + alpha;
+		}
+		double total = 0.0;
+		for(int ti = 0; ti < num_topics; ti++)
+			total += row[ti];
+		for(int ti = 0; ti < num_topics; ti++)
+			row[ti] = total > 0 ? row[ti] / total : 1.0 / num_topics;
+	});
+	return new_theta;
+}
+
 void Estimator::save(string output_path){
+	PROFILE_SCOPE("save");
 	cout<< "saving parameters " <<endl;
-	calc_theta();
 	calc_phi();
 
-	string theta_file = output_path + "theta.dat";
 	string phi_file = output_path + "phi.dat";
 	string sample_file = output_path + "z.final.dat";
-	save_matrix(theta_file, theta);
+	if(sparse_theta){
+		//theta[di][ti] = (nd[di][ti] + alpha) / (doc_lens[di] + num_topics * alpha)
+		string theta_file = output_path + "theta.csr.dat";
+		save_sparse_counts(theta_file, nd, doc_lens, alpha);
+	}else{
+		calc_theta();
+		string theta_file = output_path + "theta.dat";
+		save_matrix(theta_file, theta);
+	}
 	save_matrix(phi_file, phi);
 	save_sample(sample_file, samples);
+	if(phi_mass > 0){
+		SparsePhi sparse;
+		sparse.compress(phi, phi_mass, phi_log8);
+		sparse.save(output_path + "phi.sparse");
+		double dense = (double)num_topics * num_words * sizeof(double);
+		cout<< "phi.sparse: " << sparse.num_entries() << " of " << (long long)num_topics * num_words
+				<< " entries kept, " << dense / sparse.memory_bytes() << "x smaller than dense phi" <<endl;
+	}
+	if(bundle && !ModelBundle::save(*this, output_path + "model.bundle", !sparse_theta))
+		cerr<< "cannot write " << output_path << "model.bundle" <<endl;
+}
+
+void Estimator::load_bundle(const ModelBundle &model){
+	alpha = model.alpha;
+	beta = model.beta;
+	eta = model.eta;
+	num_topics = model.num_topics;
+	num_words = model.num_words;
+	vocab.clear();
+	vocab2id.clear();
+	for(int w = 0; w < num_words; w++){
+		vocab.push_back(model.word(w));
+		vocab2id.insert(pair<string,int>(vocab.back(), w));
+	}
+	ml_cliques = model.ml_cliques();
+	cl_cliques = model.cl_cliques();
+	cl_variants = model.cl_variants();
+	model.build_tree(root);
+	leafmap.assign(model.leafmap(), model.leafmap() + num_words);
+
+	topics = TopicCounts(&root, num_topics);
+	for(int ti = 0; ti < num_topics; ti++){
+		copy(model.edges(ti), model.edges(ti) + root.num_edges, topics.edges.begin() + (size_t)ti * root.num_edges);
+		copy(model.sums(ti), model.sums(ti) + root.num_nodes, topics.sums.begin() + (size_t)ti * root.num_nodes);
+		copy(model.y(ti), model.y(ti) + root.num_multinodes, topics.y.begin() + (size_t)ti * root.num_multinodes);
+	}
+	fill(topics.logp.begin(), topics.logp.end(), NAN);
+
+	nd.clear();
+	samples.clear();
+	invalidate();
+	phi.assign(num_topics, vector<double>(num_words, 0));
+	if(model.has_phi()){
+		for(int ti = 0; ti < num_topics; ti++)
+			phi[ti].assign(model.phi(ti), model.phi(ti) + num_words);
+		phi_valid = true;
+	}
 }
 
 Estimator::~Estimator() {
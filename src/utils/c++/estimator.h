@@ -5,61 +5,169 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <memory>
 #include "nodes.h"
+#include "utility.h"
 using namespace std;
 
+class ModelBundle;
+namespace distributed { class CountClient; }
+
+class Corpus { //documents and vocab, read once and shared by all estimators trained on them
+public:
+	int num_docs;
+	vector<vector<int>> docs;
+	vector<int> doc_lens;
+	vector<string> vocab;
+	map<string, int> vocab2id;
+
+	Corpus();
+};
+
 class Estimator {
 public:
 
+	shared_ptr<Corpus> corpus;
 	double alpha;
 	double beta;
 	double eta;
 	int num_topics;
 	int num_words;
 	int rand_seed;
-	int num_docs;
-	vector<vector<int>> docs;
+	int &num_docs;
+	int num_threads;
+	bool sparse_theta; //keep theta as document-topic counts and save it as CSR rows
+	bool word_major; //sample all occurrences of a word together instead of document by document
+	bool group_words; //sample each document word by word, reusing a word's tree values across its repeats
+	bool block_rotation; //with num_threads > 1, sample doc x vocabulary blocks on rotating diagonals
+	bool data_parallel; //with num_threads > 1, sample token chunks on stale per-thread count copies
+	bool hogwild; //as data_parallel, but all threads update the one copy of the counts atomically
+	bool numa_aware; //pin data_parallel/hogwild threads per NUMA node, keep shards and replicas local
+	double phi_mass; //when > 0, save() also writes phi.sparse keeping this share of each topic's mass
+	bool phi_log8; //phi.sparse with 8-bit log codes instead of float16
+	bool bundle; //save() also writes model.bundle (with theta unless it is kept sparse)
+	string count_server; //when set, train as worker worker_id of num_workers through this count server
+	int worker_id; //the worker's shard: documents [num_docs * id / workers, num_docs * (id + 1) / workers)
+	int num_workers;
+	int syncs_per_epoch; //count server rounds per epoch
+	vector<vector<int>> &docs;
 	vector<vector<int>> samples;
-	vector<int> doc_lens;
+	vector<int> &doc_lens;
 	vector<vector<int> > topical_clusters;
-	vector<vector<int>> mustlinks;
+	vector<vector<int>> mustlinks; //word sets read by readin_constraints
 	vector<vector<int>> cannotlinks;
-	ROOT root;
+	string constraint_file; //pairwise constraints, read instead of the cluster file when set
+	shared_ptr<ROOT> tree; //the Dirichlet tree, shared with sweep chains like the corpus
+	ROOT &root;
 	vector<int> leafmap;
-	vector<string> vocab;
-	map<string, int> vocab2id;
-	vector<ROOT> topics;
-	vector<vector<int>> nd;
+	vector<string> &vocab;
+	map<string, int> &vocab2id;
+	TopicCounts topics; //per-topic counts over root
+	vector<vector<doc_count_t>> nd;
 
 	vector<vector<double>> theta;
 	vector<vector<double>> phi;
 
 	Estimator(double alpha, double beta, double eta, int num_topics, int num_words, int rand_seed);
 
+	//shares the corpus and tree of base, with its own number of topics and counts
+	Estimator(const Estimator &base, int num_topics, int rand_seed);
+
 	void load_data(string data_file, string z_file, string cluster_file, string vocab_file);
 
+	//the two halves of load_data: corpus and tree, then topic counts
+	void load_corpus(string data_file, string cluster_file, string vocab_file);
+	void init_counts(string z_file);
+	void init_counts(vector<vector<int>> *z); //from parsed z labels, or random when NULL
+	void init_counts(const Estimator &coarse); //split each topic of a smaller-K estimator
+
+	//vocab, tree, counts and phi of a saved model, without a corpus: for inspecting and serving
+	void load_bundle(const ModelBundle &model);
+
 	void estimate(int epochs);
 
 	virtual ~Estimator();
 
 
 	void print_topwords(int N=10);
+	vector<vector<int>> top_words(int N=10); //word ids of each topic, most probable first
 
-	void save(string output_path);
+	double perplexity();
 
-private:
+	//theta of new documents (word ids) with the trained topics held fixed: Gibbs sampling of each
+	//document's assignments against phi, averaged over the second half of the iterations; every
+	//document is seeded from its words, so its theta does not depend on the batch it comes in
+	vector<vector<double>> fold_in(const vector<vector<int>> &new_docs, int iterations = 50);
+	//the same against any word-major phi (num_words x num_topics), e.g. one mapped from a ModelBundle
+	static vector<vector<double>> fold_in(const double *word_phi, int num_topics, double alpha,
+			int rand_seed, int num_threads, const vector<vector<int>> &new_docs, int iterations = 50);
 
-	vector<vector<int>> ml_cliques; //must-link connected components
-	vector<vector<int>> cl_cliques; //cannot-link connected components
+	void save(string output_path);
 
+	//the stages of load_data, public so they can be benchmarked separately
 	void readin_data(string data_file);
 	void readin_vocab(string vocab_file);
 	void readin_clusters(string cluster_file);
+	bool readin_z(string z_file, vector<vector<int>> &z); //false if there is no z file, exits on a label not in 0..K-1
+	void readin_constraints(string constraint_file);
 	void build_tree();
 
+private:
+	friend class ModelBundle; //saves the cliques, phi and theta
+
+	vector<vector<int>> ml_cliques; //must-link connected components
+	vector<vector<int>> cl_cliques; //cannot-link connected components
+	vector<vector<vector<int>>> cl_variants; //per cl clique, the sets of ml cliques allowed together
+
+	utils::Random rng;
+
+	void init_topics();
+	void add_counts();
+
+	bool theta_valid; //theta/phi are materialized from the current counts
+	bool phi_valid;
+	void invalidate();
+
 	void calc_theta();
 	void calc_phi();
 
+	vector<double> word_phi; //phi transposed (num_words x num_topics), built by fold_in
+	bool word_phi_valid;
+
+	vector<int> word_offsets; //token positions grouped by word, built on the first word-major epoch
+	vector<int> word_docs;
+	vector<int> word_positions;
+	void index_words();
+
+	//one collapsed Gibbs step for a token in topic z; returns the new topic. The common topic
+	//counts (10, 20, 50, 100, 200) go to sample_token_fixed, others use probs
+	int sample_token(TopicCounts &counts, doc_count_t *nd_row, int leaf, int z, vector<prob_t> &probs, utils::Random &rng);
+	template<int K> int sample_token_fixed(TopicCounts &counts, doc_count_t *nd_row, int leaf, int z, utils::Random &rng);
+
+	long long sample_doc_major(); //one Gibbs sweep, returns the number of changed assignments
+	long long sample_word_major();
+	long long sample_doc_grouped();
+
+	vector<vector<int>> block_docs; //token positions of each (doc block, word block) cell
+	vector<vector<int>> block_positions;
+	void partition_blocks(int num_blocks);
+	long long sample_block_rotation();
+
+	vector<long long> doc_offsets; //token offset of every document, for chunking the token stream
+	long long sample_data_parallel();
+
+	int numa_placed; //thread count the document shards were last placed for
+	void place_shards(int num_chunks);
+
+	unique_ptr<distributed::CountClient> count_client;
+	TopicCounts synced; //the global counts as of the last round
+	long long shard_lines(string &text) const; //keeps the lines of this worker's shard, returns the first one's index
+	void join_count_server();
+	void sync_counts();
+	long long sample_distributed();
+
+	void report_epoch(int epoch, long long num_tokens, long long num_changed, double seconds);
+
 
 };
 
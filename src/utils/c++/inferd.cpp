@@ -0,0 +1,206 @@
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <csignal>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "bundle.h"
+#include "inference.h"
+#include "instrument.h"
+
+using namespace std;
+
+static InferenceServer *server = NULL;
+
+static void on_signal(int){
+	if(server != NULL)
+		server->stop();
+}
+
+static int connect_to(string socket_path){
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//sends the request lines over num_connections connections at once, each pipelining its share,
+//and writes the answers in input order
+static int run_client(string socket_path, string requests_file, string output_file, int num_connections){
+	vector<string> lines;
+	ifstream in(requests_file.c_str());
+	string line;
+	while(getline(in, line))
+		if(!line.empty())
+			lines.push_back(line);
+	vector<string> answers(lines.size());
+	vector<double> latencies(lines.size());
+	bool failed = false;
+	double start = instrument::now();
+	vector<thread> clients;
+	for(int c = 0; c < num_connections; c++)
+		clients.emplace_back([&, c](){
+			int fd = connect_to(socket_path);
+			if(fd < 0){
+				failed = true;
+				return;
+			}
+			vector<size_t> mine;
+			for(size_t i = c; i < lines.size(); i += num_connections)
+				mine.push_back(i);
+			vector<double> sent(mine.size());
+			thread writer([&](){
+				for(size_t j = 0; j < mine.size(); j++){
+					string out = lines[mine[j]] + "\n";
+					sent[j] = instrument::now();
+					if(send(fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size())
+						break;
+				}
+				shutdown(fd, SHUT_WR);
+			});
+			string pending;
+			char chunk[65536];
+			size_t j = 0;
+			ssize_t n;
+			while(j < mine.size() && (n = recv(fd, chunk, sizeof(chunk), 0)) > 0){
+				pending.append(chunk, n);
+				size_t start = 0, end;
+				while(j < mine.size() && (end = pending.find('\n', start)) != string::npos){
+					answers[mine[j]] = pending.substr(start, end - start);
+					latencies[mine[j]] = instrument::now() - sent[j];
+					j++;
+					start = end + 1;
+				}
+				pending.erase(0, start);
+			}
+			writer.join();
+			close(fd);
+			if(j < mine.size())
+				failed = true;
+		});
+	for(size_t c = 0; c < clients.size(); c++)
+		clients[c].join();
+	double seconds = instrument::now() - start;
+	if(failed){
+		cerr << "cannot reach " << socket_path << ", or it closed early" << endl;
+		return 1;
+	}
+
+	ofstream out(output_file.c_str());
+	for(size_t i = 0; i < answers.size(); i++)
+		out << answers[i] << endl;
+	out.close();
+	sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double q){
+		return latencies.empty() ? 0.0 : latencies[min(latencies.size() - 1, (size_t)(q * latencies.size()))] * 1e3;
+	};
+	cout << lines.size() << " requests on " << num_connections << " connections (" << seconds << "s, "
+			<< lines.size() / seconds << " requests/s), latency ms p50 " << percentile(0.5)
+			<< " p99 " << percentile(0.99) << " max " << percentile(1.0) << endl;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	string bundle_file;
+	string socket_path;
+	string requests_file; //client mode: request lines to send
+	string output_file;
+	int num_threads = 1, iterations = 50, max_batch = 64, max_pending = 4096, num_connections = 1;
+	double budget_ms = 5;
+	int rand_seed = 42;
+
+	const char *optstring = "x:s:j:i:b:l:p:r:q:o:P:";
+
+	while( (opt = getopt(argc, argv, optstring)) != -1){
+
+		switch (opt){
+			case 'x':
+				bundle_file = optarg;
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'j':
+				num_threads = max(1, atoi(optarg));
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 'b':
+				max_batch = max(1, atoi(optarg));
+				break;
+			case 'l': //latency budget in milliseconds
+				budget_ms = atof(optarg);
+				break;
+			case 'p':
+				max_pending = max(1, atoi(optarg));
+				break;
+			case 'r':
+				rand_seed = atoi(optarg);
+				break;
+			case 'q':
+				requests_file = optarg;
+				break;
+			case 'o':
+				output_file = optarg;
+				break;
+			case 'P':
+				num_connections = max(1, atoi(optarg));
+				break;
+			default:
+				cerr <<"unknown option: " << char(optopt) << endl;
+				return -1;
+		}
+	}
+
+	if(socket_path.empty()){
+		cerr << "-s socket path is needed" << endl;
+		return -1;
+	}
+	if(!requests_file.empty())
+		return run_client(socket_path, requests_file, output_file, num_connections);
+
+	double start = instrument::now();
+	ModelBundle model;
+	if(bundle_file.empty() || !model.load(bundle_file)){
+		cerr << "-x model bundle (train -B) is needed" << endl;
+		return 1;
+	}
+	cout << "loaded " << model.num_topics << " topics over " << model.num_words << " words ("
+			<< instrument::now() - start << "s), listening on " << socket_path << endl;
+
+	InferenceServer inference(model, iterations, max_batch, budget_ms / 1e3, max_pending);
+	inference.num_threads = num_threads;
+	inference.rand_seed = rand_seed;
+	server = &inference;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if(!inference.serve(socket_path))
+		return 1;
+	cout << inference.stats() << endl;
+	return 0;
+}
+
+/*
+ * This file is the entry point of the inference daemon.
+ * Serving (-x model.bundle -s socket): maps the bundle once, folds in against its phi in place, and
+ * answers topic vectors for new documents over the Unix socket until SIGINT/SIGTERM, folding them in on -j threads
+ * with -i Gibbs iterations (see inference.h for the protocol). Queued documents are batched up to
+ * -b at a time, waiting at most -l milliseconds for a batch to fill, and more than -p queued
+ * documents are turned away as busy. The counters are printed on exit, and "stats" asks for them
+ * while running.
+ * Client (-s socket -q requests -o answers): sends the request lines over -P connections at once
+ * and reports throughput and latency, for trying a running daemon on localhost.
+ */
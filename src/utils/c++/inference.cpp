@@ -0,0 +1,383 @@
+#include "inference.h"
+#include "estimator.h"
+#include "instrument.h"
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace instrument;
+
+static const size_t LATENCY_WINDOW = 100000; //recent latencies kept for the percentiles
+
+InferenceServer::Connection::Connection(int fd): fd(fd), next(0), requests(-1), dropped(false), finished(false){
+}
+
+InferenceServer::Connection::~Connection(){
+	close(fd);
+}
+
+bool InferenceServer::Connection::answer(long long seq, string line, size_t max_backlog){
+	lock_guard<mutex> guard(lock);
+	if(dropped)
+		return true;
+	ready[seq] = move(line);
+	while(!ready.empty() && ready.begin()->first == next){
+		out += ready.begin()->second;
+		out += '\n';
+		ready.erase(ready.begin());
+		next++;
+	}
+	if(out.size() > max_backlog){ //the client is not reading its answers
+		drop();
+		return false;
+	}
+	wake.notify_one();
+	return true;
+}
+
+void InferenceServer::Connection::drop(){
+	dropped = true;
+	out.clear();
+	ready.clear();
+	shutdown(fd, SHUT_RDWR); //ends the reader's recv and the writer's send
+	wake.notify_one();
+}
+
+InferenceServer::InferenceServer(const ModelBundle &model, int iterations, int max_batch, double budget,
+		int max_pending): model(model), num_threads(1), rand_seed(42), iterations(iterations),
+		max_batch(max_batch), budget(budget), max_pending(max_pending), max_backlog(4 << 20),
+		write_timeout(10), word_phi(NULL), reading(0), stopping(0), listen_fd(-1), started(now()), num_requests(0),
+		num_rejected(0), num_errors(0), num_dropped(0), num_batches(0), num_docs(0), num_tokens(0),
+		latency_next(0){
+	int K = model.num_topics, V = model.num_words;
+	if(model.has_word_phi())
+		word_phi = model.word_phi(0);
+	else if(model.has_phi()){ //a bundle from before word-major phi was saved: transpose it once
+		own_phi.resize((size_t)V * K);
+		for(int ti = 0; ti < K; ti++)
+			for(int wi = 0; wi < V; wi++)
+				own_phi[(size_t)wi * K + ti] = model.phi(ti)[wi];
+		word_phi = own_phi.data();
+	}
+}
+
+bool InferenceServer::parse(const string &line, vector<int> &doc, string &error) const{
+	doc.clear();
+	if(line.compare(0, 4, "ids ") == 0 || line == "ids"){
+		istringstream ids(line.substr(3));
+		string token;
+		while(ids >> token){
+			char *end;
+			long id = strtol(token.c_str(), &end, 10);
+			if(*end != 0 || id < 0 || id >= model.num_words){
+				error = "bad word id " + token;
+				return false;
+			}
+			doc.push_back(id);
+		}
+		return true;
+	}
+	if(line.compare(0, 5, "text ") == 0 || line == "text"){
+		string word;
+		for(size_t i = 4; i <= line.size(); i++){
+			unsigned char c = i < line.size() ? line[i] : ' ';
+			if(c >= 0x80 || isalnum(c)) //bytes of UTF-8 characters stay in the word
+				word += tolower(c);
+			else if(!word.empty()){
+				int id = model.word_id(word);
+				if(id >= 0)
+					doc.push_back(id);
+				word.clear();
+			}
+		}
+		return true;
+	}
+	error = "unknown request";
+	return false;
+}
+
+void InferenceServer::read_connection(shared_ptr<Connection> conn){
+	string pending;
+	char chunk[65536];
+	long long seq = 0;
+	while(true){
+		ssize_t n = recv(conn->fd, chunk, sizeof(chunk), 0);
+		if(n <= 0) //the client is done, dropped, or the server is stopping
+			break;
+		pending.append(chunk, n);
+		size_t start = 0, end;
+		while((end = pending.find('\n', start)) != string::npos){
+			string line = pending.substr(start, end - start);
+			start = end + 1;
+			if(!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if(line.empty())
+				continue;
+			{
+				lock_guard<mutex> guard(stats_lock);
+				num_requests++;
+			}
+			if(line == "stats"){
+				answer(*conn, seq++, stats());
+				continue;
+			}
+			Request request;
+			string error;
+			if(!parse(line, request.doc, error)){
+				{
+					lock_guard<mutex> guard(stats_lock);
+					num_errors++;
+				}
+				answer(*conn, seq++, "error " + error);
+				continue;
+			}
+			request.conn = conn;
+			request.seq = seq++;
+			request.arrived = now();
+			bool rejected = false;
+			{
+				lock_guard<mutex> guard(queue_lock);
+				if((int)queue.size() >= max_pending)
+					rejected = true;
+				else
+					queue.push_back(move(request));
+			}
+			if(rejected){
+				{
+					lock_guard<mutex> guard(stats_lock);
+					num_rejected++;
+				}
+				answer(*conn, request.seq, "error busy");
+			}else
+				queued.notify_one();
+		}
+		pending.erase(0, start);
+	}
+	{
+		lock_guard<mutex> guard(queue_lock); //nothing more from this reader: the batcher may stop once it is drained
+		reading--;
+		queued.notify_all();
+	}
+	lock_guard<mutex> guard(conn->lock); //the writer stops after answer number seq
+	conn->requests = seq;
+	conn->wake.notify_one();
+}
+
+void InferenceServer::write_connection(shared_ptr<Connection> conn){
+	unique_lock<mutex> guard(conn->lock);
+	while(true){
+		conn->wake.wait(guard, [&](){
+			return conn->dropped || !conn->out.empty() || (conn->requests >= 0 && conn->next >= conn->requests);
+		});
+		if(conn->dropped || conn->out.empty()) //dropped, or every request is answered
+			break;
+		string sending;
+		sending.swap(conn->out);
+		guard.unlock();
+		size_t sent = 0;
+		while(sent < sending.size()){ //a send blocked for write_timeout fails
+			ssize_t n = send(conn->fd, sending.data() + sent, sending.size() - sent, MSG_NOSIGNAL);
+			if(n <= 0)
+				break;
+			sent += n;
+		}
+		guard.lock();
+		if(sent < sending.size() && !conn->dropped){ //gone, or stuck
+			conn->drop();
+			lock_guard<mutex> stats_guard(stats_lock);
+			num_dropped++;
+		}
+	}
+}
+
+void InferenceServer::handle_connection(shared_ptr<Connection> conn){
+	thread writer(&InferenceServer::write_connection, this, conn);
+	read_connection(conn);
+	writer.join();
+	conn->finished = true;
+}
+
+void InferenceServer::answer(Connection &conn, long long seq, string line){
+	if(!conn.answer(seq, move(line), max_backlog)){
+		lock_guard<mutex> guard(stats_lock);
+		num_dropped++;
+	}
+}
+
+void InferenceServer::reap(bool all){
+	for(list<shared_ptr<Connection>>::iterator it = connections.begin(); it != connections.end(); ){
+		if(all || (*it)->finished){
+			(*it)->reader.join();
+			it = connections.erase(it);
+		}else
+			it++;
+	}
+}
+
+
+
+void InferenceServer::run_batches(){
+	unique_lock<mutex> guard(queue_lock);
+	while(true){
+		queued.wait(guard, [&](){ return (stopping && reading == 0) || !queue.empty(); });
+		if(queue.empty()) //stopping, every reader is done and everything queued is answered
+			break;
+		//wait for a full batch, but not past the oldest document's budget
+		double deadline = queue.front().arrived + budget;
+		while(!stopping && (int)queue.size() < max_batch && now() < deadline)
+			queued.wait_for(guard, chrono::duration<double>(deadline - now()));
+
+		int size = min((int)queue.size(), max_batch);
+		vector<Request> batch(make_move_iterator(queue.begin()), make_move_iterator(queue.begin() + size));
+		queue.erase(queue.begin(), queue.begin() + size);
+		guard.unlock();
+
+		vector<vector<int>> docs(size);
+		for(int i = 0; i < size; i++)
+			docs[i] = move(batch[i].doc);
+		vector<vector<double>> theta = Estimator::fold_in(word_phi, model.num_topics, model.alpha, rand_seed,
+				num_threads, docs, iterations);
+		for(int i = 0; i < size; i++){
+			string line;
+			char value[32];
+			for(int ti = 0; ti < model.num_topics; ti++){
+				snprintf(value, sizeof(value), ti == 0 ? "%.6g" : " %.6g", theta[i][ti]);
+				line += value;
+			}
+			answer(*batch[i].conn, batch[i].seq, move(line));
+			batch[i].doc = move(docs[i]);
+		}
+		record(batch, now());
+		guard.lock();
+	}
+}
+
+void InferenceServer::record(const vector<Request> &batch, double done){
+	lock_guard<mutex> guard(stats_lock);
+	num_batches++;
+	for(size_t i = 0; i < batch.size(); i++){
+		num_docs++;
+		num_tokens += batch[i].doc.size();
+		if(latencies.size() < LATENCY_WINDOW)
+			latencies.push_back(done - batch[i].arrived);
+		else
+			latencies[latency_next++ % LATENCY_WINDOW] = done - batch[i].arrived;
+	}
+}
+
+string InferenceServer::stats(){
+	vector<double> recent;
+	ostringstream out;
+	size_t pending;
+	{
+		lock_guard<mutex> guard(queue_lock);
+		pending = queue.size();
+	}
+	lock_guard<mutex> guard(stats_lock);
+	recent = latencies;
+	auto percentile = [&](double q){
+		if(recent.empty())
+			return 0.0;
+		size_t at = min(recent.size() - 1, (size_t)(q * recent.size()));
+		nth_element(recent.begin(), recent.begin() + at, recent.end());
+		return recent[at] * 1e3;
+	};
+	double elapsed = now() - started;
+	out << "{\"requests\":" << num_requests << ",\"answered\":" << num_docs
+			<< ",\"rejected\":" << num_rejected << ",\"errors\":" << num_errors << ",\"dropped\":" << num_dropped
+			<< ",\"pending\":" << pending
+			<< ",\"batches\":" << num_batches
+			<< ",\"mean_batch\":" << (num_batches > 0 ? (double)num_docs / num_batches : 0.0)
+			<< ",\"docs_per_s\":" << num_docs / elapsed << ",\"tokens_per_s\":" << num_tokens / elapsed
+			<< ",\"latency_ms\":{\"p50\":" << percentile(0.5) << ",\"p90\":" << percentile(0.9)
+			<< ",\"p99\":" << percentile(0.99) << ",\"max\":" << percentile(1.0) << "}"
+			<< ",\"uptime_s\":" << elapsed << "}";
+	return out.str();
+}
+
+bool InferenceServer::serve(string socket_path){
+	if(word_phi == NULL){
+		cerr << "the model bundle has no phi; save it again with train -B" << endl;
+		return false;
+	}
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(socket_path.size() >= sizeof(addr.sun_path)){
+		cerr << "socket path is too long: " << socket_path << endl;
+		return false;
+	}
+	strcpy(addr.sun_path, socket_path.c_str());
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_path.c_str()); //a stale socket of an earlier run
+	if(listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0){
+		cerr << "cannot listen on " << socket_path << ": " << strerror(errno) << endl;
+		return false;
+	}
+	started = now();
+	thread batcher(&InferenceServer::run_batches, this);
+	while(!stopping){
+		pollfd waiting = {listen_fd, POLLIN, 0};
+		if(poll(&waiting, 1, 200) <= 0) //wakes up now and then to see whether to stop
+			continue;
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd < 0)
+			continue;
+		timeval timeout;
+		timeout.tv_sec = (long)write_timeout;
+		timeout.tv_usec = (long)((write_timeout - timeout.tv_sec) * 1e6);
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		shared_ptr<Connection> conn = make_shared<Connection>(fd);
+		{
+			lock_guard<mutex> guard(queue_lock);
+			reading++;
+		}
+		conn->reader = thread(&InferenceServer::handle_connection, this, conn);
+		connections.push_back(conn);
+		reap(false);
+	}
+	//no more requests: readers stop, and the batcher answers what they queued before it exits
+	close(listen_fd);
+	for(list<shared_ptr<Connection>>::iterator it = connections.begin(); it != connections.end(); it++)
+		shutdown((*it)->fd, SHUT_RD);
+	{
+		lock_guard<mutex> guard(queue_lock);
+		queued.notify_all();
+	}
+	batcher.join();
+	reap(true);
+	unlink(socket_path.c_str());
+	return true;
+}
+
+void InferenceServer::stop(){
+	stopping = 1;
+}
+
+/*
+ * This file implements the inference daemon behind inferd.
+ * - parse: Turns "ids ..." and "text ..." request lines into word ids.
+ * - read_connection: One thread per client; queues its documents, or answers "error busy" when
+ *   max_pending are already queued, and answers stats and malformed lines straight away.
+ * - write_connection: The client's writer; sends its answers in order and disconnects the client
+ *   when its unsent answers pass max_backlog or a send is stuck for write_timeout.
+ * - run_batches: Takes up to max_batch queued documents once the batch is full or the oldest has
+ *   waited the latency budget, folds them in together and answers each on its connection, in the
+ *   order the client sent them.
+ * - serve: Accepts clients until stop(), then waits for the readers to finish, answers what they
+ *   queued and joins every thread.
+ * - stats: Counts of requests, rejections, errors, dropped clients and batches, throughput since start, and
+ *   latency percentiles (arrival to answer) over the most recent documents.
+ */
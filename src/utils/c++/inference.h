@@ -0,0 +1,110 @@
+#ifndef INFERENCE_H_
+#define INFERENCE_H_
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <map>
+#include <atomic>
+#include <csignal>
+#include "bundle.h"
+using namespace std;
+
+// Topic vectors for new documents, served from a mapped ModelBundle over a Unix domain socket.
+// A request is one line, answered by one line in the same order on the same connection:
+//   ids <word id> <word id> ...   a tokenized document
+//   text <raw text>               lowercased and split on ASCII punctuation and spaces; words not in
+//                                 the vocab are dropped, so the text must be preprocessed (stemmed)
+//                                 the way the training data was
+//   stats                         the counters, as one JSON object
+// Documents are answered with num_topics space separated probabilities, or "error <reason>".
+//
+// Connections are read on their own threads and queue their documents; one batcher takes up to
+// max_batch of them, waiting at most the latency budget after the oldest arrived, and folds them
+// in on num_threads threads against the bundle's word-major phi, read in place from the mapping.
+// When max_pending documents are queued, new ones are answered "error busy" at once instead of
+// waiting. Answers go out on each connection's own writer thread, so a client that stops reading
+// never holds up the batcher: once max_backlog bytes of its answers are waiting, or a send has
+// been stuck for write_timeout seconds, the client is disconnected.
+class InferenceServer {
+public:
+	const ModelBundle &model;
+	int num_threads;
+	int rand_seed; //fold_in seeds every document from this and its words
+	int iterations; //Gibbs iterations of fold_in
+	int max_batch;
+	double budget; //seconds a queued document may wait for its batch to fill
+	int max_pending;
+	size_t max_backlog; //bytes of answers a connection may have waiting to be sent
+	double write_timeout; //seconds
+
+	InferenceServer(const ModelBundle &model, int iterations = 50, int max_batch = 64, double budget = 0.005,
+			int max_pending = 4096);
+
+	bool serve(string socket_path); //until stop(); false if the socket cannot be set up
+	void stop(); //safe from a signal handler
+
+	string stats(); //requests, rejections, batches, throughput and latency percentiles, as JSON
+
+	//parses one "ids"/"text" request line into word ids; false with a reason if it is malformed
+	bool parse(const string &line, vector<int> &doc, string &error) const;
+
+private:
+	class Connection { //one client; answers are written in request order whoever finishes first
+	public:
+		int fd;
+		mutex lock;
+		condition_variable wake; //for the writer: more to send, or the reader is done
+		long long next; //sequence number of the next answer to queue for sending
+		long long requests; //answers owed once the reader is done, -1 until then
+		map<long long, string> ready; //answers waiting for an earlier one
+		string out; //answers in order, not sent yet
+		bool dropped; //too far behind, or gone: answers are discarded
+		atomic<bool> finished; //both threads are done; the server may join and forget it
+		thread reader;
+		Connection(int fd);
+		~Connection();
+		bool answer(long long seq, string line, size_t max_backlog); //false when it drops the client
+		void drop();
+	};
+
+	class Request {
+	public:
+		shared_ptr<Connection> conn;
+		long long seq;
+		vector<int> doc;
+		double arrived;
+	};
+
+	vector<double> own_phi; //word-major phi of a bundle written without one
+	const double *word_phi;
+
+	list<shared_ptr<Connection>> connections;
+	deque<Request> queue;
+	mutex queue_lock;
+	condition_variable queued;
+	int reading; //connections whose reader may still queue documents, under queue_lock
+	volatile sig_atomic_t stopping;
+	int listen_fd;
+
+	mutex stats_lock;
+	double started;
+	long long num_requests, num_rejected, num_errors, num_dropped, num_batches, num_docs, num_tokens;
+	vector<double> latencies; //seconds, the most recent ones in a ring
+	size_t latency_next;
+
+	void handle_connection(shared_ptr<Connection> conn);
+	void read_connection(shared_ptr<Connection> conn);
+	void write_connection(shared_ptr<Connection> conn);
+	void answer(Connection &conn, long long seq, string line);
+	void run_batches();
+	void record(const vector<Request> &batch, double done);
+	void reap(bool all); //joins finished connections, or all of them
+};
+
+#endif /* INFERENCE_H_ */
@@ -0,0 +1,90 @@
+#include "instrument.h"
+
+#include <chrono>
+#include <sstream>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace instrument{
+
+Metrics metrics;
+
+double now(){
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long peak_rss_kb(){
+#ifdef _WIN32
+	return -1;
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return -1;
+	return usage.ru_maxrss; //kilobytes on linux
+#endif
+}
+
+Metrics::Metrics(){
+	start = now();
+}
+
+void Metrics::open(string metrics_file){
+	file.open(metrics_file.c_str());
+	if(file.fail())
+		cerr<< "cannot open metrics file " << metrics_file <<endl;
+	start = now();
+}
+
+bool Metrics::enabled(){
+	return file.is_open();
+}
+
+void Metrics::write(const string &json){
+	if(!enabled())
+		return;
+	lock_guard<mutex> lock(file_lock);
+	file << json << endl;
+}
+
+void Metrics::phase(const char *name, double seconds){
+	if(!enabled())
+		return;
+	stringstream line;
+	line << "{\"phase\":\"" << name << "\",\"seconds\":" << seconds
+			<< ",\"elapsed\":" << elapsed() << "}";
+	write(line.str());
+}
+
+void Metrics::count(const char *name, long long n){
+	if(!enabled())
+		return;
+	stringstream line;
+	line << "{\"counter\":\"" << name << "\",\"value\":" << n
+			<< ",\"elapsed\":" << elapsed() << "}";
+	write(line.str());
+}
+
+double Metrics::elapsed(){
+	return now() - start;
+}
+
+ScopedTimer::ScopedTimer(const char *name):name(name){
+	start = now();
+}
+
+ScopedTimer::~ScopedTimer(){
+	metrics.phase(name, now() - start);
+}
+
+}
+
+/*
+ * This file contains the lightweight instrumentation used by train.
+ *
+ * - now / peak_rss_kb: Wall clock and memory probes.
+ * - Metrics: Appends JSON lines (phases, counters, per-epoch telemetry) to the file given with -m.
+ *   Nothing is written when no metrics file is open.
+ * - ScopedTimer: Times a scope and reports it as a phase. Used through PROFILE_SCOPE, which
+ *   like PROFILE_COUNT expands to nothing unless STABLELDA_PROFILE is defined.
+ */
@@ -0,0 +1,57 @@
+#ifndef INSTRUMENT_H_
+#define INSTRUMENT_H_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <mutex>
+using namespace std;
+
+namespace instrument{
+
+	double now(); //seconds on a monotonic clock
+
+	long peak_rss_kb(); //peak resident set size of this process, -1 if unknown
+
+	class Metrics { //JSON-lines sink for timings and per-epoch telemetry
+	public:
+		Metrics();
+
+		void open(string metrics_file);
+		bool enabled();
+		void write(const string &json);
+		void phase(const char *name, double seconds);
+		void count(const char *name, long long n);
+		double elapsed();
+
+	private:
+		ofstream file;
+		mutex file_lock;
+		double start;
+	};
+
+	extern Metrics metrics;
+
+	class ScopedTimer { //reports the lifetime of a scope as a phase
+	public:
+		ScopedTimer(const char *name);
+		~ScopedTimer();
+	private:
+		const char *name;
+		double start;
+	};
+
+};
+
+// timers and counters cost nothing unless built with -DSTABLELDA_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifdef STABLELDA_PROFILE
+#define PROFILE_SCOPE(name) instrument::ScopedTimer PROFILE_CONCAT(scoped_timer_, __LINE__)(name)
+#define PROFILE_COUNT(name, n) instrument::metrics.count(name, n)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(name, n)
+#endif
+
+#endif /* INSTRUMENT_H_ */
@@ -4,192 +4,339 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
-#include <typeinfo>
+#include <algorithm>
 
 using namespace std;
 using namespace utils;
 
-ROOT::ROOT(){}
+//count access on the sampling path: reads are relaxed atomic loads (plain loads on x86) and adds
+//become atomic read-modify-writes when several threads update the same counts (Hogwild)
+static inline int load(const count_t *count){
+	return __atomic_load_n(count, __ATOMIC_RELAXED);
+}
+
+template<bool shared>
+static inline void add(count_t *count, int val){
+	if(shared)
+		__atomic_fetch_add(count, (count_t)val, __ATOMIC_RELAXED);
+	else
+		*count += val;
+}
+
+template<bool shared>
+static inline void reset_logp(double *logp){
+	double stale = NAN;
+	if(shared)
+		__atomic_store(logp, &stale, __ATOMIC_RELAXED);
+	else
+		*logp = stale;
+}
+
+//log-marginal of a node's own edges from the cached tables, stored until the node's counts change
+static double own_logp(const vector<const LgammaTable*> &edge_tables, const LgammaTable *sum_table,
+		const count_t *edges, int sum, double &cached){
+	if(!isnan(cached))
+		return cached;
+	double logp = -(*sum_table)(sum);
+	for(int ei = 0; ei < edge_tables.size(); ei++)
+		logp += (*edge_tables[ei])(edges[ei]);
+	cached = logp;
+	return logp;
+}
+
+//one cached table per edge prior, plus one for the node sum
+static void set_tables(const vector<double> &orig_edge_weights, double orig_edgesum,
+		vector<const LgammaTable*> &edge_tables, const LgammaTable *&sum_table){
+	edge_tables.resize(orig_edge_weights.size());
+	for(int ei = 0; ei < orig_edge_weights.size(); ei++)
+		edge_tables[ei] = lgamma_table(orig_edge_weights[ei]);
+	sum_table = lgamma_table(orig_edgesum);
+}
 
-ROOT::ROOT(vector<double> edge_weights,
-		vector<MultiNode> children, vector<int> maxind,
-		int leafstart, double edgesum, vector<double> orig_edge_weights,
-		double orig_edgesum):edge_weights(edge_weights),children(children),
-				maxind(maxind),
-				leafstart(leafstart), edgesum(edgesum), orig_edge_weights(orig_edge_weights),
-				orig_edgesum(orig_edgesum){}
+ROOT::ROOT(){
+	leafstart = 0;
+	orig_edgesum = 0;
+	eoff = 0;
+	noff = 0;
+	num_edges = 0;
+	num_nodes = 0;
+	num_multinodes = 0;
+	sum_table = NULL;
+}
+
+ROOT::ROOT(vector<MultiNode> children, vector<int> maxind,
+		int leafstart, vector<double> orig_edge_weights,
+		double orig_edgesum):children(move(children)),
+				maxind(move(maxind)),
+				leafstart(leafstart), orig_edge_weights(move(orig_edge_weights)),
+				orig_edgesum(orig_edgesum){
+	layout();
+}
+
+void ROOT::layout(){
+	num_edges = 0;
+	num_nodes = 0;
+	num_multinodes = 0;
+	eoff = num_edges;
+	num_edges += orig_edge_weights.size();
+	noff = num_nodes++;
+	set_tables(orig_edge_weights, orig_edgesum, edge_tables, sum_table);
+	for(int i = 0; i < children.size(); i++)
+		children[i].layout(num_edges, num_nodes, num_multinodes);
+}
 
 int ROOT::num_leaves(){
 	int n = 0;
 	for(int i = 0; i < children.size(); i++)
 		n += children[i].num_leaves();
-	return n+edge_weights.size()-children.size();
+	return n+orig_edge_weights.size()-children.size();
 }
 
-void ROOT::sample_node(){
-	vector<MultiNode> multi = get_multinodes();
-	for(int mi = 0; mi < multi.size(); mi++){
-		MultiNode* mu = &children[mi];
+void ROOT::sample_node(Counts c, Random &rng) const{
+	for(int mi = 0; mi < children.size(); mi++){
+		const MultiNode* mu = &children[mi];
 		vector<double> vals;
 		int numvar = mu->num_variants();
 
 		for(int vi = 0; vi < numvar; vi++){
-			double v = mu->logphi_update(vi) + mu->var_logweight(vi);
+			double v = mu->logphi_update(c, vi) + mu->var_logweight(vi);
 			vals.push_back(v);
 		}
-		int y = log_mult_sample(vals);
-		mu->y = y;
+		int y = log_mult_sample(vals, rng);
+		c.y[mu->moff] = y;
+	}
+}
+
+void ROOT::leaf_count_update(Counts c, int val, int leaf) const{
+	if(c.shared){
+		reset_logp<true>(c.logp + noff);
+		count_update<true>(c, val, leaf, c.sums[noff]);
+	}else{
+		reset_logp<false>(c.logp + noff);
+		count_update<false>(c, val, leaf, c.sums[noff]);
 	}
 }
 
-void ROOT::leaf_count_update(double val, int leaf){
+void ROOT::leaf_count_update(Counts c, int val, int leaf, count_t &sum) const{
+	if(c.shared)
+		count_update<true>(c, val, leaf, sum);
+	else
+		count_update<false>(c, val, leaf, sum);
+}
+
+template<bool shared>
+void ROOT::count_update(Counts c, int val, int leaf, count_t &sum) const{
 	for(int i = 0 ; i < children.size(); i++){
 		if (leaf <= maxind[i]){
-			edge_weights[i] += val;
-			edgesum += val;
-			children[i].leaf_count_update(val, leaf);
+			add<shared>(c.edges + eoff + i, val);
+			add<shared>(&sum, val);
+			children[i].leaf_count_update<shared>(c, val, leaf);
 			return;
 		}
 	}
 	int ei = children.size() + leaf - leafstart;
-	edge_weights[ei] += val;
-	edgesum += val;
+	add<shared>(c.edges + eoff + ei, val);
+	add<shared>(&sum, val);
 	return;
 }
 
-vector<MultiNode> ROOT::get_multinodes(){
-	vector<MultiNode> multinodes;
-	for(int i = 0; i < children.size(); i++){
-		if( string( typeid(children[i]).name() ).find("MultiNode") != string::npos ){
-			multinodes.push_back(children[i]);
-		}
-	}
-	return multinodes;
+double ROOT::wordval_update(Counts c, double val, int leaf) const{
+	return wordval_update(c, val, leaf, load(c.sums + noff));
 }
 
-
-double ROOT::wordval_update(double val, int leaf){
+double ROOT::wordval_update(Counts c, double val, int leaf, int sum) const{
 	double newval;
+	double edgesum = orig_edgesum + sum;
 	for(int i =0; i < children.size(); i++){
 		if(leaf <= maxind[i]){
-			newval = edge_weights[i] / edgesum;
+			newval = (orig_edge_weights[i] + load(c.edges + eoff + i)) / edgesum;
 
-			return children[i].wordval_update(newval*val, leaf);
+			return children[i].wordval_update(c, newval*val, leaf);
 		}
 	}
 	int ei = children.size() + leaf - leafstart;
-	newval = edge_weights[ei] / edgesum;
+	newval = (orig_edge_weights[ei] + load(c.edges + eoff + ei)) / edgesum;
 
 	return val * newval;
 }
 
-double ROOT::logphi_update(){
-	double logpwz = lgamma(orig_edgesum) -lgamma(edgesum);
+int ROOT::edge_of(int leaf) const{
+	for(int i = 0; i < children.size(); i++)
+		if(leaf <= maxind[i])
+			return i;
+	return children.size() + leaf - leafstart;
+}
 
-	for(int ei =0; ei < edge_weights.size(); ei++)
-		logpwz += lgamma(edge_weights[ei]) - lgamma(orig_edge_weights[ei]);
+void ROOT::leafvals_update(Counts c, double val, vector<double> &leafvals) const{
+	double edgesum = orig_edgesum + c.sums[noff];
+	for(int i = 0; i < children.size(); i++){
+		double newval = (orig_edge_weights[i] + c.edges[eoff + i]) / edgesum;
+		children[i].leafvals_update(c, newval*val, leafvals);
+	}
+	for(int ei = children.size(); ei < orig_edge_weights.size(); ei++){
+		double newval = (orig_edge_weights[ei] + c.edges[eoff + ei]) / edgesum;
+		leafvals[leafstart + ei - children.size()] = val * newval;
+	}
+}
+
+double ROOT::logphi_update(Counts c) const{
+	double logpwz = own_logp(edge_tables, sum_table, c.edges + eoff, c.sums[noff], c.logp[noff]);
 
 	for(int i = 0; i < children.size(); i++){
-		logpwz += children[i].logphi_update();
+		logpwz += children[i].logphi_update(c);
 	}
 	return logpwz;
 }
 
-Node::Node(vector<double> edge_weights,
-		vector<Node> children, vector<int> maxind,
-		int leafstart, double edgesum, vector<double> orig_edge_weights,
-		double orig_edgesum):edge_weights(edge_weights),children(children),
-				maxind(maxind),
-				leafstart(leafstart), edgesum(edgesum), orig_edge_weights(orig_edge_weights),
-				orig_edgesum(orig_edgesum){}
+void ROOT::repair_sums(Counts c) const{
+	int sum = 0;
+	for(int ei = 0; ei < orig_edge_weights.size(); ei++)
+		sum += c.edges[eoff + ei];
+	c.sums[noff] = sum;
+	for(int i = 0; i < children.size(); i++)
+		children[i].repair_sums(c);
+}
+
+Node::Node(vector<Node> children, vector<int> maxind,
+		int leafstart, vector<double> orig_edge_weights,
+		double orig_edgesum):children(move(children)),
+				maxind(move(maxind)),
+				leafstart(leafstart), orig_edge_weights(move(orig_edge_weights)),
+				orig_edgesum(orig_edgesum){
+	eoff = 0;
+	noff = 0;
+	sum_table = NULL;
+}
 
-Node::Node(vector<double> edge_weights, vector<Node> children,
+Node::Node(vector<Node> children,
 			vector<int> maxind, int leafstart, vector<int> words,
-			double edgesum, vector<double> orig_edge_weights,
-			double orig_edgesum):edge_weights(edge_weights),children(children),
-					maxind(maxind),leafstart(leafstart),words(words),
-					edgesum(edgesum), orig_edge_weights(orig_edge_weights),
-					orig_edgesum(orig_edgesum){}
+			vector<double> orig_edge_weights,
+			double orig_edgesum):children(move(children)),
+					maxind(move(maxind)),leafstart(leafstart),
+					orig_edge_weights(move(orig_edge_weights)),
+					orig_edgesum(orig_edgesum),words(move(words)){
+	eoff = 0;
+	noff = 0;
+	sum_table = NULL;
+}
+
+void Node::layout(int &num_edges, int &num_nodes){
+	eoff = num_edges;
+	num_edges += orig_edge_weights.size();
+	noff = num_nodes++;
+	set_tables(orig_edge_weights, orig_edgesum, edge_tables, sum_table);
+	for(int i = 0; i < children.size(); i++)
+		children[i].layout(num_edges, num_nodes);
+}
 
 int Node::num_leaves(){
 	int n = 0;
 	for(int i = 0; i < children.size(); i++)
 		n += children[i].num_leaves();
-	return n+edge_weights.size()-children.size();
+	return n+orig_edge_weights.size()-children.size();
 }
 
 
 
-void Node::leaf_count_update(double val, int leaf){
+template<bool shared>
+void Node::leaf_count_update(Counts c, int val, int leaf) const{
 	for(int i = 0 ; i < children.size(); i++){
 		if (leaf <= maxind[i]){
-			edge_weights[i] += val;
-			edgesum += val;
-			children[i].leaf_count_update(val, leaf);
+			reset_logp<shared>(c.logp + noff);
+			add<shared>(c.edges + eoff + i, val);
+			add<shared>(c.sums + noff, val);
+			children[i].leaf_count_update<shared>(c, val, leaf);
 			return;
 		}
 	}
 	int ei = children.size() + leaf - leafstart;
-	edge_weights[ei] += val;
-	edgesum += val;
+	reset_logp<shared>(c.logp + noff);
+	add<shared>(c.edges + eoff + ei, val);
+	add<shared>(c.sums + noff, val);
 	return;
 }
 
 
-double Node::wordval_update(double val, int leaf){
+double Node::wordval_update(Counts c, double val, int leaf) const{
 	double newval;
+	double edgesum = orig_edgesum + load(c.sums + noff);
 	for(int i =0; i < children.size(); i++){
 		if(leaf <= maxind[i]){
-			newval = edge_weights[i] / edgesum;
+			newval = (orig_edge_weights[i] + load(c.edges + eoff + i)) / edgesum;
 
-			return children[i].wordval_update(newval*val, leaf);
+			return children[i].wordval_update(c, newval*val, leaf);
 		}
 	}
 	int ei = children.size() + leaf - leafstart;
-	newval = edge_weights[ei] / edgesum;
+	newval = (orig_edge_weights[ei] + load(c.edges + eoff + ei)) / edgesum;
 
 	return val * newval;
 }
 
-double Node::logphi_update(){
-	double logpwz = lgamma(orig_edgesum) -lgamma(edgesum);
+void Node::leafvals_update(Counts c, double val, vector<double> &leafvals) const{
+	double edgesum = orig_edgesum + c.sums[noff];
+	for(int i = 0; i < children.size(); i++){
+		double newval = (orig_edge_weights[i] + c.edges[eoff + i]) / edgesum;
+		children[i].leafvals_update(c, newval*val, leafvals);
+	}
+	for(int ei = children.size(); ei < orig_edge_weights.size(); ei++){
+		double newval = (orig_edge_weights[ei] + c.edges[eoff + ei]) / edgesum;
+		leafvals[leafstart + ei - children.size()] = val * newval;
+	}
+}
 
-	for(int ei =0; ei < edge_weights.size(); ei++)
-		logpwz += lgamma(edge_weights[ei]) - lgamma(orig_edge_weights[ei]);
+double Node::logphi_update(Counts c) const{
+	double logpwz = own_logp(edge_tables, sum_table, c.edges + eoff, c.sums[noff], c.logp[noff]);
 
 	for(int i = 0; i < children.size(); i++){
-		logpwz += children[i].logphi_update();
+		logpwz += children[i].logphi_update(c);
 	}
 	return logpwz;
 }
 
-MultiNode::MultiNode(vector<double> edge_weights, vector<Node> children, vector<int> maxind,
-		int leafstart, double edgesum, vector<double> orig_edge_weights, double orig_edgesum):edge_weights(edge_weights),children(children),maxind(maxind),
-				leafstart(leafstart), edgesum(edgesum), orig_edge_weights(orig_edge_weights),
-				orig_edgesum(orig_edgesum){}
+void Node::repair_sums(Counts c) const{
+	int sum = 0;
+	for(int ei = 0; ei < orig_edge_weights.size(); ei++)
+		sum += c.edges[eoff + ei];
+	c.sums[noff] = sum;
+	for(int i = 0; i < children.size(); i++)
+		children[i].repair_sums(c);
+}
 
-MultiNode::MultiNode(vector<double> edge_weights, vector<Node> children,
+MultiNode::MultiNode(vector<Node> children,
 			vector<int> maxind, int leafstart, vector<int> words,
 			vector<Node> variants, vector<vector<int>> fake_leafmap,
-			vector<double> variant_logweights):edge_weights(edge_weights),children(children),
-					maxind(maxind),leafstart(leafstart),words(words),
-					variants(variants), fake_leafmap(fake_leafmap),
-					variant_logweights(variant_logweights){
-		y= -1;
+			vector<double> variant_logweights):maxind(move(maxind)),leafstart(leafstart),
+					children(move(children)),words(move(words)),
+					variants(move(variants)),variant_logweights(move(variant_logweights)),
+					fake_leafmap(move(fake_leafmap)){
+	moff = 0;
 }
 
-double MultiNode::logphi_update(){
-	double logpwz = lgamma(orig_edgesum) -lgamma(edgesum);
+void MultiNode::layout(int &num_edges, int &num_nodes, int &num_multinodes){
+	moff = num_multinodes++;
+	for(int v = 0; v < variants.size(); v++)
+		variants[v].layout(num_edges, num_nodes);
+	for(int i = 0; i < children.size(); i++)
+		children[i].layout(num_edges, num_nodes);
+}
 
-	for(int ei =0; ei < edge_weights.size(); ei++)
-		logpwz += lgamma(edge_weights[ei]) - lgamma(orig_edge_weights[ei]);
+double MultiNode::logphi_update(Counts c) const{
+	double logpwz = logphi_update(c, c.y[moff]);
 
 	for(int i = 0; i < children.size(); i++){
-		logpwz += children[i].logphi_update();
+		logpwz += children[i].logphi_update(c);
 	}
 	return logpwz;
 }
 
+void MultiNode::repair_sums(Counts c) const{
+	for(int v = 0; v < variants.size(); v++)
+		variants[v].repair_sums(c);
+	for(int i = 0; i < children.size(); i++)
+		children[i].repair_sums(c);
+}
+
 int MultiNode::num_leaves(){
 	int n =0;
 	for(int i = 0; i < children.size(); i++)
@@ -198,70 +345,149 @@ int MultiNode::num_leaves(){
 }
 
 
-void MultiNode::leaf_count_update(double val, int leaf){
+template<bool shared>
+void MultiNode::leaf_count_update(Counts c, int val, int leaf) const{
 	for(int i = 0; i < children.size(); i++){
 
 		if (leaf <= maxind[i]){
 			for(int v = 0; v < variants.size(); v++){
-				variants[v].leaf_count_update(val, fake_leafmap[v][i]);
+				variants[v].leaf_count_update<shared>(c, val, fake_leafmap[v][i]);
 			}
-			children[i].leaf_count_update(val, leaf);
+			children[i].leaf_count_update<shared>(c, val, leaf);
 			return;
 		}
 	}
 	int ei = children.size() + leaf - leafstart;
 	for(int v = 0; v < variants.size(); v++)
-		variants[v].leaf_count_update(val, fake_leafmap[v][ei]);
+		variants[v].leaf_count_update<shared>(c, val, fake_leafmap[v][ei]);
 	return;
 }
 
-double MultiNode::wordval_update(double val, int leaf){
+double MultiNode::wordval_update(Counts c, double val, int leaf) const{
 	double newval;
+	int y = c.y[moff];
 	for(int i = 0; i < children.size(); i++){
 
 		if (leaf <= maxind[i]){
-			newval = variants[y].wordval_update(val, fake_leafmap[y][i]);
-			return children[i].wordval_update(newval, leaf);
+			newval = variants[y].wordval_update(c, val, fake_leafmap[y][i]);
+			return children[i].wordval_update(c, newval, leaf);
 		}
 	}
 
 	int ei = children.size() + leaf - leafstart;
-	return variants[y].wordval_update(val, fake_leafmap[y][ei]);
+	return variants[y].wordval_update(c, val, fake_leafmap[y][ei]);
 }
 
-int MultiNode::num_variants(){
+void MultiNode::leafvals_update(Counts c, double val, vector<double> &leafvals) const{
+	//the selected variant spreads val over the fake leaves, one per child and word
+	int y = c.y[moff];
+	vector<double> fakevals(fake_leafmap[y].size(), 0.0);
+	variants[y].leafvals_update(c, val, fakevals);
+
+	for(int i = 0; i < children.size(); i++)
+		children[i].leafvals_update(c, fakevals[fake_leafmap[y][i]], leafvals);
+
+	for(int w = 0; w < words.size(); w++){
+		int ei = children.size() + w;
+		leafvals[leafstart + w] = fakevals[fake_leafmap[y][ei]];
+	}
+}
+
+int MultiNode::num_variants() const{
 	return variants.size();
 }
-double MultiNode::var_logweight(int given_y){
+double MultiNode::var_logweight(int given_y) const{
 	return variant_logweights[given_y];
 }
 
-double MultiNode::logphi_update(int given_y){
-	return variants[given_y].logphi_update();
+double MultiNode::logphi_update(Counts c, int given_y) const{
+	return variants[given_y].logphi_update(c);
 }
 
-// This file defines the implementation of three classes: ROOT, Node, and MultiNode. 
-// These classes represent a hierarchical structure with nodes that can have children and edges with weights. 
-// The classes provide various methods to manipulate and query this structure. 
+TopicCounts::TopicCounts():tree(NULL),num_topics(0),shared(false){}
+
+TopicCounts::TopicCounts(const ROOT *tree, int num_topics):tree(tree),num_topics(num_topics),
+		edges((size_t)num_topics * tree->num_edges, 0),
+		sums((size_t)num_topics * tree->num_nodes, 0),
+		y((size_t)num_topics * tree->num_multinodes, 0),
+		logp((size_t)num_topics * tree->num_nodes, 0.0),shared(false){}
+
+void TopicCounts::repair_sums(){
+	for(int ti = 0; ti < num_topics; ti++)
+		tree->repair_sums((*this)[ti].c);
+	fill(logp.begin(), logp.end(), NAN);
+}
+
+void TopicCounts::merge(const vector<TopicCounts> &copies, bool zero_based, int num_threads){
+	const size_t block = 4096;
+	size_t num_edge_blocks = (edges.size() + block - 1) / block;
+	size_t num_sum_blocks = (sums.size() + block - 1) / block;
+	parallel_for(0, num_edge_blocks + num_sum_blocks, num_threads, [&](int b){
+		bool is_edge = b < num_edge_blocks;
+		vector<count_t> &counts = is_edge ? edges : sums;
+		size_t first = (is_edge ? b : b - num_edge_blocks) * block;
+		for(size_t i = first; i < min(counts.size(), first + block); i++){
+			int base = zero_based ? 0 : counts[i];
+			for(int r = 0; r < copies.size(); r++)
+				counts[i] += (is_edge ? copies[r].edges[i] : copies[r].sums[i]) - base;
+		}
+	});
+	fill(logp.begin(), logp.end(), NAN);
+}
+
+int TopicCounts::size() const{
+	return num_topics;
+}
+
+Topic TopicCounts::operator[](int ti){
+	Topic t;
+	t.tree = tree;
+	t.c.edges = edges.data() + (size_t)ti * tree->num_edges;
+	t.c.sums = sums.data() + (size_t)ti * tree->num_nodes;
+	t.c.y = y.data() + (size_t)ti * tree->num_multinodes;
+	t.c.logp = logp.data() + (size_t)ti * tree->num_nodes;
+	t.c.shared = shared;
+	return t;
+}
+
+// This file defines the implementation of three classes: ROOT, Node, and MultiNode.
+// These classes represent a hierarchical structure with nodes that can have children and edges with weights.
+// The classes provide various methods to manipulate and query this structure.
+// The structure and edge priors are shared by all topics; the counts of a topic are passed in as Counts,
+// and TopicCounts stores the counts of every topic in a few flat arrays. Counts marked shared are updated
+// with relaxed atomic adds so several threads can sample into one copy. logphi_update reads cached lgamma
+// tables instead of calling lgamma, and keeps each node's log-marginal until leaf_count_update changes it.
 
 // ROOT class:
+// - layout(): Assigns every node its slots in the flat count arrays.
 // - num_leaves(): Calculates the total number of leaves in the tree.
-// - leaf_count_update(double val, int leaf): Updates the edge weights and sums based on the given leaf.
-// - get_multinodes(): Retrieves all MultiNode children of the ROOT.
-// - wordval_update(double val, int leaf): Updates and returns a value based on the edge weights and the given leaf.
-// - logphi_update(): Computes and returns a log-probability value based on the edge weights and original edge weights.
+// - sample_node(Counts c, Random &rng): Samples the selected variant of every MultiNode.
+// - leaf_count_update(Counts c, int val, int leaf): Updates the edge counts and sums based on the given leaf.
+// - wordval_update(Counts c, double val, int leaf): Updates and returns a value based on the edge weights and the given leaf.
+// - leafvals_update(Counts c, double val, vector<double> &leafvals): Pushes val down the tree in one sweep, writing the value of every leaf.
+// - logphi_update(Counts c): Returns the log-marginal of the subtree, reusing the cached value of unchanged nodes.
+// - edge_of(int leaf): Returns the root edge above a leaf.
+// - repair_sums(Counts c): Recomputes every node sum from its edges, after Hogwild epochs.
+// - leaf_count_update / wordval_update with an explicit root sum: The same, for callers that keep the root sum themselves.
 
 // Node class:
 // - num_leaves(): Calculates the total number of leaves in the subtree rooted at this node.
-// - leaf_count_update(double val, int leaf): Updates the edge weights and sums based on the given leaf.
-// - wordval_update(double val, int leaf): Updates and returns a value based on the edge weights and the given leaf.
-// - logphi_update(): Computes and returns a log-probability value based on the edge weights and original edge weights.
+// - leaf_count_update(Counts c, int val, int leaf): Updates the edge counts and sums based on the given leaf.
+// - wordval_update(Counts c, double val, int leaf): Updates and returns a value based on the edge weights and the given leaf.
+// - leafvals_update(Counts c, double val, vector<double> &leafvals): Pushes val down the subtree in one sweep, writing the value of every leaf.
+// - logphi_update(Counts c): Returns the log-marginal of the subtree, reusing the cached value of unchanged nodes.
 
 // MultiNode class:
-// - logphi_update(): Computes and returns a log-probability value based on the edge weights and original edge weights.
+// - logphi_update(Counts c): Computes and returns a log-probability value through the selected variant and the children.
 // - num_leaves(): Calculates the total number of leaves in the subtree rooted at this node, including words.
-// - leaf_count_update(double val, int leaf): Updates the edge weights and sums based on the given leaf, including variants.
-// - wordval_update(double val, int leaf): Updates and returns a value based on the edge weights and the given leaf, including variants.
+// - leaf_count_update(Counts c, int val, int leaf): Updates the edge counts and sums based on the given leaf, including variants.
+// - wordval_update(Counts c, double val, int leaf): Updates and returns a value based on the edge weights and the given leaf, including variants.
+// - leafvals_update(Counts c, double val, vector<double> &leafvals): Writes the value of every leaf below, routing val through the selected variant.
 // - num_variants(): Returns the number of variants in the MultiNode.
 // - var_logweight(int given_y): Returns the log-weight of a given variant.
-// - logphi_update(int given_y): Computes and returns a log-probability value for a given variant.
\ No newline at end of file
+// - logphi_update(Counts c, int given_y): Computes and returns a log-probability value for a given variant.
+
+// TopicCounts class:
+// - operator[](int ti): Returns topic ti as a Topic, the shared tree together with that topic's counts.
+// - repair_sums(): Recomputes the sums of every topic and drops the cached log-marginals.
+// - merge(copies, zero_based, num_threads): Folds per-thread copies or deltas back into these counts.
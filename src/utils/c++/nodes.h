@@ -3,95 +3,158 @@
 
 #include <iostream>
 #include <vector>
+#include "utility.h"
 using namespace std;
 
 class MultiNode;
 
+// The tree (ROOT, Node, MultiNode) only holds the topology and the prior of every edge and is
+// shared by all topics. The counts of a topic live in flat arrays: every node owns the slots
+// edges[eoff .. eoff+#edges) and sums[noff], every multinode owns y[moff] (its selected variant).
+// The weight of an edge is orig_edge_weights[ei] + edges[eoff+ei]. logp[noff] caches the
+// log-marginal of the node's own edges; leaf_count_update resets it to NaN when the node changes.
+class Counts { //one topic's counts over a shared tree
+public:
+	count_t *edges;
+	count_t *sums;
+	int *y;
+	double *logp;
+	bool shared; //several threads update these counts at once, so adds are atomic
+};
+
 class ROOT{
 public :
-	vector<double> edge_weights;
 	vector<MultiNode> children;
 	vector<int> maxind;
 	int leafstart;
 	vector<double> orig_edge_weights;
-	double edgesum;
 	double orig_edgesum;
+	int eoff;
+	int noff;
+	vector<const utils::LgammaTable*> edge_tables; //per edge and for the sum, set by layout()
+	const utils::LgammaTable *sum_table;
 
-	ROOT();
+	int num_edges; //slots needed by one topic, set by layout()
+	int num_nodes;
+	int num_multinodes;
 
-	ROOT(vector<double> edge_weights, vector<MultiNode> children, vector<int> maxind,
-			int leafstart, double edgesum, vector<double> orig_edge_weights, double orig_edgesum);
+	ROOT();
 
+	ROOT(vector<MultiNode> children, vector<int> maxind,
+			int leafstart, vector<double> orig_edge_weights, double orig_edgesum);
 
+	void layout();
 	int num_leaves();
 
-	void sample_node();
-	void leaf_count_update(double val, int leaf);
-	double wordval_update(double val, int leaf);
-	double logphi_update();
-	vector<MultiNode> get_multinodes();
+	void sample_node(Counts c, utils::Random &rng) const;
+	void leaf_count_update(Counts c, int val, int leaf) const;
+	double wordval_update(Counts c, double val, int leaf) const;
+	void leafvals_update(Counts c, double val, vector<double> &leafvals) const;
+	double logphi_update(Counts c) const;
+	void repair_sums(Counts c) const; //recompute every node sum from its edges
+
+	//the root edge a leaf hangs from; everything below it is only touched by that leaf's updates
+	int edge_of(int leaf) const;
+	//as above, with the root's own sum held by the caller (the rest of the path still lives in c).
+	//The root's cached logp is not reset, the caller does that when it folds sum back.
+	void leaf_count_update(Counts c, int val, int leaf, count_t &sum) const;
+	double wordval_update(Counts c, double val, int leaf, int sum) const;
+
+private:
+	template<bool shared> void count_update(Counts c, int val, int leaf, count_t &sum) const;
 };
 
 class Node { //represent a node in dirichlet tree
 public:
 
-	vector<double> edge_weights;
-
 	vector<Node> children;
 
 	vector<int> maxind;
 	int leafstart;
 	vector<double> orig_edge_weights;
-	double edgesum;
 	double orig_edgesum;
+	int eoff;
+	int noff;
+	vector<const utils::LgammaTable*> edge_tables; //per edge and for the sum, set by layout()
+	const utils::LgammaTable *sum_table;
 
-	Node(vector<double> edge_weights, vector<Node> children,
-			vector<int> maxind, int leafstart, double edgesum,
+	Node(vector<Node> children, vector<int> maxind, int leafstart,
 			vector<double> orig_edge_weights, double orig_edgesum);
 
 	vector<int> words;
-	Node(vector<double> edge_weights, vector<Node> children, vector<int> maxind,
-					int leafstart, vector<int> words,
-					double edgesum, vector<double> orig_edge_weights, double orig_edgesum);
+	Node(vector<Node> children, vector<int> maxind, int leafstart, vector<int> words,
+			vector<double> orig_edge_weights, double orig_edgesum);
 
+	void layout(int &num_edges, int &num_nodes);
 	int num_leaves();
 
-	void sample_node();
-	void leaf_count_update(double val, int leaf);
-	double wordval_update(double val, int leaf);
-	double logphi_update();
+	template<bool shared> void leaf_count_update(Counts c, int val, int leaf) const; //shared: atomic adds
+	double wordval_update(Counts c, double val, int leaf) const;
+	void leafvals_update(Counts c, double val, vector<double> &leafvals) const;
+	double logphi_update(Counts c) const;
+	void repair_sums(Counts c) const;
 };
 
 class MultiNode{ //represent an intermediate node
 public:
-	vector<double> edge_weights;
 	vector<int> maxind;
 	int leafstart;
 	vector<Node> children;
-	vector<double> orig_edge_weights;
-	double edgesum;
-	double orig_edgesum;
 
 	vector<int> words;
 	vector<Node> variants;
 	vector<double> variant_logweights;
 	vector<vector<int>> fake_leafmap;
-	int y;
-
-	MultiNode(vector<double> edge_weights, vector<Node> children, vector<int> maxind,
-				int leafstart, double edgesum, vector<double> orig_edge_weights, double orig_edgesum);
-		MultiNode(vector<double> edge_weights, vector<Node> children, vector<int> maxind,
-				int leafstart, vector<int> words, vector<Node> variants, vector<vector<int>> fake_leafmap,
-				vector<double> variant_logweights);
-
-	void leaf_count_update(double val, int leaf);
-	double wordval_update(double val, int leaf);
-	int num_variants();
-	double var_logweight(int given_y);
-	double logphi_update(int given_y);
+	int moff;
+
+	MultiNode(vector<Node> children, vector<int> maxind, int leafstart, vector<int> words,
+			vector<Node> variants, vector<vector<int>> fake_leafmap, vector<double> variant_logweights);
+
+	void layout(int &num_edges, int &num_nodes, int &num_multinodes);
+
+	template<bool shared> void leaf_count_update(Counts c, int val, int leaf) const;
+	double wordval_update(Counts c, double val, int leaf) const;
+	void leafvals_update(Counts c, double val, vector<double> &leafvals) const;
+	int num_variants() const;
+	double var_logweight(int given_y) const;
+	double logphi_update(Counts c, int given_y) const;
 	int num_leaves();
-	double logphi_update();
+	double logphi_update(Counts c) const;
+	void repair_sums(Counts c) const;
+
+};
 
+class Topic { //one topic: the shared tree seen through this topic's counts
+public:
+	const ROOT *tree;
+	Counts c;
+
+	void sample_node(utils::Random &rng){ tree->sample_node(c, rng); }
+	void leaf_count_update(int val, int leaf){ tree->leaf_count_update(c, val, leaf); }
+	double wordval_update(double val, int leaf){ return tree->wordval_update(c, val, leaf); }
+	void leafvals_update(double val, vector<double> &leafvals){ tree->leafvals_update(c, val, leafvals); }
+	double logphi_update(){ return tree->logphi_update(c); }
+};
+
+class TopicCounts { //counts of all topics over one shared tree, stored topic after topic
+public:
+	const ROOT *tree;
+	int num_topics;
+	vector<count_t> edges;
+	vector<count_t> sums;
+	vector<int> y;
+	vector<double> logp;
+	bool shared; //handed out as shared Counts, for Hogwild sampling
+
+	TopicCounts();
+	TopicCounts(const ROOT *tree, int num_topics); //all counts zero
+
+	int size() const;
+	Topic operator[](int ti);
+	void repair_sums(); //every sum from its edges, and all cached log-marginals dropped
+	//adds the counts of copies: their change since they were copied from these counts, or with
+	//zero_based their whole counts (copies that started empty); on num_threads threads
+	void merge(const vector<TopicCounts> &copies, bool zero_based, int num_threads);
 };
 
 
@@ -0,0 +1,92 @@
+#include "numa.h"
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace numa{
+
+vector<int> parse_cpulist(const string &list){
+	vector<int> cpus;
+	stringstream ranges(list);
+	string range;
+	while(getline(ranges, range, ',')){
+		if(range.empty() || range == "\n")
+			continue;
+		size_t dash = range.find('-');
+		int lo = atoi(range.c_str());
+		int hi = dash == string::npos ? lo : atoi(range.c_str() + dash + 1);
+		for(int cpu = lo; cpu <= hi; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+Topology::Topology(){
+	for(int node = 0; ; node++){
+		ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+		if(file.fail())
+			break;
+		string list;
+		getline(file, list);
+		vector<int> node_cpus = parse_cpulist(list);
+		if(!node_cpus.empty()) //memory-only nodes have no cpus to run on
+			cpus.push_back(node_cpus);
+	}
+	if(cpus.empty()){
+		int n = max(1u, thread::hardware_concurrency());
+		cpus.push_back(vector<int>());
+		for(int cpu = 0; cpu < n; cpu++)
+			cpus[0].push_back(cpu);
+	}
+}
+
+int Topology::num_nodes() const{
+	return cpus.size();
+}
+
+int Topology::node_of(int thread, int num_threads) const{
+	int nodes = min(num_nodes(), num_threads);
+	return (long long)thread * nodes / num_threads;
+}
+
+int Topology::cpu_of(int thread, int num_threads) const{
+	int node = node_of(thread, num_threads);
+	int first = 0; //first thread placed on this node
+	while(node_of(first, num_threads) != node)
+		first++;
+	return cpus[node][(thread - first) % cpus[node].size()];
+}
+
+const Topology &topology(){
+	static Topology host;
+	return host;
+}
+
+bool pin(int cpu){
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+}
+
+/*
+ * This file implements the small amount of NUMA support used by the parallel sampling modes.
+ *
+ * - Topology: Reads the cpus of every NUMA node from /sys and maps worker threads onto nodes in
+ *   contiguous runs, so neighbouring document shards share a node.
+ * - pin: Binds the calling thread to one cpu, so memory it first-touches stays on that cpu's node.
+ * - parse_cpulist: Parses the kernel's cpu list format.
+ */
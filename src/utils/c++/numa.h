@@ -0,0 +1,29 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include <vector>
+#include <string>
+using namespace std;
+
+namespace numa{
+
+	class Topology { //the cpus of every NUMA node, as reported by /sys on Linux
+	public:
+		vector<vector<int>> cpus;
+
+		Topology(); //reads the host; a single node with all cpus where that is not available
+
+		int num_nodes() const;
+		int node_of(int thread, int num_threads) const; //threads are spread over nodes in contiguous runs
+		int cpu_of(int thread, int num_threads) const;
+	};
+
+	const Topology &topology(); //read once
+
+	bool pin(int cpu); //pins the calling thread, false where unsupported
+
+	vector<int> parse_cpulist(const string &list); //"0-3,8-11"
+
+};
+
+#endif /* NUMA_H_ */
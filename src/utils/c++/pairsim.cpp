@@ -0,0 +1,93 @@
+#include <iostream>
+#include <getopt.h>
+#include <sstream>
+#include "similarity.h"
+#include "utility.h"
+#include "instrument.h"
+
+using namespace std;
+using namespace similarity;
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	string theta_file;
+	string pair_file;
+	string output_path;
+	vector<string> measures;
+	int num_threads = 1;
+	bool npy = false;
+
+	const char *optstring = "i:p:m:o:j:n";
+
+	while( (opt = getopt(argc, argv, optstring)) != -1){
+
+		switch (opt){
+			case 'i': //theta.dat, theta.csr.dat or a .npy matrix
+				theta_file = optarg;
+				break;
+			case 'p': //document index pairs, one per line
+				pair_file = optarg;
+				break;
+			case 'm':{ //comma separated: cosine, hellinger, js, l1
+				stringstream list(optarg);
+				string tok;
+				while(getline(list, tok, ','))
+					measures.push_back(tok);
+				break;
+			}
+			case 'o':
+				output_path = optarg;
+				break;
+			case 'j':
+				num_threads = atoi(optarg);
+				break;
+			case 'n': //numpy arrays instead of text columns
+				npy = true;
+				break;
+			default:
+				cerr <<"unknown option: " << char(optopt) << endl;
+				return -1;
+		}
+	}
+	if(measures.empty())
+		measures.push_back("cosine");
+	for(size_t mi = 0; mi < measures.size(); mi++){
+		if(!known(measures[mi])){
+			cerr << "unknown measure: " << measures[mi] << endl;
+			return -1;
+		}
+	}
+	num_threads = max(1, num_threads);
+
+	double start = instrument::now();
+	Theta theta;
+	if(!load_theta(theta_file, theta, num_threads)){
+		cerr << "cannot read theta file " << theta_file << endl;
+		return 1;
+	}
+	vector<long long> a, b;
+	if(!load_pairs(pair_file, a, b, num_threads)){
+		cerr << "cannot read pair file " << pair_file << endl;
+		return 1;
+	}
+	cout << theta.num_docs << " docs, " << theta.num_topics << " topics, " << a.size() << " pairs ("
+			<< instrument::now() - start << "s)" << endl;
+
+	for(size_t mi = 0; mi < measures.size(); mi++){
+		start = instrument::now();
+		vector<double> vals = compare_pairs(theta, a, b, measures[mi], num_threads);
+		string filename = output_path + measures[mi] + (npy ? ".npy" : ".dat");
+		save_column(filename, vals);
+		cout << measures[mi] << " -> " << filename << " (" << instrument::now() - start << "s)" << endl;
+	}
+
+	return 0;
+}
+
+/*
+ * This file is the entry point for batch document similarity, used to generate regression variables.
+ * It reads a theta matrix (-i, dense text, sparse counts from train -s, or .npy) and a file of
+ * document index pairs (-p), and writes one column per measure (-m cosine,hellinger,js,l1) to
+ * <output path><measure>.dat, or .npy with -n, computing the pairs on -j threads.
+ */
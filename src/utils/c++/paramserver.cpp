@@ -0,0 +1,42 @@
+#include <iostream>
+#include <getopt.h>
+#include "distributed.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	string address;
+	int num_workers = 1;
+
+	const char *optstring = "s:n:";
+
+	while( (opt = getopt(argc, argv, optstring)) != -1){
+
+		switch (opt){
+			case 's':
+				address = optarg;
+				break;
+			case 'n':
+				num_workers = atoi(optarg);
+				break;
+			default:
+				cerr <<"unknown option: " << char(optopt) << endl;
+				return -1;
+		}
+	}
+	if(address.empty() || num_workers < 1){
+		cerr << "-s address (host:port or a socket path) and -n workers are needed" << endl;
+		return -1;
+	}
+
+	distributed::CountServer server(num_workers);
+	return server.serve(address) ? 0 : 1;
+}
+
+/*
+ * This file is the entry point of the count server for distributed training.
+ * It listens on -s (host:port for TCP, or a path for a Unix domain socket) for -n train workers
+ * (train -P address -i id/n), then keeps their topic counts in step until they have all finished.
+ */
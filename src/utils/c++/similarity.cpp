@@ -0,0 +1,315 @@
+#include "similarity.h"
+#include "utility.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+using namespace utils;
+
+namespace similarity{
+
+Theta::Theta(): num_docs(0), num_topics(0){
+}
+
+//calls fn(part, line, end of line) for every line of text, each part of it on its own thread
+template<class F>
+static void parse_lines(const string &text, int num_threads, F fn){
+	vector<size_t> bounds = line_chunks(text, num_threads);
+	parallel_for(0, num_threads, num_threads, [&](int p){
+		const char *at = text.data() + bounds[p];
+		const char *end = text.data() + bounds[p + 1];
+		while(at < end){
+			const char *eol = find(at, end, '\n');
+			fn(p, at, eol);
+			at = eol + 1;
+		}
+	});
+}
+
+static bool load_npy(const string &text, Theta &theta){
+	if(text.size() < 10 || text.compare(0, 6, "\x93NUMPY") != 0)
+		return false;
+	int major = (unsigned char)text[6];
+	size_t header_len, offset;
+	if(major == 1){
+		header_len = (unsigned char)text[8] | (unsigned char)text[9] << 8;
+		offset = 10;
+	}else{
+		header_len = (unsigned char)text[8] | (unsigned char)text[9] << 8
+				| (unsigned char)text[10] << 16 | (size_t)(unsigned char)text[11] << 24;
+		offset = 12;
+	}
+	string header = text.substr(offset, header_len);
+	offset += header_len;
+
+	bool f8 = header.find("'<f8'") != string::npos;
+	bool f4 = header.find("'<f4'") != string::npos;
+	size_t shape = header.find("'shape'");
+	if((!f8 && !f4) || header.find("'fortran_order': True") != string::npos || shape == string::npos){
+		cerr << "theta .npy must be a C-ordered float64 or float32 matrix" << endl;
+		return false;
+	}
+	const char *dims = header.c_str() + header.find('(', shape) + 1;
+	char *next;
+	theta.num_docs = strtoll(dims, &next, 10);
+	while(*next == ',' || *next == ' ')
+		next++;
+	theta.num_topics = *next == ')' ? 1 : strtol(next, NULL, 10);
+
+	size_t count = theta.num_docs * theta.num_topics;
+	if(text.size() < offset + count * (f8 ? 8 : 4))
+		return false;
+	theta.vals.resize(count);
+	if(f8)
+		memcpy(theta.vals.data(), text.data() + offset, count * sizeof(double));
+	else{
+		const float *vals = (const float *)(text.data() + offset);
+		for(size_t i = 0; i < count; i++)
+			theta.vals[i] = vals[i];
+	}
+	return true;
+}
+
+//the "num_docs num_topics nnz alpha" header and "doc_len nnz topic:count ..." rows of save_sparse_counts
+static bool load_csr(const string &text, Theta &theta, int num_threads){
+	stringstream head(text.substr(0, text.find('\n')));
+	long long nnz;
+	double alpha;
+	if(!(head >> theta.num_docs >> theta.num_topics >> nnz >> alpha))
+		return false;
+	theta.vals.assign(theta.num_docs * theta.num_topics, 0.0);
+	string body = text.substr(text.find('\n') + 1);
+
+	//rows are numbered by counting the lines before each part
+	vector<size_t> bounds = line_chunks(body, num_threads);
+	vector<long long> first_row(num_threads + 1, 0);
+	for(int p = 0; p < num_threads; p++)
+		first_row[p + 1] = first_row[p] + count(body.begin() + bounds[p], body.begin() + bounds[p + 1], '\n');
+	vector<long long> row(first_row.begin(), first_row.end() - 1);
+	parse_lines(body, num_threads, [&](int p, const char *line, const char *){
+		long long di = row[p]++;
+		if(di >= theta.num_docs)
+			return;
+		char *next;
+		int doc_len = strtol(line, &next, 10);
+		int row_nnz = strtol(next, &next, 10);
+		double norm = doc_len + theta.num_topics * alpha;
+		double *vals = theta.vals.data() + di * theta.num_topics;
+		fill(vals, vals + theta.num_topics, alpha / norm);
+		for(int q = 0; q < row_nnz; q++){
+			int k = strtol(next, &next, 10);
+			int count = strtol(next + 1, &next, 10); //skips the ':'
+			vals[k] = (count + alpha) / norm;
+		}
+	});
+	return true;
+}
+
+static bool ends_with(const string &s, const string &suffix){
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool load_theta(string filename, Theta &theta, int num_threads){
+	string text;
+	if(!read_file(filename, text))
+		return false;
+	if(ends_with(filename, ".npy"))
+		return load_npy(text, theta);
+	if(ends_with(filename, ".csr.dat"))
+		return load_csr(text, theta, num_threads);
+
+	vector<vector<double>> parts(num_threads);
+	vector<int> widths(num_threads, 0);
+	parse_lines(text, num_threads, [&](int p, const char *line, const char *eol){
+		int width = 0;
+		char *next;
+		for(const char *c = line; ; c = next){
+			while(c < eol && isspace((unsigned char)*c)) //strtod would skip the newline too
+				c++;
+			if(c >= eol)
+				break;
+			double v = strtod(c, &next);
+			if(next == c)
+				break;
+			parts[p].push_back(v);
+			width++;
+		}
+		if(width > 0)
+			widths[p] = width;
+	});
+	theta.num_topics = *max_element(widths.begin(), widths.end());
+	theta.vals.clear();
+	for(int p = 0; p < num_threads; p++){
+		theta.vals.insert(theta.vals.end(), parts[p].begin(), parts[p].end());
+		vector<double>().swap(parts[p]);
+	}
+	theta.num_docs = theta.num_topics > 0 ? theta.vals.size() / theta.num_topics : 0;
+	return true;
+}
+
+bool load_pairs(string filename, vector<long long> &a, vector<long long> &b, int num_threads){
+	string text;
+	if(!read_file(filename, text))
+		return false;
+	vector<vector<long long>> parts_a(num_threads), parts_b(num_threads);
+	parse_lines(text, num_threads, [&](int p, const char *line, const char *eol){
+		char *next;
+		long long x = strtoll(line, &next, 10);
+		if(next == line || next >= eol)
+			return;
+		const char *c = next;
+		while(c < eol && (*c == ',' || *c == ' ' || *c == '\t'))
+			c++;
+		long long y = strtoll(c, &next, 10);
+		if(next == c || next > eol)
+			return;
+		parts_a[p].push_back(x);
+		parts_b[p].push_back(y);
+	});
+	a.clear();
+	b.clear();
+	for(int p = 0; p < num_threads; p++){
+		a.insert(a.end(), parts_a[p].begin(), parts_a[p].end());
+		b.insert(b.end(), parts_b[p].begin(), parts_b[p].end());
+	}
+	return true;
+}
+
+//the kernels keep LANES independent partial sums, so the compiler can vectorize them without
+//reassociating (and changing the result of) a single running sum
+static const int LANES = 4;
+
+static double cosine(const double *x, const double *y, int n){
+	double dot[LANES] = {0}, xx[LANES] = {0}, yy[LANES] = {0};
+	int k = 0;
+	for(; k + LANES <= n; k += LANES)
+		for(int l = 0; l < LANES; l++){
+			dot[l] += x[k + l] * y[k + l];
+			xx[l] += x[k + l] * x[k + l];
+			yy[l] += y[k + l] * y[k + l];
+		}
+	for(; k < n; k++){
+		dot[0] += x[k] * y[k];
+		xx[0] += x[k] * x[k];
+		yy[0] += y[k] * y[k];
+	}
+	double d = (dot[0] + dot[1]) + (dot[2] + dot[3]);
+	double nx = (xx[0] + xx[1]) + (xx[2] + xx[3]);
+	double ny = (yy[0] + yy[1]) + (yy[2] + yy[3]);
+	return d / sqrt(nx * ny);
+}
+
+static double hellinger(const double *x, const double *y, int n){
+	double sum[LANES] = {0};
+	int k = 0;
+	for(; k + LANES <= n; k += LANES)
+		for(int l = 0; l < LANES; l++){
+			double d = sqrt(x[k + l]) - sqrt(y[k + l]);
+			sum[l] += d * d;
+		}
+	for(; k < n; k++){
+		double d = sqrt(x[k]) - sqrt(y[k]);
+		sum[0] += d * d;
+	}
+	return sqrt(0.5 * ((sum[0] + sum[1]) + (sum[2] + sum[3])));
+}
+
+static double js(const double *x, const double *y, int n){ //log bound, not worth lanes
+	double sum = 0.0;
+	for(int k = 0; k < n; k++){
+		double m = 0.5 * (x[k] + y[k]);
+		if(x[k] > 0)
+			sum += x[k] * log(x[k] / m);
+		if(y[k] > 0)
+			sum += y[k] * log(y[k] / m);
+	}
+	return 0.5 * sum;
+}
+
+static double l1(const double *x, const double *y, int n){
+	double sum[LANES] = {0};
+	int k = 0;
+	for(; k + LANES <= n; k += LANES)
+		for(int l = 0; l < LANES; l++)
+			sum[l] += fabs(x[k + l] - y[k + l]);
+	for(; k < n; k++)
+		sum[0] += fabs(x[k] - y[k]);
+	return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+typedef double (*Kernel)(const double *, const double *, int);
+
+static Kernel kernel_of(string measure){
+	if(measure == "cosine")
+		return cosine;
+	if(measure == "hellinger")
+		return hellinger;
+	if(measure == "js")
+		return js;
+	if(measure == "l1")
+		return l1;
+	return NULL;
+}
+
+bool known(string measure){
+	return kernel_of(measure) != NULL;
+}
+
+double compare(const double *x, const double *y, int num_topics, string measure){
+	return kernel_of(measure)(x, y, num_topics);
+}
+
+vector<double> compare_pairs(const Theta &theta, const vector<long long> &a, const vector<long long> &b,
+		string measure, int num_threads){
+	Kernel kernel = kernel_of(measure);
+	long long num_pairs = a.size();
+	vector<double> vals(num_pairs);
+	//contiguous runs of pairs per thread, so every thread writes its own stretch of vals
+	parallel_for(0, num_threads, num_threads, [&](int p){
+		int n = theta.num_topics;
+		for(long long i = num_pairs * p / num_threads; i < num_pairs * (p + 1) / num_threads; i++){
+			if(a[i] < 0 || a[i] >= theta.num_docs || b[i] < 0 || b[i] >= theta.num_docs)
+				vals[i] = NAN;
+			else
+				vals[i] = kernel(theta.row(a[i]), theta.row(b[i]), n);
+		}
+	});
+	return vals;
+}
+
+void save_column(string filename, const vector<double> &vals){
+	ofstream file(filename.c_str(), ios::binary);
+	if(ends_with(filename, ".npy")){
+		string header = "{'descr': '<f8', 'fortran_order': False, 'shape': (" + to_string(vals.size()) + ",), }";
+		header.append(63 - (10 + header.size()) % 64, ' '); //data starts on a 64-byte boundary
+		header += '\n';
+		file.write("\x93NUMPY\x01\x00", 8);
+		char len[2] = {(char)(header.size() & 0xff), (char)(header.size() >> 8)};
+		file.write(len, 2);
+		file << header;
+		file.write((const char *)vals.data(), vals.size() * sizeof(double));
+	}else{
+		file.precision(17);
+		for(size_t i = 0; i < vals.size(); i++)
+			file << vals[i] << "\n";
+	}
+	file.close();
+}
+
+};
+
+/*
+ * This file implements batch comparison of document-topic vectors.
+ * - load_theta: Reads dense text theta, the sparse counts written by train -s, or a .npy matrix.
+ * - load_pairs: Reads the document index pairs to compare.
+ * - compare_pairs: Cosine similarity, Hellinger distance, Jensen-Shannon divergence or L1 distance
+ *   of every pair, split across threads.
+ * - save_column: Writes the values as a text column or a numpy array.
+ */
@@ -0,0 +1,43 @@
+#ifndef SIMILARITY_H_
+#define SIMILARITY_H_
+
+#include <vector>
+#include <string>
+using namespace std;
+
+// Batch comparison of document-topic vectors, for regression variables over pairs of documents
+// (e.g. question/answer similarity) without a per-row Python loop.
+namespace similarity{
+
+	class Theta { //document-topic rows, stored row after row
+	public:
+		long long num_docs;
+		int num_topics;
+		vector<double> vals;
+
+		Theta();
+		const double *row(long long i) const{ return vals.data() + i * num_topics; }
+	};
+
+	//theta.dat (text, one row per line), theta.csr.dat (train -s) or a 2-D float64/float32 .npy
+	bool load_theta(string filename, Theta &theta, int num_threads = 1);
+
+	//one "a b" (or "a,b") document index pair per line; lines without two numbers (headers) are skipped
+	bool load_pairs(string filename, vector<long long> &a, vector<long long> &b, int num_threads = 1);
+
+	bool known(string measure); //cosine, hellinger, js, l1
+
+	//cosine: similarity, 1 - scipy's cosine distance; hellinger: distance; js: Jensen-Shannon
+	//divergence (natural log); l1: sum of absolute differences
+	double compare(const double *x, const double *y, int num_topics, string measure);
+
+	//compare(theta.row(a[i]), theta.row(b[i])) for every pair, on num_threads threads
+	vector<double> compare_pairs(const Theta &theta, const vector<long long> &a, const vector<long long> &b,
+			string measure, int num_threads = 1);
+
+	//one value per line, or a float64 .npy array when filename ends with .npy
+	void save_column(string filename, const vector<double> &vals);
+
+};
+
+#endif /* SIMILARITY_H_ */
@@ -0,0 +1,352 @@
+#include "sparse_phi.h"
+#include "utility.h"
+
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+using namespace utils;
+
+static const long long PHI_MAGIC = 0x49485041444c5453LL; //"STLDAPHI"
+static const long long PHI_VERSION = 2;
+
+static unsigned short to_half(float f){ //IEEE 754 binary16, round to nearest even
+	unsigned x;
+	memcpy(&x, &f, sizeof(x));
+	unsigned sign = (x >> 16) & 0x8000;
+	int exp = ((x >> 23) & 0xff) - 127 + 15;
+	unsigned mant = x & 0x7fffff;
+	if(exp >= 31)
+		return sign | 0x7c00;
+	if(exp <= 0){ //subnormal or zero
+		if(exp < -10)
+			return sign;
+		mant |= 0x800000;
+		int shift = 14 - exp;
+		unsigned half = mant >> shift;
+		unsigned rest = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+		if(rest > mid || (rest == mid && (half & 1)))
+			half++;
+		return sign | half;
+	}
+	unsigned half = sign | (exp << 10) | (mant >> 13);
+	unsigned rest = mant & 0x1fff;
+	if(rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++; //may carry into the exponent, which is still correct
+	return half;
+}
+
+static float from_half(unsigned short h){
+	unsigned sign = (h & 0x8000) << 16;
+	int exp = (h >> 10) & 0x1f;
+	unsigned mant = h & 0x3ff;
+	unsigned x;
+	if(exp == 0){
+		if(mant == 0)
+			x = sign;
+		else{ //subnormal: normalize
+			exp = 1;
+			while(!(mant & 0x400)){
+				mant <<= 1;
+				exp--;
+			}
+			mant &= 0x3ff;
+			x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+		}
+	}else if(exp == 31)
+		x = sign | 0x7f800000 | (mant << 13);
+	else
+		x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+SparsePhi::SparsePhi(): num_topics(0), num_words(0), log8(false), num_top(100){
+}
+
+void SparsePhi::compress(const vector<vector<double>> &phi, double mass, bool log8_codes){
+	num_topics = phi.size();
+	num_words = num_topics > 0 ? phi[0].size() : 0;
+	log8 = log8_codes;
+	lo.assign(num_topics, 0.0f);
+	hi.assign(num_topics, 0.0f);
+	residual.assign(num_topics, 0.0);
+
+	//topic-major while compressing, most probable first; only the word-major copy is kept
+	vector<long long> offsets(1, 0);
+	vector<int> words;
+	vector<unsigned short> codes;
+	for(int ti = 0; ti < num_topics; ti++){
+		vector<int> idx = sort_indexes(phi[ti]); //most probable first
+		double total = 0.0;
+		int kept = 0;
+		while(kept < num_words && (kept == 0 || total < mass))
+			total += phi[ti][idx[kept++]];
+
+		double top = phi[ti][idx[0]], bottom = phi[ti][idx[kept - 1]];
+		if(log8){
+			lo[ti] = log(bottom);
+			hi[ti] = log(top);
+		}else
+			hi[ti] = top;
+		double decoded = 0.0;
+		for(int n = 0; n < kept; n++){
+			double p = phi[ti][idx[n]];
+			words.push_back(idx[n]);
+			if(log8){
+				double span = hi[ti] - lo[ti];
+				int code = span > 0 ? (int)lround((log(p) - lo[ti]) / span * 255) : 255;
+				codes.push_back(min(255, max(0, code)));
+			}else
+				codes.push_back(to_half(p / top));
+			decoded += decode(ti, codes.back());
+		}
+		offsets.push_back(words.size());
+		//the residual makes the decoded topic sum to one
+		residual[ti] = kept < num_words ? max(0.0, 1.0 - decoded) / (num_words - kept) : 0.0;
+	}
+	index_words(offsets, words, codes);
+}
+
+double SparsePhi::decode(int topic, int code) const{
+	if(log8)
+		return exp(lo[topic] + code / 255.0 * (hi[topic] - lo[topic]));
+	return from_half(code) * (double)hi[topic];
+}
+
+void SparsePhi::index_words(const vector<long long> &offsets, const vector<int> &words,
+		const vector<unsigned short> &codes){
+	//counting sort of the entries by word, topics ascending within a word
+	word_offsets.assign(num_words + 1, 0);
+	for(size_t e = 0; e < words.size(); e++)
+		word_offsets[words[e] + 1]++;
+	for(int w = 0; w < num_words; w++)
+		word_offsets[w + 1] += word_offsets[w];
+	word_topics.resize(words.size());
+	codes8.clear();
+	codes16.clear();
+	if(log8)
+		codes8.resize(words.size());
+	else
+		codes16.resize(words.size());
+	vector<long long> fill_at(word_offsets.begin(), word_offsets.end() - 1);
+	top_offsets.assign(1, 0);
+	top.clear();
+	for(int ti = 0; ti < num_topics; ti++){
+		for(long long e = offsets[ti]; e < offsets[ti + 1]; e++){
+			long long at = fill_at[words[e]]++;
+			if(log8)
+				codes8[at] = codes[e];
+			else
+				codes16[at] = codes[e];
+			word_topics[at] = ti;
+		}
+		top.insert(top.end(), words.begin() + offsets[ti], words.begin() + min(offsets[ti + 1], offsets[ti] + num_top));
+		top_offsets.push_back(top.size());
+	}
+}
+
+double SparsePhi::prob(int topic, int word) const{
+	if(topic < 0 || topic >= num_topics || word < 0 || word >= num_words)
+		return 0.0;
+	for(long long i = word_offsets[word]; i < word_offsets[word + 1]; i++)
+		if(word_topics[i] == topic)
+			return decode(topic, code(i));
+	return residual[topic];
+}
+
+void SparsePhi::word_probs(int word, double *probs) const{
+	if(word < 0 || word >= num_words){
+		fill(probs, probs + num_topics, 0.0);
+		return;
+	}
+	for(int ti = 0; ti < num_topics; ti++)
+		probs[ti] = residual[ti];
+	for(long long i = word_offsets[word]; i < word_offsets[word + 1]; i++)
+		probs[word_topics[i]] = decode(word_topics[i], code(i));
+}
+
+vector<int> SparsePhi::top_words(int topic, int n) const{
+	if(topic < 0 || topic >= num_topics || n <= 0)
+		return vector<int>();
+	long long first = top_offsets[topic];
+	long long last = min(top_offsets[topic + 1], first + n);
+	return vector<int>(top.begin() + first, top.begin() + last);
+}
+
+vector<double> SparsePhi::fold_in(const vector<int> &doc, double alpha, int iterations) const{
+	//p(w|k) of every distinct word once, then EM: theta_k ~ alpha + sum_w n_w p(k|w, theta)
+	vector<int> types;
+	for(size_t i = 0; i < doc.size(); i++)
+		if(doc[i] >= 0 && doc[i] < num_words)
+			types.push_back(doc[i]);
+	sort(types.begin(), types.end());
+	vector<pair<int, int>> counts; //(word, occurrences)
+	for(size_t i = 0; i < types.size(); i++){
+		if(!counts.empty() && counts.back().first == types[i])
+			counts.back().second++;
+		else
+			counts.push_back(make_pair(types[i], 1));
+	}
+	vector<double> probs(counts.size() * num_topics);
+	for(size_t i = 0; i < counts.size(); i++)
+		word_probs(counts[i].first, probs.data() + i * num_topics);
+
+	vector<double> theta(num_topics, 1.0 / num_topics), next(num_topics);
+	for(int it = 0; it < iterations; it++){
+		fill(next.begin(), next.end(), alpha);
+		for(size_t i = 0; i < counts.size(); i++){
+			const double *p = probs.data() + i * num_topics;
+			double norm = 0.0;
+			for(int ti = 0; ti < num_topics; ti++)
+				norm += theta[ti] * p[ti];
+			if(norm <= 0)
+				continue;
+			double scale = counts[i].second / norm;
+			for(int ti = 0; ti < num_topics; ti++)
+				next[ti] += theta[ti] * p[ti] * scale;
+		}
+		double total = 0.0;
+		for(int ti = 0; ti < num_topics; ti++)
+			total += next[ti];
+		for(int ti = 0; ti < num_topics; ti++)
+			theta[ti] = next[ti] / total;
+	}
+	return theta;
+}
+
+size_t SparsePhi::memory_bytes() const{
+	return word_offsets.size() * sizeof(long long) + word_topics.size() * sizeof(unsigned short)
+			+ codes16.size() * sizeof(unsigned short) + codes8.size() + (lo.size() + hi.size()) * sizeof(float)
+			+ residual.size() * sizeof(double) + top_offsets.size() * sizeof(long long) + top.size() * sizeof(int);
+}
+
+//header (magic, version, num_topics, num_words, log8, nnz, num_top), then residual, lo, hi,
+//word_offsets, word_topics, codes, top_offsets and top, all little endian
+bool SparsePhi::save(string filename) const{
+	ofstream file(filename.c_str(), ios::binary);
+	if(!file)
+		return false;
+	long long header[7] = {PHI_MAGIC, PHI_VERSION, num_topics, num_words, log8, num_entries(), num_top};
+	file.write((const char *)header, sizeof(header));
+	file.write((const char *)residual.data(), residual.size() * sizeof(double));
+	file.write((const char *)lo.data(), lo.size() * sizeof(float));
+	file.write((const char *)hi.data(), hi.size() * sizeof(float));
+	file.write((const char *)word_offsets.data(), word_offsets.size() * sizeof(long long));
+	file.write((const char *)word_topics.data(), word_topics.size() * sizeof(unsigned short));
+	if(log8)
+		file.write((const char *)codes8.data(), codes8.size());
+	else
+		file.write((const char *)codes16.data(), codes16.size() * sizeof(unsigned short));
+	file.write((const char *)top_offsets.data(), top_offsets.size() * sizeof(long long));
+	file.write((const char *)top.data(), top.size() * sizeof(int));
+	file.close();
+	return !file.fail();
+}
+
+static bool ascending(const vector<long long> &offsets, long long last){ //0, non-decreasing, ends at last
+	if(offsets.empty() || offsets[0] != 0 || offsets.back() != last)
+		return false;
+	for(size_t i = 1; i < offsets.size(); i++)
+		if(offsets[i] < offsets[i - 1])
+			return false;
+	return true;
+}
+
+bool SparsePhi::load(string filename){
+	ifstream file(filename.c_str(), ios::binary);
+	long long header[7] = {0};
+	if(!file.read((char *)header, 6 * sizeof(long long)) || header[0] != PHI_MAGIC
+			|| (header[1] != PHI_VERSION && header[1] != 1)){
+		cerr << filename << " is not a sparse phi file of this version" << endl;
+		return false;
+	}
+	bool topic_major = header[1] == 1; //written before the entries were stored by word
+	if(!topic_major)
+		file.read((char *)&header[6], sizeof(long long));
+	long long nnz = header[5];
+	if(file.fail() || header[2] < 1 || header[2] > 65536 || header[3] < 1 || header[3] >= 1LL << 31
+			|| nnz < 0 || nnz > header[2] * header[3] || header[6] < 0 || header[6] > header[3]){
+		cerr << filename << " is damaged" << endl;
+		return false;
+	}
+	num_topics = header[2];
+	num_words = header[3];
+	log8 = header[4] != 0;
+	residual.resize(num_topics);
+	lo.resize(num_topics);
+	hi.resize(num_topics);
+	file.read((char *)residual.data(), residual.size() * sizeof(double));
+	file.read((char *)lo.data(), lo.size() * sizeof(float));
+	file.read((char *)hi.data(), hi.size() * sizeof(float));
+	auto read_codes = [&](){
+		codes8.clear();
+		codes16.clear();
+		if(log8){
+			codes8.resize(nnz);
+			file.read((char *)codes8.data(), nnz);
+		}else{
+			codes16.resize(nnz);
+			file.read((char *)codes16.data(), nnz * sizeof(unsigned short));
+		}
+	};
+
+	bool valid = true;
+	if(topic_major){ //transposed here; num_top stays as it is
+		vector<long long> offsets(num_topics + 1);
+		vector<int> words(nnz);
+		file.read((char *)offsets.data(), offsets.size() * sizeof(long long));
+		file.read((char *)words.data(), words.size() * sizeof(int));
+		read_codes();
+		valid = !file.fail() && ascending(offsets, nnz);
+		for(long long e = 0; e < nnz && valid; e++)
+			valid = words[e] >= 0 && words[e] < num_words;
+		if(valid){
+			vector<unsigned short> codes(nnz);
+			for(long long e = 0; e < nnz; e++)
+				codes[e] = code(e);
+			index_words(offsets, words, codes);
+		}
+	}else{
+		num_top = header[6];
+		word_offsets.resize(num_words + 1);
+		word_topics.resize(nnz);
+		top_offsets.resize(num_topics + 1);
+		file.read((char *)word_offsets.data(), word_offsets.size() * sizeof(long long));
+		file.read((char *)word_topics.data(), word_topics.size() * sizeof(unsigned short));
+		read_codes();
+		file.read((char *)top_offsets.data(), top_offsets.size() * sizeof(long long));
+		valid = !file.fail() && ascending(word_offsets, nnz)
+				&& ascending(top_offsets, top_offsets.back()) && top_offsets.back() <= (long long)num_topics * num_top;
+		if(valid){
+			top.resize(top_offsets.back());
+			file.read((char *)top.data(), top.size() * sizeof(int));
+			valid = !file.fail();
+		}
+		for(long long e = 0; e < nnz && valid; e++)
+			valid = word_topics[e] < num_topics;
+		for(size_t i = 0; i < top.size() && valid; i++)
+			valid = top[i] >= 0 && top[i] < num_words;
+	}
+	if(!valid){
+		cerr << filename << " is truncated or damaged" << endl;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * This file implements the compressed phi used for serving.
+ * - compress: Keeps each topic's words up to a cumulative mass, quantizes them to float16 or
+ *   8-bit log codes, and spreads the remaining mass evenly over the other words.
+ * - index_words: Stores the entries once, by word, with codes at their own width, and keeps each
+ *   topic's top words in order for display.
+ * - save/load: A small binary file of the word-major layout; files written topic-major are
+ *   transposed on load.
+ * - prob/word_probs/top_words: p(w|k) lookups and top-word display straight from the codes.
+ * - fold_in: EM estimate of a new document's topic weights against the compressed phi.
+ */
@@ -0,0 +1,56 @@
+#ifndef SPARSE_PHI_H_
+#define SPARSE_PHI_H_
+
+#include <vector>
+#include <string>
+using namespace std;
+
+// A compact, read-only phi for serving. Each topic keeps its most probable words until they hold
+// a given share of its mass, with their probabilities quantized either to float16 (relative to the
+// topic's largest probability) or to 8-bit codes on a log scale between the topic's smallest and
+// largest kept probability. The mass left over is spread evenly over the words not kept (the
+// residual), so every topic still sums to one.
+// The kept entries are held once, by word (topics ascending), so one word is looked up in all
+// topics at once; each topic also keeps its num_top most probable words in order, for display.
+class SparsePhi {
+public:
+	int num_topics; //at most 65536
+	int num_words;
+	bool log8; //8-bit log codes instead of float16
+	int num_top; //words per topic kept in order for top_words
+	vector<long long> word_offsets; //entries of word w are [word_offsets[w], word_offsets[w+1])
+	vector<unsigned short> word_topics;
+	vector<unsigned short> codes16; //per entry, float16 codes
+	vector<unsigned char> codes8; //or 8-bit log codes
+	vector<float> lo; //per topic: log of the smallest kept value (log8)
+	vector<float> hi; //per topic: largest kept value (float16), its log (log8)
+	vector<double> residual; //per topic: probability of every word not kept
+	vector<long long> top_offsets; //the top words of topic k are [top_offsets[k], top_offsets[k+1])
+	vector<int> top;
+
+	SparsePhi();
+
+	void compress(const vector<vector<double>> &phi, double mass, bool log8); //phi is num_topics x num_words
+
+	bool save(string filename) const;
+	bool load(string filename);
+
+	long long num_entries() const{ return word_topics.size(); }
+	double prob(int topic, int word) const; //p(word | topic), 0 for an id out of range
+	void word_probs(int word, double *probs) const; //p(word | k) for every topic k, zeros for a bad id
+	vector<int> top_words(int topic, int n) const; //at most num_top
+
+	//theta of a new document (word ids) with phi fixed: EM on the topic weights, alpha smoothed;
+	//ids out of range are skipped
+	vector<double> fold_in(const vector<int> &doc, double alpha, int iterations = 50) const;
+
+	size_t memory_bytes() const;
+
+private:
+	double decode(int topic, int code) const;
+	int code(long long entry) const{ return log8 ? codes8[entry] : codes16[entry]; }
+	//from topic-major entries, each topic's most probable first, to the word-major layout
+	void index_words(const vector<long long> &offsets, const vector<int> &words, const vector<unsigned short> &codes);
+};
+
+#endif /* SPARSE_PHI_H_ */
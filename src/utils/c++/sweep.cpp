@@ -0,0 +1,101 @@
+#include "sweep.h"
+#include "utility.h"
+#include "instrument.h"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+using namespace utils;
+
+static string chain_path(string output_path, int num_topics){
+	return output_path + "k" + to_string(num_topics) + "_";
+}
+
+void save_eval(Estimator &est, string path, const Coherence *coherence){
+	double perplexity = est.perplexity();
+	ofstream eval((path + "eval.dat").c_str());
+	eval << "num_topics " << est.num_topics << endl;
+	eval << "perplexity " << perplexity << endl;
+	string scores;
+	if(coherence != NULL){
+		vector<vector<int>> topics = est.top_words();
+		for(size_t mi = 0; mi < coherence->measures.size(); mi++){
+			string measure = coherence->measures[mi];
+			double score = coherence->score(topics, measure, est.num_threads);
+			eval << measure << " " << score << endl;
+			scores += " " + measure + ": " + to_string(score);
+		}
+	}
+	eval.close();
+	cout << "K=" << est.num_topics << " perplexity: " << perplexity << scores << endl;
+}
+
+static void finish_chain(Estimator &est, string output_path, const Coherence *coherence){
+	string path = chain_path(output_path, est.num_topics);
+	est.save(path);
+	save_eval(est, path, coherence);
+}
+
+void sweep(Estimator &base, vector<int> topic_counts, string z_file, int epochs,
+		string output_path, bool split_init, const Coherence *coherence){
+	sort(topic_counts.begin(), topic_counts.end());
+	topic_counts.erase(unique(topic_counts.begin(), topic_counts.end()), topic_counts.end()); //one chain per K
+	int num_chains = topic_counts.size();
+
+	vector<unique_ptr<Estimator>> chains;
+	for(int ci = 0; ci < num_chains; ci++)
+		chains.push_back(unique_ptr<Estimator>(new Estimator(base, topic_counts[ci], base.rand_seed)));
+
+	//one z file for every chain: its labels may go up to the largest K, and are folded into each chain's range
+	vector<vector<int>> z;
+	bool have_z = num_chains > 0 && chains.back()->readin_z(z_file, z);
+	auto init_from_z = [&](Estimator &est){
+		if(!have_z){
+			est.init_counts(NULL);
+			return;
+		}
+		vector<vector<int>> folded(z);
+		for(size_t di = 0; di < folded.size(); di++)
+			for(size_t wi = 0; wi < folded[di].size(); wi++)
+				folded[di][wi] %= est.num_topics;
+		est.init_counts(&folded);
+	};
+
+	if(split_init){
+		//each chain waits for the previous one, and uses all threads for its own phi
+		for(int ci = 0; ci < num_chains; ci++){
+			Estimator &est = *chains[ci];
+			if(ci == 0)
+				init_from_z(est);
+			else
+				est.init_counts(*chains[ci-1]);
+			est.estimate(epochs);
+			finish_chain(est, output_path, coherence);
+			if(ci > 0)
+				chains[ci-1].reset();
+		}
+		return;
+	}
+
+	//independent chains share the thread budget, spare threads go to each chain's phi
+	int chain_threads = max(1, base.num_threads / num_chains);
+	parallel_for(0, num_chains, base.num_threads, [&](int ci){
+		Estimator &est = *chains[ci];
+		est.num_threads = chain_threads;
+		init_from_z(est);
+		est.estimate(epochs);
+		finish_chain(est, output_path, coherence);
+		chains[ci].reset();
+	});
+}
+
+/*
+ * This file implements the multi-K model sweep used by train when -t lists several topic counts.
+ * The corpus, constraints and tree are loaded once into a base estimator; every chain shares
+ * them and only owns its topic counts. Chains either run concurrently, or in increasing K with
+ * each one warm-started from the previous chain by splitting its topics. With a Coherence built
+ * on the shared corpus, every chain's eval file also reports the coherence of its top words.
+ */
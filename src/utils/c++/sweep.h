@@ -0,0 +1,21 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <vector>
+#include <string>
+#include "estimator.h"
+#include "coherence.h"
+using namespace std;
+
+// trains one chain per number of topics on the corpus and tree already loaded into base.
+// each chain writes <output_path>k<K>_theta.dat, ... and <output_path>k<K>_eval.dat.
+// with split_init, every chain after the first starts from the previous (smaller) one with its
+// topics split; otherwise chains are independent and run concurrently on base.num_threads threads.
+// with coherence, each eval file also gets the coherence of every measure it was built for.
+void sweep(Estimator &base, vector<int> topic_counts, string z_file, int epochs,
+		string output_path, bool split_init, const Coherence *coherence = NULL);
+
+//writes <path>eval.dat: number of topics, training perplexity and, if given, coherence
+void save_eval(Estimator &est, string path, const Coherence *coherence);
+
+#endif /* SWEEP_H_ */
@@ -0,0 +1,137 @@
+#include "synthetic.h"
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace synthetic{
+
+double normal(utils::Random &rng){
+	double u1 = rng.uniform();
+	double u2 = rng.uniform();
+	if(u1 < 1e-300)
+		u1 = 1e-300;
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+CorpusSpec::CorpusSpec(){
+	num_docs = 10000;
+	num_words = 5000;
+	num_topics = 20;
+	num_clusters = 30;
+	mean_len = 60;
+	len_dist = "lognormal";
+	len_sigma = 1.0;
+	zipf = 1.0;
+	topics_per_doc = 3;
+	seed = 42;
+}
+
+Corpus::Corpus(CorpusSpec spec):spec(spec){
+	utils::Random rng(spec.seed);
+	int V = spec.num_words;
+
+	for(int wi = 0; wi < V; wi++){
+		stringstream word;
+		word << "w" << setw(6) << setfill('0') << wi;
+		vocab.push_back(word.str());
+	}
+
+	//zipf over ranks, shared by all topics; each topic ranks the vocab differently
+	vector<double> cdf(V);
+	double total = 0.0;
+	for(int r = 0; r < V; r++){
+		total += 1.0 / pow(r + 1.0, spec.zipf);
+		cdf[r] = total;
+	}
+	vector<vector<int>> rank2word(spec.num_topics, vector<int>(V));
+	for(int k = 0; k < spec.num_topics; k++){
+		for(int wi = 0; wi < V; wi++)
+			rank2word[k][wi] = wi;
+		for(int wi = V - 1; wi > 0; wi--)
+			swap(rank2word[k][wi], rank2word[k][rng.below(wi + 1)]);
+	}
+
+	for(int di = 0; di < spec.num_docs; di++){
+		vector<int> doc_topics;
+		for(int t = 0; t < spec.topics_per_doc; t++)
+			doc_topics.push_back(rng.below(spec.num_topics));
+		int len = doc_len(rng);
+		vector<int> doc;
+		for(int n = 0; n < len; n++){
+			int k = doc_topics[rng.below(doc_topics.size())];
+			int r = lower_bound(cdf.begin(), cdf.end(), rng.uniform() * total) - cdf.begin();
+			if(r >= V)
+				r = V - 1;
+			doc.push_back(rank2word[k][r]);
+		}
+		docs.push_back(doc);
+	}
+
+	//disjoint clusters covering the whole vocab, as k-means would produce
+	vector<int> order(V);
+	for(int wi = 0; wi < V; wi++)
+		order[wi] = wi;
+	for(int wi = V - 1; wi > 0; wi--)
+		swap(order[wi], order[rng.below(wi + 1)]);
+	clusters.assign(min(spec.num_clusters, V), vector<int>());
+	for(int i = 0; i < V; i++)
+		clusters[i % clusters.size()].push_back(order[i]);
+}
+
+int Corpus::doc_len(utils::Random &rng){
+	int len;
+	if(spec.len_dist == "fixed"){
+		len = int(spec.mean_len);
+	}else if(spec.len_dist == "uniform"){
+		len = 1 + rng.below(int(2 * spec.mean_len));
+	}else{
+		//lognormal with the requested mean: mu = log(mean) - sigma^2 / 2
+		double mu = log(spec.mean_len) - spec.len_sigma * spec.len_sigma / 2;
+		len = int(exp(mu + spec.len_sigma * normal(rng)));
+	}
+	return max(len, 1);
+}
+
+long long Corpus::num_tokens(){
+	long long n = 0;
+	for(int di = 0; di < docs.size(); di++)
+		n += docs[di].size();
+	return n;
+}
+
+void Corpus::save(string prefix){
+	ofstream vocab_file((prefix + ".vocab").c_str());
+	for(int wi = 0; wi < vocab.size(); wi++)
+		vocab_file << vocab[wi] << endl;
+	vocab_file.close();
+
+	ofstream bow_file((prefix + ".bow").c_str());
+	for(int di = 0; di < docs.size(); di++){
+		for(int n = 0; n < docs[di].size(); n++)
+			bow_file << (n > 0 ? " " : "") << vocab[docs[di][n]];
+		bow_file << endl;
+	}
+	bow_file.close();
+
+	ofstream cluster_file((prefix + ".cluster").c_str());
+	for(int ci = 0; ci < clusters.size(); ci++){
+		for(int n = 0; n < clusters[ci].size(); n++)
+			cluster_file << (n > 0 ? "," : "") << vocab[clusters[ci][n]];
+		cluster_file << endl;
+	}
+	cluster_file.close();
+}
+
+}
+
+/*
+ * This file generates deterministic synthetic corpora for benchmarking.
+ *
+ * - normal: Standard normal draws from utils::Random, which gives the same stream on every platform.
+ * - CorpusSpec: Number of docs, vocab size, doc-length distribution, latent topics and clusters.
+ * - Corpus: Draws documents from a few zipf-shaped topics each, partitions the vocab into
+ *   must-link clusters, and saves vocab/bow/cluster files that train can read.
+ */
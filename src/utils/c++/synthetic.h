@@ -0,0 +1,50 @@
+#ifndef SYNTHETIC_H_
+#define SYNTHETIC_H_
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "utility.h"
+using namespace std;
+
+namespace synthetic{
+
+	double normal(utils::Random &rng); //standard normal, Box-Muller
+
+	class CorpusSpec {
+	public:
+		int num_docs;
+		int num_words;
+		int num_topics; //latent topics the documents are drawn from
+		int num_clusters; //must-link clusters written to the cluster file
+		double mean_len;
+		string len_dist; //"fixed", "uniform" or "lognormal"
+		double len_sigma; //spread of the lognormal length distribution
+		double zipf; //exponent of each topic's word distribution
+		int topics_per_doc;
+		uint64_t seed;
+
+		CorpusSpec();
+	};
+
+	class Corpus {
+	public:
+		CorpusSpec spec;
+		vector<string> vocab;
+		vector<vector<int>> docs;
+		vector<vector<int>> clusters;
+
+		Corpus(CorpusSpec spec);
+
+		long long num_tokens();
+
+		//writes <prefix>.vocab, <prefix>.bow and <prefix>.cluster in the formats train reads
+		void save(string prefix);
+
+	private:
+		int doc_len(utils::Random &rng);
+	};
+
+};
+#endif /* SYNTHETIC_H_ */
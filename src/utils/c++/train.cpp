@@ -1,7 +1,15 @@
 #include <iostream>
 #include <getopt.h>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <memory>
 #include "estimator.h"
 #include "utility.h"
+#include "instrument.h"
+#include "sweep.h"
+#include "coherence.h"
 
 using namespace std;
 using namespace utils;
@@ -11,15 +19,33 @@ int main(int argc, char *argv[]) {
 	int opt;
 	string data_file;
 	string cluster_file;
+	string constraint_file;
 	string z_file;
 	string vocab_file;
 	string output_path;
 	int num_words, num_topics;
+	vector<int> topic_counts;
+	bool split_init = false;
 	double alpha, beta, eta;
 	int rand_seed;
 	int epochs;
+	int num_threads = 1;
+	bool sparse_theta = false;
+	bool word_major = false;
+	bool group_words = false;
+	bool block_rotation = false;
+	bool data_parallel = false;
+	bool hogwild = false;
+	bool numa_aware = false;
+	double phi_mass = 0;
+	bool phi_log8 = false;
+	bool bundle = false;
+	string count_server;
+	int worker_id = 0, num_workers = 1, syncs_per_epoch = 1;
+	string metrics_file;
+	vector<string> measures;
 
-	const char *optstring = "f:v:c:z:t:w:a:b:e:n:r:o:";
+	const char *optstring = "f:v:c:C:z:t:w:a:b:e:n:r:o:j:sm:SWGRDHNE:Q:LBP:i:y:";
 
 	while( (opt = getopt(argc, argv, optstring)) != -1){
 
@@ -33,12 +59,31 @@ int main(int argc, char *argv[]) {
 			case 'c':
 				cluster_file = optarg;
 				break;
+			case 'C': //pairwise must-link / cannot-link constraints instead of clusters
+				constraint_file = optarg;
+				break;
 			case 'z':
 				z_file = optarg;
 				break;
-			case 't':
-				num_topics = atoi(optarg);
+			case 't':{ //a single K, or a comma separated list to sweep
+				stringstream list(optarg);
+				string tok;
+				while(getline(list, tok, ',')){
+					char *end;
+					long k = strtol(tok.c_str(), &end, 10);
+					if(tok.empty() || *end != '\0' || k < 1 || k > INT_MAX){
+						cerr <<"-t takes positive numbers of topics, not \"" << tok << "\"" << endl;
+						return -1;
+					}
+					topic_counts.push_back(k);
+				}
+				if(topic_counts.empty()){
+					cerr <<"-t needs at least one number of topics" << endl;
+					return -1;
+				}
+				num_topics = topic_counts[0];
 				break;
+			}
 			case 'w':
 				num_words = atoi(optarg);
 				break;
@@ -60,6 +105,61 @@ int main(int argc, char *argv[]) {
 			case 'o':
 				output_path = optarg;
 				break;
+			case 'j':
+				num_threads = atoi(optarg);
+				break;
+			case 's':
+				sparse_theta = true;
+				break;
+			case 'm':
+				metrics_file = optarg;
+				break;
+			case 'S':
+				split_init = true;
+				break;
+			case 'W': //word-major sampling order
+				word_major = true;
+				break;
+			case 'G': //documents sampled word by word, reusing tree values for repeated words
+				group_words = true;
+				break;
+			case 'R': //multithreaded epochs by doc x vocabulary block rotation (needs -j)
+				block_rotation = true;
+				break;
+			case 'D': //multithreaded epochs on stale count copies with work stealing (needs -j)
+				data_parallel = true;
+				break;
+			case 'H': //as -D, on one shared copy of the counts with atomic updates
+				hogwild = true;
+				break;
+			case 'N': //NUMA-aware -D/-H: pinned threads, node-local shards and count replicas
+				numa_aware = true;
+				break;
+			case 'E':{ //coherence measures to evaluate, comma separated (u_mass, c_uci, c_npmi, c_v)
+				stringstream list(optarg);
+				string tok;
+				while(getline(list, tok, ','))
+					measures.push_back(tok);
+				break;
+			}
+			case 'Q': //also save phi.sparse, keeping this share of each topic's mass (e.g. 0.95)
+				phi_mass = atof(optarg);
+				break;
+			case 'L': //phi.sparse with 8-bit log codes instead of float16
+				phi_log8 = true;
+				break;
+			case 'B': //also save the whole model as one mappable file, model.bundle
+				bundle = true;
+				break;
+			case 'P': //train as one worker of a count server (paramserver), at host:port or a socket path
+				count_server = optarg;
+				break;
+			case 'i': //this worker's index and the number of workers, e.g. 0/4
+				sscanf(optarg, "%d/%d", &worker_id, &num_workers);
+				break;
+			case 'y': //count server rounds per epoch
+				syncs_per_epoch = max(1, atoi(optarg));
+				break;
 			default:
 				cerr <<"unknown option: " << char(optopt) << endl;
 				return -1;
@@ -67,12 +167,50 @@ int main(int argc, char *argv[]) {
 
 	}
 
+    if(!metrics_file.empty())
+        instrument::metrics.open(metrics_file);
+
     Estimator est(alpha, beta, eta, num_topics, num_words, rand_seed);
+    est.num_threads = num_threads;
+    est.sparse_theta = sparse_theta;
+    est.constraint_file = constraint_file;
+    est.word_major = word_major;
+    est.group_words = group_words;
+    est.block_rotation = block_rotation;
+    est.data_parallel = data_parallel;
+    est.hogwild = hogwild;
+    est.numa_aware = numa_aware;
+    est.phi_mass = phi_mass;
+    est.phi_log8 = phi_log8;
+    est.bundle = bundle;
+    est.count_server = count_server;
+    est.worker_id = worker_id;
+    est.num_workers = num_workers;
+    est.syncs_per_epoch = syncs_per_epoch;
+    if(!count_server.empty() && num_workers > 1){ //every worker saves its shard of theta and z
+        output_path += "w" + to_string(worker_id) + "_";
+    }
 	cout << "loading data - train.cpp" << endl;
+    unique_ptr<Coherence> coherence; //indexed once, after the corpus is in
+    if(topic_counts.size() > 1 && !count_server.empty()){
+        cerr << "a sweep (-t with several numbers of topics) cannot run on a count server" << endl;
+        return -1;
+    }
+    if(topic_counts.size() > 1){
+        est.load_corpus(data_file, cluster_file, vocab_file);
+        if(!measures.empty())
+            coherence.reset(new Coherence(est.docs, est.num_words, measures, num_threads));
+        sweep(est, topic_counts, z_file, epochs, output_path, split_init, coherence.get());
+        return 0;
+    }
     est.load_data(data_file, z_file, cluster_file, vocab_file);
     est.estimate(epochs);
 
     est.save(output_path);
+    if(!measures.empty()){
+        coherence.reset(new Coherence(est.docs, est.num_words, measures, num_threads));
+        save_eval(est, output_path, coherence.get());
+    }
 
 	return 0;
 }
@@ -80,8 +218,10 @@ int main(int argc, char *argv[]) {
 /*
  * This file is the main entry point for training a topic model using the Estimator class.
  * It parses command-line arguments to set various parameters such as the data file, vocabulary file,
- * cluster file, number of topics, number of words, alpha, beta, eta, number of epochs, random seed, 
- * and output path. After parsing the arguments, it initializes an Estimator object with these parameters.
+ * cluster file (or -C, a file of pairwise ml/cl constraints), number of topics, number of words, alpha, beta, eta, number of epochs, random seed, 
+ * output path, number of threads, whether theta is saved sparse, the sampling order (-W word-major, -G grouped by word within documents, -R block rotation, -D data-parallel or -H Hogwild over the -j threads, -N to make -D/-H NUMA-aware), an optional metrics file, the coherence measures (-E) to report in eval.dat, a compressed serving copy of phi (-Q mass, -L for 8-bit codes) a single-file model bundle (-B), and distributed training as worker -i id/count of a count server (-P address, -y rounds per epoch). After parsing the arguments, it initializes an Estimator object with these parameters.
  * The Estimator object then loads the data, performs the estimation process for the specified number of epochs,
- * and finally saves the results to the specified output path.
+ * and finally saves the results to the specified output path. When -t lists several numbers of topics,
+ * the corpus is loaded once and a sweep trains one model per number of topics (-S warm-starts each
+ * model by splitting the topics of the previous one).
  */
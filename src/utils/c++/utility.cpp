@@ -2,12 +2,37 @@
 #include <cmath>
 #include <numeric>
 #include <fstream>
+#include <thread>
+#include <map>
+#include <mutex>
+#include <deque>
 
 #include "utility.h"
 
 namespace utils{
 
-int log_mult_sample(vector<double> vals){
+Random::Random(unsigned long long seed):state(seed){}
+
+void Random::seed(unsigned long long seed){
+	state = seed;
+}
+
+unsigned long long Random::next(){
+	unsigned long long z = (state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+double Random::uniform(){
+	return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int Random::below(int n){
+	return int(uniform() * n);
+}
+
+int log_mult_sample(vector<double> vals, Random &rng){
 	double maxval =vals[0];
 	for(int vi = 0; vi < vals.size(); vi++){
 		if(vals[vi] > maxval)
@@ -20,12 +45,13 @@ int log_mult_sample(vector<double> vals){
 		newvals.push_back(t);
 		normsum += t;
 	}
-	return mult_sample(newvals, normsum);
+	return mult_sample(newvals, normsum, rng);
 }
 
-int mult_sample(vector<double> vals, double norm_sum){
+template<class T>
+static int mult_sample_of(const vector<T> &vals, double norm_sum, Random &rng){
 
-	double r = rand() / double(RAND_MAX) * norm_sum;
+	double r = rng.uniform() * norm_sum;
 	double tmp_sum = 0.0;
 	int j = 0;
 	while(tmp_sum < r || j == 0){
@@ -35,7 +61,15 @@ int mult_sample(vector<double> vals, double norm_sum){
 	return j-1;
 }
 
-int getIndex(vector<int> v, int K){
+int mult_sample(const vector<double> &vals, double norm_sum, Random &rng){
+	return mult_sample_of(vals, norm_sum, rng);
+}
+
+int mult_sample(const vector<float> &vals, double norm_sum, Random &rng){
+	return mult_sample_of(vals, norm_sum, rng);
+}
+
+int getIndex(const vector<int> &v, int K){
     auto it = find(v.begin(), v.end(), K);
 
     // If element was found
@@ -97,12 +131,153 @@ void save_sample(string filename, vector<vector<int>> samples) {
   file.close();
 }
 
+// CSR text format, one row per line after a "num_rows num_cols nnz alpha" header:
+//   row_len nnz col:count col:count ...
+// the dense value of a row is (count + alpha) / (row_len + num_cols * alpha).
+void save_sparse_counts(string filename, const vector<vector<doc_count_t>> &counts,
+    const vector<int> &row_lens, double alpha) {
+  ofstream file(filename.c_str());
+  int row = counts.size();
+  int col = row > 0 ? counts[0].size() : 0;
+  long long nnz = 0;
+  for(int i = 0; i < row; ++i)
+    for(int j = 0; j < col; ++j)
+      if(counts[i][j] != 0)
+        nnz++;
+
+  file.precision(17);
+  file << row << " " << col << " " << nnz << " " << alpha << endl;
+  for(int i = 0; i < row; ++i) {
+    int row_nnz = 0;
+    for(int j = 0; j < col; ++j)
+      if(counts[i][j] != 0)
+        row_nnz++;
+    file << row_lens[i] << " " << row_nnz;
+    for(int j = 0; j < col; ++j) {
+      if(counts[i][j] != 0)
+        file << " " << j << ":" << counts[i][j];
+    }
+    file << endl;
+  }
+  file.close();
+}
+
+LgammaTable::LgammaTable(double prior, int size):prior(prior),vals(size){
+	double base = lgamma(prior);
+	for(int n = 0; n < size; n++)
+		vals[n] = lgamma(prior + n) - base;
+}
+
+const LgammaTable *lgamma_table(double prior){
+	static map<double, LgammaTable*> tables;
+	static mutex tables_mutex;
+	lock_guard<mutex> lock(tables_mutex);
+	LgammaTable *&table = tables[prior];
+	if(table == NULL)
+		table = new LgammaTable(prior, 4096); //counts past the table fall back to lgamma
+	return table;
+}
+
+bool read_file(string filename, string &text){
+	ifstream file(filename, ios::binary);
+	if(file.fail())
+		return false;
+	file.seekg(0, ios::end);
+	text.resize(file.tellg());
+	file.seekg(0, ios::beg);
+	file.read(&text[0], text.size());
+	return true;
+}
+
+vector<size_t> line_chunks(const string &text, int num_parts){
+	vector<size_t> bounds(num_parts + 1, text.size());
+	bounds[0] = 0;
+	for(int p = 1; p < num_parts; p++){
+		size_t at = max(bounds[p - 1], text.size() * p / num_parts);
+		if(at > 0 && at < text.size() && text[at - 1] != '\n'){
+			at = text.find('\n', at);
+			at = at == string::npos ? text.size() : at + 1;
+		}
+		bounds[p] = at;
+	}
+	return bounds;
+}
+
+void parallel_for(int begin, int end, int num_threads, const function<void(int)> &fn) {
+  if(num_threads <= 1 || end - begin <= 1){
+    for(int i = begin; i < end; i++)
+      fn(i);
+    return;
+  }
+  if(num_threads > end - begin)
+    num_threads = end - begin;
+
+  // thread t takes indexes begin+t, begin+t+num_threads, ...
+  vector<thread> workers;
+  for(int t = 0; t < num_threads; t++){
+    workers.push_back(thread([&, t](){
+      for(int i = begin + t; i < end; i += num_threads)
+        fn(i);
+    }));
+  }
+  for(int t = 0; t < num_threads; t++)
+    workers[t].join();
+}
+
+void parallel_steal(int num_tasks, int num_threads, const function<void(int, int)> &fn) {
+  if(num_threads > num_tasks)
+    num_threads = num_tasks;
+  if(num_threads <= 1){
+    for(int i = 0; i < num_tasks; i++)
+      fn(i, 0);
+    return;
+  }
+
+  // thread t owns a contiguous run of tasks and takes them from the front; once it runs dry it
+  // steals single tasks from the back of the other threads' runs
+  vector<deque<int>> queues(num_threads);
+  vector<mutex> locks(num_threads);
+  for(int t = 0; t < num_threads; t++)
+    for(int i = (long long)num_tasks * t / num_threads; i < (long long)num_tasks * (t + 1) / num_threads; i++)
+      queues[t].push_back(i);
+
+  vector<thread> workers;
+  for(int t = 0; t < num_threads; t++){
+    workers.push_back(thread([&, t](){
+      while(true){
+        int task = -1;
+        {
+          lock_guard<mutex> lock(locks[t]);
+          if(!queues[t].empty()){
+            task = queues[t].front();
+            queues[t].pop_front();
+          }
+        }
+        for(int v = 1; task < 0 && v < num_threads; v++){
+          int victim = (t + v) % num_threads;
+          lock_guard<mutex> lock(locks[victim]);
+          if(!queues[victim].empty()){
+            task = queues[victim].back();
+            queues[victim].pop_back();
+          }
+        }
+        if(task < 0) // no task is ever added, so empty queues everywhere means done
+          return;
+        fn(task, t);
+      }
+    }));
+  }
+  for(int t = 0; t < num_threads; t++)
+    workers[t].join();
+}
+
 }
 
 /*
  * This file contains utility functions for various mathematical and data manipulation tasks.
  * 
  * Functions included:
+ * - Random: A small seedable generator used for all sampling, so independent chains and threads do not share rand().
  * - log_mult_sample: Computes a sample from a log-transformed multinomial distribution.
  * - mult_sample: Samples an index from a multinomial distribution given the probabilities and their sum.
  * - getIndex: Finds the index of a given element in a vector of integers.
@@ -110,4 +285,9 @@ void save_sample(string filename, vector<vector<int>> samples) {
  * - sort_indexes: Returns the indices that would sort a vector of doubles in descending order.
  * - save_matrix: Saves a 2D matrix of doubles to a file.
  * - save_sample: Saves a 2D matrix of integers (samples) to a file.
+ * - save_sparse_counts: Saves the nonzero entries of a count matrix as CSR rows, with the smoothing needed to rebuild dense values.
+ * - LgammaTable / lgamma_table: Tabulated lgamma(prior + n) - lgamma(prior), cached once per prior value.
+ * - read_file / line_chunks: Reads a file in one go and cuts it into runs of whole lines for parallel parsing.
+ * - parallel_for: Runs a function over an index range, spread across a number of threads.
+ * - parallel_steal: Runs a list of uneven tasks on a number of threads, with idle threads stealing queued tasks.
  */
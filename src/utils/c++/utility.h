@@ -3,17 +3,70 @@
 
 #include <iostream>
 #include <vector>
+#include <functional>
+#include <string>
+#include <cmath>
 using namespace std;
 
+// Count and probability types, fixed per build. The Dirichlet priors are kept apart from the counts
+// (orig_edge_weights), so counts are exact integers:
+//   count_t      topic counts over the tree (TopicCounts); 16 bits with -DSTABLELDA_COUNT16, which
+//                halves their memory but needs a corpus of fewer than 65536 tokens
+//   doc_count_t  document-topic counts (nd); 16 bits with -DSTABLELDA_DOC_COUNT16, for documents of
+//                fewer than 65536 tokens, which halves the largest count array of a big corpus
+//   prob_t       per-topic sampling probabilities; float with -DSTABLELDA_FLOAT
+// Estimator::init_counts checks that the corpus fits the count types it was built with.
+#ifdef STABLELDA_COUNT16
+typedef unsigned short count_t;
+#else
+typedef int count_t;
+#endif
+#ifdef STABLELDA_DOC_COUNT16
+typedef unsigned short doc_count_t;
+#else
+typedef int doc_count_t;
+#endif
+#ifdef STABLELDA_FLOAT
+typedef float prob_t;
+#else
+typedef double prob_t;
+#endif
+
 namespace utils{
 
-	int log_mult_sample(vector<double> vals);
+	class Random { //splitmix64; each estimator (and later each thread) owns one instead of sharing rand()
+	public:
+		Random(unsigned long long seed = 1);
+		void seed(unsigned long long seed);
+		unsigned long long next();
+		double uniform(); //[0, 1)
+		int below(int n); //[0, n)
+	private:
+		unsigned long long state;
+	};
+
+	class LgammaTable { //lgamma(prior + n) - lgamma(prior) for integer counts n, tabulated for small n
+	public:
+		double prior;
+		vector<double> vals;
+
+		LgammaTable(double prior, int size);
+		double operator()(int n) const{
+			return n < (int)vals.size() ? vals[n] : lgamma(prior + n) - lgamma(prior);
+		}
+	};
+
+	//one read-only table per distinct prior, shared by every node and never freed
+	const LgammaTable *lgamma_table(double prior);
+
+	int log_mult_sample(vector<double> vals, Random &rng);
 
-	int mult_sample(vector<double> vals, double norm_sum);
+	int mult_sample(const vector<double> &vals, double norm_sum, Random &rng);
+	int mult_sample(const vector<float> &vals, double norm_sum, Random &rng);
 
 	void normalize(vector<double> &vals, double norm_sum);
 
-	int getIndex(vector<int> v, int K);
+	int getIndex(const vector<int> &v, int K);
 
 	vector<int> sort_indexes(const vector<double> &v);
 
@@ -21,5 +74,18 @@ namespace utils{
 
 	void save_sample(string filename, vector<vector<int>> samples);
 
+	void save_sparse_counts(string filename, const vector<vector<doc_count_t>> &counts,
+			const vector<int> &row_lens, double alpha);
+
+	bool read_file(string filename, string &text); //whole file into text, false if it cannot be opened
+
+	//num_parts + 1 offsets cutting text into runs of whole lines of about equal size
+	vector<size_t> line_chunks(const string &text, int num_parts);
+
+	void parallel_for(int begin, int end, int num_threads, const function<void(int)> &fn);
+
+	//runs fn(task, thread) for every task in [0, num_tasks) on a work-stealing pool
+	void parallel_steal(int num_tasks, int num_threads, const function<void(int, int)> &fn);
+
 };
 #endif /* UTILITY_H_ */
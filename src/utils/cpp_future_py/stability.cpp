@@ -13,6 +13,7 @@
 #include <functional>
 #include <Eigen/Dense>
 #include <unsupported/Eigen/MatrixFunctions>
+#include "../c++/coherence.h"
 
 using namespace std;
 using namespace Eigen;
@@ -79,6 +80,57 @@ public:
     }
 };
 
+// theta kept as document-topic counts (the CSR rows written by train -s).
+// row i holds the nonzero topics in indices[indptr[i]..indptr[i+1]), and
+// theta(i, k) = (count + alpha) / (doc_len + num_topics * alpha).
+class SparseTheta {
+public:
+    int num_docs;
+    int num_topics;
+    double alpha;
+    vector<int> indptr;
+    vector<int> indices;
+    vector<int> counts;
+    vector<int> doc_lens;
+
+    double base(int i) const {
+        return alpha / (doc_lens[i] + num_topics * alpha);
+    }
+
+    double value(int i, int k) const {
+        for (int p = indptr[i]; p < indptr[i + 1]; ++p) {
+            if (indices[p] == k) {
+                return (counts[p] + alpha) / (doc_lens[i] + num_topics * alpha);
+            }
+        }
+        return base(i);
+    }
+
+    // argmax of a row is its largest count, lowest topic on ties (as for the dense theta)
+    int label(int i) const {
+        int best = 0;
+        int best_count = 0;
+        for (int p = indptr[i]; p < indptr[i + 1]; ++p) {
+            if (counts[p] > best_count || (counts[p] == best_count && indices[p] < best)) {
+                best = indices[p];
+                best_count = counts[p];
+            }
+        }
+        return best;
+    }
+
+    MatrixXd to_dense() const {
+        MatrixXd theta(num_docs, num_topics);
+        for (int i = 0; i < num_docs; ++i) {
+            theta.row(i).setConstant(base(i));
+            for (int p = indptr[i]; p < indptr[i + 1]; ++p) {
+                theta(i, indices[p]) = (counts[p] + alpha) / (doc_lens[i] + num_topics * alpha);
+            }
+        }
+        return theta;
+    }
+};
+
 MatrixXd computeMatrix(TopicModel& tm1, TopicModel& tm2) {
     if (tm1.num_topics != tm2.num_topics) {
         throw invalid_argument("two topic models have different topics");
@@ -137,6 +189,59 @@ double doc_stability(TopicModel& tm1, TopicModel& tm2, unordered_map<int, int>&
     return accumulate(index_match_bool.begin(), index_match_bool.end(), 0.0) / index_match_bool.size();
 }
 
+// same as theta_stability, but only touches the nonzero topics of each row:
+// topics that are zero in both rows all differ by |base1 - base2|.
+double theta_stability(const SparseTheta& th1, const SparseTheta& th2, unordered_map<int, int>& alignment) {
+    if (th1.num_docs != th2.num_docs || th1.num_topics != th2.num_topics) {
+        throw invalid_argument("two sparse thetas have different shapes");
+    }
+    double total = 0.0;
+    vector<pair<int, double>> row1;
+    vector<pair<int, double>> row2;
+    for (int i = 0; i < th1.num_docs; ++i) {
+        double norm1 = th1.doc_lens[i] + th1.num_topics * th1.alpha;
+        double norm2 = th2.doc_lens[i] + th2.num_topics * th2.alpha;
+        double base1 = th1.base(i);
+        double base2 = th2.base(i);
+
+        row1.clear();
+        row2.clear();
+        for (int p = th1.indptr[i]; p < th1.indptr[i + 1]; ++p) {
+            row1.push_back(make_pair(alignment[th1.indices[p]], (th1.counts[p] + th1.alpha) / norm1));
+        }
+        for (int p = th2.indptr[i]; p < th2.indptr[i + 1]; ++p) {
+            row2.push_back(make_pair(th2.indices[p], (th2.counts[p] + th2.alpha) / norm2));
+        }
+        sort(row1.begin(), row1.end());
+        sort(row2.begin(), row2.end());
+
+        double dist = 0.0;
+        int touched = 0;
+        size_t a = 0, b = 0;
+        while (a < row1.size() || b < row2.size()) {
+            if (b == row2.size() || (a < row1.size() && row1[a].first < row2[b].first)) {
+                dist += abs(row1[a++].second - base2);
+            } else if (a == row1.size() || row2[b].first < row1[a].first) {
+                dist += abs(base1 - row2[b++].second);
+            } else {
+                dist += abs(row1[a++].second - row2[b++].second);
+            }
+            touched++;
+        }
+        dist += (th1.num_topics - touched) * abs(base1 - base2);
+        total += 1 - 0.5 * dist;
+    }
+    return total / th1.num_docs;
+}
+
+double doc_stability(const SparseTheta& th1, const SparseTheta& th2, unordered_map<int, int>& alignment) {
+    double matches = 0.0;
+    for (int i = 0; i < th1.num_docs; ++i) {
+        matches += (th1.label(i) == alignment[th2.label(i)]);
+    }
+    return matches / th1.num_docs;
+}
+
 double phi_stability(TopicModel& tm1, TopicModel& tm2, unordered_map<int, int>& alignment) {
     vector<double> l1_distances;
     for (int k = 0; k < tm1.num_topics; ++k) {
@@ -181,10 +286,32 @@ double compute_perplexity(vector<vector<int>>& bow, MatrixXd& theta, MatrixXd& p
     return exp(-loglikelihood / wordcount);
 }
 
+// coherence of topics (top word ids) against an index built once for the corpus; build one
+// Coherence with every measure needed and pass it here for each model, seed and K evaluated.
+double compute_coherence(const Coherence& coherence, vector<vector<int>>& topics, string coherence_score = "c_npmi", int num_threads = 1) {
+    return coherence.score(topics, coherence_score, num_threads);
+}
+
+// same arguments as the python version; gensim_bow is not needed, the token order of text gives
+// both the document (u_mass) and the sliding window (c_uci, c_npmi, c_v) co-occurrences.
 double compute_coherence(vector<vector<int>>& gensim_bow, vector<vector<string>>& text, unordered_map<int, string>& id2word, vector<vector<int>>& topics, string coherence_score = "c_npmi") {
-    // Implement coherence model calculation
-    // ...
-    return 0.0;
+    unordered_map<string, int> word2id;
+    int num_words = 0;
+    for (const auto& entry : id2word) {
+        word2id[entry.second] = entry.first;
+        num_words = max(num_words, entry.first + 1);
+    }
+    vector<vector<int>> docs(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        for (const string& word : text[i]) {
+            auto it = word2id.find(word);
+            if (it != word2id.end()) {
+                docs[i].push_back(it->second);
+            }
+        }
+    }
+    Coherence coherence(docs, num_words, vector<string>(1, coherence_score));
+    return compute_coherence(coherence, topics, coherence_score);
 }
 
 tuple<vector<vector<int>>, vector<string>, MatrixXd, MatrixXd> load_topic_model_results(string doc_path, string vocab_path, string theta_path, string phi_path) {
@@ -249,4 +376,33 @@ tuple<vector<vector<int>>, vector<string>, MatrixXd, MatrixXd> load_topic_model_
     }
 
     return make_tuple(docs, vocab, theta, phi);
-}
\ No newline at end of file
+}
+
+// reads theta.csr.dat: a "num_docs num_topics nnz alpha" header, then one
+// "doc_len nnz topic:count ..." line per document.
+SparseTheta load_sparse_theta(string theta_path) {
+    SparseTheta theta;
+    ifstream theta_file(theta_path);
+    long long nnz = 0;
+    theta_file >> theta.num_docs >> theta.num_topics >> nnz >> theta.alpha;
+
+    theta.indptr.reserve(theta.num_docs + 1);
+    theta.indices.reserve(nnz);
+    theta.counts.reserve(nnz);
+    theta.doc_lens.reserve(theta.num_docs);
+    theta.indptr.push_back(0);
+    for (int i = 0; i < theta.num_docs; ++i) {
+        int doc_len, row_nnz;
+        theta_file >> doc_len >> row_nnz;
+        for (int p = 0; p < row_nnz; ++p) {
+            int k, count;
+            char sep;
+            theta_file >> k >> sep >> count;
+            theta.indices.push_back(k);
+            theta.counts.push_back(count);
+        }
+        theta.doc_lens.push_back(doc_len);
+        theta.indptr.push_back(theta.indices.size());
+    }
+    return theta;
+}
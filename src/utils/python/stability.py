@@ -1,4 +1,5 @@
 # this scripts evaluate topic model stability
+import os
 import numpy as np
 from gensim.models import CoherenceModel
 from scipy.optimize import linear_sum_assignment
@@ -143,6 +144,25 @@ def compute_coherence(gensim_bow, text, id2word, topics, coherence_score='c_npmi
     cm = CoherenceModel(topics=topics, corpus=gensim_bow, texts=text, dictionary=id2word, coherence=coherence_score)
     return cm.get_coherence()
 
+def pair_similarity(theta, post_idx, answer_idx, measure='cosine', work_dir='.', num_threads=4):
+    '''
+    compares the topic vectors of many document pairs in one call to the C++ pairsim program.
+    theta: the path of theta.dat, theta.csr.dat or a .npy matrix, or the rows themselves (saved to work_dir as .npy)
+    measure: 'cosine' (similarity, 1 - scipy's cosine distance), 'hellinger', 'js' (Jensen-Shannon divergence) or 'l1'
+    returns an array with one value per (post_idx, answer_idx) pair.
+    '''
+    cmd = 'pairsim'    # windows
+    # cmd = './pairsim'  # linux
+    if not isinstance(theta, str):
+        theta_path = os.path.join(work_dir, 'pairsim_theta.npy')
+        np.save(theta_path, np.asarray(theta, dtype=np.float64))
+        theta = theta_path
+    pair_path = os.path.join(work_dir, 'pairsim_pairs.txt')
+    np.savetxt(pair_path, np.column_stack([post_idx, answer_idx]), fmt='%d')
+    prefix = os.path.join(work_dir, 'pairsim_')
+    os.system('{} -i {} -p {} -m {} -o {} -j {} -n'.format(cmd, theta, pair_path, measure, prefix, num_threads))
+    return np.load(prefix + measure + '.npy')
+
 def load_topic_model_results(doc_path, vocab_path, theta_path, phi_path): #load a trained topic model
     docs, vocab, theta, phi = [], [], [], []
     vocab2id = {}